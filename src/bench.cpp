@@ -0,0 +1,608 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rtcwake-compact.h"
+#include "rtcwake-schedule.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// the regex based parser as it was before the scanner. Kept here to compare
+// against it.
+namespace legacy
+{
+using namespace rtc;
+
+duration_t to_hour_duration(std::string s)
+{
+	std::regex ex("([0-2][0-9]):([0-5][0-9])");
+	std::smatch what;
+	if (std::regex_match(s, what, ex))
+	{
+		auto h = std::atol(what[1].str().c_str());
+		auto m = std::atol(what[2].str().c_str());
+		return hours(h) + minutes(m);
+	}
+	else
+	{
+		std::string msg = "to_hour_duration(): Unrecognized string: " + s;
+		throw std::runtime_error(msg);
+	}
+}
+
+template <typename inserter_t>
+cmd_t read_schedule(inserter_t inserter, std::istream& is,
+					const time_point_t now)
+{
+	auto week_start = get_week_start(now);
+
+	// clang-format off
+	std::regex ex_action("(Mon|Tue|Wed|Thu|Fri|Sat|Sun):([0-2][0-9]):([0-5][0-9])\\-(Mon|Tue|Wed|Thu|Fri|Sat|Sun):([0-2][0-9]):([0-5][0-9])( |\t|#.*)*");
+	// clang-format on
+	std::regex ex_comment("^(#.*)|( |\\t)*");
+	std::regex ex_stay_awake("CheckStayAwake=(.*)");
+	std::regex ex_power_down("PowerDown=(.*)");
+
+	cmd_t cmd;
+
+	std::string line;
+	std::smatch what;
+	while (std::getline(is, line))
+	{
+		if (std::regex_match(line, what, ex_action))
+		{
+			std::string start_day = what[1].str();
+			std::string start_time = what[2].str() + ":" + what[3].str();
+
+			std::string end_day = what[4].str();
+			std::string end_time = what[5].str() + ":" + what[6].str();
+
+			time_point_t on = week_start;
+			time_point_t off = on;
+
+			on += to_hour_duration(start_time);
+			on += to_day_duration(start_day);
+
+			off += to_hour_duration(end_time);
+			off += to_day_duration(end_day);
+
+			if (off < on)
+			{
+				inserter = {week_start, off};
+				off += hours(7 * 24);
+			}
+
+			inserter = {on, off};
+		}
+		else if (std::regex_match(line, what, ex_comment))
+		{
+		}
+		else if (std::regex_match(line, what, ex_power_down))
+		{
+			cmd.power_down = what[1].str();
+		}
+		else if (std::regex_match(line, what, ex_stay_awake))
+		{
+			cmd.check_stay_awake.push_back(what[1].str());
+		}
+		else
+		{
+			std::string msg =
+				"read_schedule(): Unrecognized syntax at line: " + line;
+			throw std::runtime_error(msg);
+		}
+	}
+
+	return cmd;
+}
+
+// the O(n^2) validation as it was before the sweep line
+template <typename iterator_t>
+void check_schedule(iterator_t begin, iterator_t end)
+{
+	auto pos1 = std::adjacent_find(
+		begin, end, [](const action_t& a1, const action_t& a2) -> bool
+		{ return a1.off > a2.on; });
+	if (pos1 != end)
+	{
+		throw std::runtime_error(
+			"check_schedule: next off time < current on time");
+	}
+
+	auto pos2 = std::find_if(begin, end,
+							 [](const action_t& a) -> bool
+							 {
+								 if (!(a.off > a.on))
+									 return false;
+								 return (a.off - a.on) > hours(24 * 7);
+							 });
+	if (pos2 != end)
+	{
+		throw std::runtime_error("check_schedule: off time < on time");
+	}
+
+	auto pos3 = std::find_if(begin, end,
+							 [begin, end](const action_t& a) -> bool
+							 {
+								 auto p = std::find_if(
+									 begin, end,
+									 [a](const action_t& b) -> bool
+									 {
+										 if (a == b)
+											 return false;
+										 return (a.on >= b.on && a.on <= b.off);
+									 });
+								 return p != end;
+							 });
+	if (pos3 != end)
+	{
+		throw std::runtime_error("check_schedule: overlaping schedules");
+	}
+}
+} // namespace legacy
+
+// count the allocations of the benchmarked code. gcc sees free() of the
+// pointer from our operator new once both are inlined and warns.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace
+{
+std::size_t g_allocations = 0;
+}
+
+void* operator new(std::size_t size)
+{
+	++g_allocations;
+	if (void* p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+using namespace rtc;
+
+struct result_t
+{
+	std::string benchmark;
+	std::string engine;
+	std::size_t size;
+	std::string distribution;
+	double ns_per_op;
+	double allocs_per_op;
+	double ops_per_sec;
+};
+
+// keeps the compiler from dropping the benchmarked code
+volatile std::size_t g_sink = 0;
+
+void sink(bool v) { g_sink = g_sink + (v ? 1 : 0); }
+void sink(std::size_t v) { g_sink = g_sink + v; }
+void sink(const std::string& v) { g_sink = g_sink + v.size(); }
+void sink(const time_point_t& v) { g_sink = g_sink + v.time_of_day().minutes(); }
+
+// Call fn(i) with i = 0, 1, ... until min_ms passed, at least once
+template <typename fn_t>
+result_t measure(const std::string& benchmark, const std::string& engine,
+				 std::size_t size, const std::string& distribution, fn_t fn,
+				 double min_ms = 100)
+{
+	using clock_t = std::chrono::steady_clock;
+
+	fn(0); // warm up
+
+	std::size_t ops = 0;
+	std::size_t batch = 1;
+	auto allocations = g_allocations;
+	auto start = clock_t::now();
+	double elapsed_ms = 0;
+	do
+	{
+		for (std::size_t i = 0; i < batch; ++i, ++ops)
+		{
+			fn(ops);
+		}
+		batch *= 2;
+		elapsed_ms = std::chrono::duration<double, std::milli>(clock_t::now() -
+															   start)
+						 .count();
+	} while (elapsed_ms < min_ms);
+	allocations = g_allocations - allocations;
+
+	result_t r;
+	r.benchmark = benchmark;
+	r.engine = engine;
+	r.size = size;
+	r.distribution = distribution;
+	r.ns_per_op = elapsed_ms * 1e6 / ops;
+	r.allocs_per_op = double(allocations) / ops;
+	r.ops_per_sec = ops * 1000.0 / elapsed_ms;
+	return r;
+}
+
+const time_point_t bench_now =
+	boost::posix_time::time_from_string("2019-02-19 12:43:12");
+
+// a schedule with n window lines, some comments and the commands
+std::string generate_schedule(std::size_t n, unsigned seed)
+{
+	static const char* names[] = {"Mon", "Tue", "Wed", "Thu",
+								  "Fri", "Sat", "Sun"};
+
+	std::mt19937 gen(seed);
+	std::uniform_int_distribution<int> day(0, 6);
+	std::uniform_int_distribution<int> hour(0, 23);
+	std::uniform_int_distribution<int> minute(0, 59);
+
+	std::string s = "# generated schedule\n\n";
+	char buf[64];
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		std::snprintf(buf, sizeof(buf), "%s:%02d:%02d-%s:%02d:%02d%s\n",
+					  names[day(gen)], hour(gen), minute(gen),
+					  names[day(gen)], hour(gen), minute(gen),
+					  i % 8 == 0 ? " # comment" : "");
+		s += buf;
+		if (i % 16 == 0)
+		{
+			s += "# another comment\n";
+		}
+	}
+	s += "CheckStayAwake=netstat -n | grep tcp | grep -v TIME_WAIT | wc -l\n";
+	s += "PowerDown=/usr/sbin/rtcwake -m off -s %d\n";
+	return s;
+}
+
+// n windows on full minutes spread over the week, none of them overlapping.
+// Each is on for the first half of its slot.
+std::vector<action_t> generate_minute_windows(std::size_t n)
+{
+	auto week_start = get_week_start(bench_now);
+	const std::size_t slot = week_bitmap::minutes_per_week / n;
+
+	std::vector<action_t> sched;
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		auto on = week_start + minutes(static_cast<long>(i * slot));
+		sched.push_back({on, on + minutes(static_cast<long>(slot / 2)), i + 1});
+	}
+	return sched;
+}
+
+// n short windows spread over the week, not on full minutes
+std::vector<action_t> generate_windows(std::size_t n)
+{
+	auto week_start = get_week_start(bench_now);
+
+	const std::int64_t week_us = std::int64_t(7) * 24 * 3600 * 1000000;
+	const std::int64_t span = week_us / static_cast<std::int64_t>(n);
+
+	std::vector<action_t> sched;
+	sched.reserve(n);
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		auto on = week_start + boost::posix_time::microseconds(
+								   static_cast<std::int64_t>(i) * span);
+		sched.push_back({on, on + boost::posix_time::microseconds(span / 2),
+						 i + 1});
+	}
+	return sched;
+}
+
+// like generate_windows(), in whole seconds
+std::vector<action_t> generate_second_windows(std::size_t n)
+{
+	auto week_start = get_week_start(bench_now);
+	const long span = 7 * 24 * 3600 / static_cast<long>(n);
+
+	std::vector<action_t> sched;
+	sched.reserve(n);
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		auto on = week_start + seconds(static_cast<long>(i) * span);
+		sched.push_back({on, on + seconds(span / 2), i + 1});
+	}
+	return sched;
+}
+
+// time points in the week of the schedule
+std::vector<time_point_t> generate_time_points(
+	const std::vector<action_t>& sched, const std::string& distribution)
+{
+	auto week_start = get_week_start(bench_now);
+
+	std::mt19937 gen(4711);
+	std::uniform_int_distribution<long> second(0, 7 * 24 * 3600 - 1);
+
+	std::vector<time_point_t> tps;
+	while (tps.size() < 1024)
+	{
+		auto tp = week_start + seconds(second(gen));
+		const auto& a = sched[tps.size() % sched.size()];
+
+		if (distribution == "on")
+		{
+			tp = a.on + (a.off - a.on) / 2;
+		}
+		else if (distribution == "off")
+		{
+			// outside of all windows
+			if (get_state(sched.begin(), sched.end(), tp))
+			{
+				continue;
+			}
+		}
+		else if (distribution == "edge")
+		{
+			tp = tps.size() % 2 ? a.on : a.off;
+		}
+		tps.push_back(tp);
+	}
+	return tps;
+}
+
+void bench_read_schedule(std::vector<result_t>& results)
+{
+	using inserter_t = std::back_insert_iterator<std::vector<action_t>>;
+
+	for (std::size_t n : {10u, 100u, 1000u, 10000u})
+	{
+		auto text = generate_schedule(n, 42);
+
+		std::vector<action_t> sched_legacy;
+		std::vector<action_t> sched;
+		auto parse = [&text](std::vector<action_t>& out, bool regex)
+		{
+			out.clear();
+			std::istringstream iss(text);
+			inserter_t inserter(out);
+			if (regex)
+				legacy::read_schedule(inserter, iss, bench_now);
+			else
+				rtc::read_schedule(inserter, iss, bench_now);
+		};
+
+		results.push_back(measure("read_schedule", "scanner", n, "generated",
+								  [&](std::size_t)
+								  {
+									  parse(sched, false);
+									  sink(sched.size());
+								  }));
+
+		// the regex parser needs seconds for the biggest one
+		if (n <= 1000)
+		{
+			results.push_back(measure("read_schedule", "regex", n, "generated",
+									  [&](std::size_t)
+									  {
+										  parse(sched_legacy, true);
+										  sink(sched_legacy.size());
+									  }));
+
+			if (sched_legacy != sched)
+			{
+				throw std::runtime_error("read_schedule: parsers disagree");
+			}
+		}
+	}
+}
+
+void bench_check_schedule(std::vector<result_t>& results)
+{
+	for (std::size_t n : {10u, 1000u, 100000u, 1000000u})
+	{
+		auto sched = generate_windows(n);
+
+		results.push_back(measure("check_schedule", "sweep", n, "disjoint",
+								  [&](std::size_t)
+								  {
+									  check_schedule(sched.begin(),
+													 sched.end());
+								  }));
+
+		// a million windows dont fit into the seconds of a week
+		if (n <= 100000)
+		{
+			auto whole = generate_second_windows(n);
+			compact_schedule compact(whole.begin(), whole.end(),
+									 get_week_start(bench_now));
+			results.push_back(measure("check_schedule", "compact", n,
+									  "disjoint", [&](std::size_t)
+									  { check_schedule(compact); }));
+		}
+
+		// the quadratic one takes hours for the big ones
+		if (n <= 1000)
+		{
+			results.push_back(measure(
+				"check_schedule", "nested_find_if", n, "disjoint",
+				[&](std::size_t)
+				{ legacy::check_schedule(sched.begin(), sched.end()); }));
+		}
+	}
+}
+
+void bench_lookups(std::vector<result_t>& results)
+{
+	cmd_t cmds;
+	cmds.power_down = "/usr/sbin/rtcwake -m off -s %d";
+
+	for (std::size_t n : {7u, 70u, 700u, 5040u})
+	{
+		auto sched = generate_minute_windows(n);
+		week_bitmap index(sched.begin(), sched.end(),
+						  get_week_start(bench_now));
+		compact_schedule compact(sched.begin(), sched.end(),
+								 get_week_start(bench_now));
+
+		for (const char* dist : {"uniform", "on", "edge"})
+		{
+			auto tps = generate_time_points(sched, dist);
+			results.push_back(
+				measure("get_state", "binary_search", n, dist,
+						[&](std::size_t i)
+						{
+							sink(get_state(sched.begin(), sched.end(),
+										   tps[i % tps.size()]));
+						}));
+			results.push_back(measure(
+				"get_state", "bitmap", n, dist, [&](std::size_t i)
+				{ sink(get_state(index, tps[i % tps.size()])); }));
+			results.push_back(measure(
+				"get_state", "compact", n, dist, [&](std::size_t i)
+				{ sink(get_state(compact, tps[i % tps.size()])); }));
+		}
+
+		// the off time, where a run needs them
+		auto tps = generate_time_points(sched, "off");
+		results.push_back(
+			measure("get_next_on_time", "binary_search", n, "off",
+					[&](std::size_t i)
+					{
+						sink(get_next_on_time(sched.begin(), sched.end(),
+											  tps[i % tps.size()]));
+					}));
+		results.push_back(measure(
+			"get_next_on_time", "bitmap", n, "off", [&](std::size_t i)
+			{ sink(get_next_on_time(index, tps[i % tps.size()])); }));
+		results.push_back(measure(
+			"get_next_on_time", "compact", n, "off", [&](std::size_t i)
+			{ sink(get_next_on_time(compact, tps[i % tps.size()])); }));
+
+		results.push_back(
+			measure("build_power_off_command", "binary_search", n, "off",
+					[&](std::size_t i)
+					{
+						sink(build_power_off_command(sched.begin(),
+													 sched.end(), cmds,
+													 tps[i % tps.size()]));
+					}));
+		results.push_back(
+			measure("build_power_off_command", "bitmap", n, "off",
+					[&](std::size_t i)
+					{
+						sink(build_power_off_command(index, cmds,
+													 tps[i % tps.size()]));
+					}));
+	}
+}
+
+void print_csv(const std::vector<result_t>& results)
+{
+	std::cout << "benchmark,engine,size,distribution,ns_per_op,allocs_per_op,"
+				 "ops_per_sec\n";
+	for (const auto& r : results)
+	{
+		std::cout << r.benchmark << "," << r.engine << "," << r.size << ","
+				  << r.distribution << "," << r.ns_per_op << ","
+				  << r.allocs_per_op << "," << r.ops_per_sec << "\n";
+	}
+	std::cout << std::flush;
+}
+
+void print_json(const std::vector<result_t>& results)
+{
+	std::cout << "[\n";
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		const auto& r = results[i];
+		std::cout << "  {\"benchmark\": \"" << r.benchmark
+				  << "\", \"engine\": \"" << r.engine
+				  << "\", \"size\": " << r.size << ", \"distribution\": \""
+				  << r.distribution << "\", \"ns_per_op\": " << r.ns_per_op
+				  << ", \"allocs_per_op\": " << r.allocs_per_op
+				  << ", \"ops_per_sec\": " << r.ops_per_sec << "}"
+				  << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	std::cout << "]" << std::endl;
+}
+
+void usage()
+{
+	std::cout << "Usage: rtcwake-schedule-bench [--csv|--json] [--filter "
+				 "NAME]\n"
+			  << "\t--csv\t\tprint the results as CSV (default)\n"
+			  << "\t--json\t\tprint the results as JSON\n"
+			  << "\t--filter NAME\tonly run the benchmarks NAME: "
+				 "read_schedule,\n"
+			  << "\t\t\tcheck_schedule or lookups (get_state, "
+				 "get_next_on_time\n"
+			  << "\t\t\tand build_power_off_command)\n"
+			  << std::endl;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		bool json = false;
+		std::string filter;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (arg == "--json")
+				json = true;
+			else if (arg == "--csv")
+				json = false;
+			else if (arg == "--filter" && i + 1 < argc)
+				filter = argv[++i];
+			else
+			{
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+
+		std::vector<result_t> results;
+		if (filter.empty() || filter == "read_schedule")
+			bench_read_schedule(results);
+		if (filter.empty() || filter == "check_schedule")
+			bench_check_schedule(results);
+		if (filter.empty() || filter == "lookups")
+			bench_lookups(results);
+
+		if (json)
+			print_json(results);
+		else
+			print_csv(results);
+
+		return EXIT_SUCCESS;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Error: " << ex.what() << std::endl;
+	}
+
+	return EXIT_FAILURE;
+}
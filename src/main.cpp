@@ -13,13 +13,29 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "rtcwake-cache.h"
+#include "rtcwake-daemon.h"
+#include "rtcwake-fragments.h"
+#include "rtcwake-idle.h"
+#include "rtcwake-learn.h"
+#include "rtcwake-lock.h"
+#include "rtcwake-probes.h"
+#include "rtcwake-process.h"
 #include "rtcwake-schedule.h"
+#include "rtcwake-simulate.h"
+#include "rtcwake-status.h"
+#include "rtcwake-trace.h"
+#include "rtcwake-wakealarm.h"
+#include "rtcwake-warmup.h"
 
 #include <vector>
 
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 
 namespace ours
 {
@@ -36,6 +52,7 @@ void usage()
 		<< "\tGNU General Public License for more details.\n\n"
 		<< "Usage:\n\tRun it from cron to read the schedule '" << RC_FILE_PATH << "' and execute the\n"
 		<< "\tcommand given at CheckStayAwake=... and PowerDown=...\n"
+		<< "\tThe files '" << RC_FILE_PATH << ".d/*.conf' add to the schedule.\n"
 		<< "\tIf CheckStayAwake prints on it's stdout something different than \"0\" it stays\n"
 		<< "\tawake even when its in the off time of the schedule. You can use that, to check for\n"
 		<< "\topen connections on your NAS or server.\n\n"
@@ -43,7 +60,28 @@ void usage()
 		<< "Options:\n"
 		<< "\t-h or --help\tPrint the usage information\n"
 		<< "\t-f or --force\tforce the shutdown even the CheckStayAwake reports !=0\n"
-		<< "\t-t or --test\ttest the configuration. Print the actions and states\n\n"
+		<< "\t-t or --test\ttest the configuration. Print the actions and states\n"
+		<< "\t-d or --daemon\tstay in memory and sleep until the next transition\n"
+		<< "\t\t\tinstead of running from cron. Rereads the schedule when it changes.\n"
+		<< "\t\t\tCombined with --test it logs but does not power down\n"
+		<< "\t--no-cache\tDont use the compiled schedule in '" << RC_CACHE_PATH << "'\n"
+		<< "\t--lock P\twhen the run before still holds '" << RC_LOCK_PATH << "':\n"
+		<< "\t\t\tskip (default) this run, wait for it or takeover from it\n"
+		<< "\t--lock-timeout D\thow long to wait, or to take over before SIGKILL (30s)\n"
+		<< "\t--next N\tprint the next N on and off transitions and exit\n"
+		<< "\t--status\tprint what the last run published in '" << RC_STATUS_PATH << "'\n"
+		<< "\t--learn\t\trecord whether the checks want to stay awake, each minute of the\n"
+		<< "\t\t\tweek, in '" << RC_LEARN_PATH << "'\n"
+		<< "\t--propose P\tprint the windows that cover P% of the recorded activity\n"
+		<< "\t\t\twith the fewest on hours, and exit\n"
+		<< "\t--simulate FROM TO\treplay the cron runs from FROM to TO (2026-01-01 or\n"
+		<< "\t\t\t2026-01-01T08:00) and report the on time, power cycles and gaps\n"
+		<< "\t--step D\tbetween the simulated runs, like 1m or 1h (default 1m)\n"
+		<< "\t--stay-awake FILE\tthe CheckStayAwake output in the simulation, lines of\n"
+		<< "\t\t\t'2026-03-01 10:00 1'. Without it prints \"0\"\n"
+		<< "\t--timings\tprint the time of each phase to stderr\n"
+		<< "\t--trace-json\tprint the timings, the decision and the probe outputs\n"
+		<< "\t\t\tas one JSON object per run to stdout\n\n"
 		<< std::endl;
 
 	// clang-format on
@@ -63,6 +101,19 @@ struct options
 {
 	mode_t mode = mode_t::op;
 	bool forced = false;
+	bool daemon = false;
+	bool use_cache = true;
+	bool timings = false;
+	bool trace_json = false;
+	bool status = false;  // print the status page
+	bool learn = false;	  // record the activity
+	double propose = -1;  // the availability in %, -1: dont propose
+	rtc::lock_options_t lock;
+	std::size_t next = 0; // transitions to print
+
+	bool simulate = false;
+	rtc::simulation_options_t simulation;
+	std::string stay_awake_script;
 };
 
 options parse_options(int argc, char* argv[])
@@ -84,6 +135,67 @@ options parse_options(int argc, char* argv[])
 		{
 			opts.forced = true;
 		}
+		else if (arg == "-d" || arg == "--daemon")
+		{
+			opts.daemon = true;
+		}
+		else if (arg == "--no-cache")
+		{
+			opts.use_cache = false;
+		}
+		else if (arg == "--next" && i + 1 < argc &&
+				 std::atoi(argv[i + 1]) > 0)
+		{
+			opts.next = static_cast<std::size_t>(std::atoi(argv[++i]));
+		}
+		else if (arg == "--simulate" && i + 2 < argc &&
+				 rtc::parse_time_point(argv[i + 1], opts.simulation.from) &&
+				 rtc::parse_time_point(argv[i + 2], opts.simulation.to))
+		{
+			opts.simulate = true;
+			i += 2;
+		}
+		else if (arg == "--step" && i + 1 < argc &&
+				 rtc::detail::parse_duration(argv[i + 1], opts.simulation.step))
+		{
+			++i;
+		}
+		else if (arg == "--stay-awake" && i + 1 < argc)
+		{
+			opts.stay_awake_script = argv[++i];
+		}
+		else if (arg == "--lock" && i + 1 < argc &&
+				 rtc::parse_lock_policy(argv[i + 1], opts.lock.policy))
+		{
+			++i;
+		}
+		else if (arg == "--lock-timeout" && i + 1 < argc &&
+				 rtc::detail::parse_duration(argv[i + 1], opts.lock.timeout))
+		{
+			++i;
+		}
+		else if (arg == "--status")
+		{
+			opts.status = true;
+		}
+		else if (arg == "--learn")
+		{
+			opts.learn = true;
+		}
+		else if (arg == "--propose" && i + 1 < argc &&
+				 (opts.propose = std::atof(argv[i + 1])) > 0 &&
+				 opts.propose <= 100)
+		{
+			++i;
+		}
+		else if (arg == "--timings")
+		{
+			opts.timings = true;
+		}
+		else if (arg == "--trace-json")
+		{
+			opts.trace_json = true;
+		}
 		else if (arg == "-h" || arg == "--help")
 		{
 			opts.mode = mode_t::usage;
@@ -109,9 +221,13 @@ int main(int argc, char* argv[])
 	using namespace rtc;
 	using namespace ours;
 	using ours::mode_t;
+
+	options opts;
+	run_trace trace;
+	int rc = EXIT_FAILURE;
 	try
 	{
-		auto opts = parse_options(argc, argv);
+		opts = parse_options(argc, argv);
 		switch (opts.mode)
 		{
 			case mode_t::usage:
@@ -124,28 +240,131 @@ int main(int argc, char* argv[])
 				break;
 		}
 
-		// real work
-		std::ifstream ifs(RC_FILE_PATH);
+		// just read the page, nothing else
+		if (opts.status)
+		{
+#ifndef _WIN32
+			status_t s;
+			if (!status_reader(RC_STATUS_PATH).read(s))
+			{
+				throw std::runtime_error(std::string("No status in ") +
+										 RC_STATUS_PATH);
+			}
+			print_status(std::cout, s);
+			return EXIT_SUCCESS;
+#else
+			throw std::runtime_error("--status is not supported on windows");
+#endif
+		}
+
+		// what the learned activity asks for
+		if (opts.propose > 0)
+		{
+#ifndef _WIN32
+			activity_histogram h(RC_LEARN_PATH, false);
+			if (!h.is_open())
+			{
+				throw std::runtime_error(std::string("Nothing learned in ") +
+										 RC_LEARN_PATH);
+			}
+			print_proposal(std::cout,
+						   propose_schedule(h.slots(std::time(nullptr)),
+											opts.propose / 100),
+						   opts.propose / 100);
+			return EXIT_SUCCESS;
+#else
+			throw std::runtime_error("--propose is not supported on windows");
+#endif
+		}
 
-		std::vector<action_t> sched;
-		std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+#ifndef _WIN32
+		// one run at a time: a hanging check must not pile them up. The
+		// daemon keeps the lock, the cron runs skip then.
+		std::unique_ptr<instance_lock> lock;
+		if (opts.mode == mode_t::op && !opts.simulate && opts.next == 0)
+		{
+			lock.reset(new instance_lock(RC_LOCK_PATH));
+			std::string msg;
+			bool locked = lock->acquire(opts.lock, msg);
+			if (!msg.empty())
+			{
+				std::cerr << msg << std::endl;
+			}
+			if (!locked)
+			{
+				return opts.lock.policy == lock_policy_t::skip ? EXIT_SUCCESS
+															   : EXIT_FAILURE;
+			}
+			if (!opts.daemon)
+			{
+				stop_on_sigterm();
+			}
+		}
+#endif
 
-		if (opts.mode == mode_t::test)
+		if (opts.daemon)
 		{
-			std::clog << "Read schedule ..." << std::endl;
+#ifdef __linux__
+			daemon_options dopts;
+			dopts.schedule_path = RC_FILE_PATH;
+			dopts.fragment_dir = RC_FILE_PATH ".d";
+			dopts.forced = opts.forced;
+			dopts.test = opts.mode == mode_t::test;
+			dopts.timings = opts.timings;
+			dopts.trace_json = opts.trace_json;
+			dopts.state_path = RC_STATE_PATH;
+			dopts.cgroup_root = RC_CGROUP_PATH;
+			dopts.idle_path = RC_IDLE_PATH;
+			dopts.learn_path = opts.learn ? RC_LEARN_PATH : "";
+			dopts.warm_up_path = RC_WARMUP_PATH;
+			dopts.status_path = RC_STATUS_PATH;
+
+			schedule_daemon daemon(dopts);
+			daemon.run();
+#else
+			throw std::runtime_error("--daemon is only supported on linux");
+#endif
 		}
+
+		// real work
 		auto now = rtc::now();
-		auto cmds = read_schedule(back_inserter, ifs, now);
-		std::sort(sched.begin(), sched.end());
+		trace.now = now;
 
-		if (opts.mode == mode_t::test)
+		// the schedule and schedule.d/*.conf. Skip parsing and checking,
+		// when the files did not change.
+		schedule_files_t files;
+		files.schedule_path = RC_FILE_PATH;
+		files.fragment_dir = RC_FILE_PATH ".d";
+		if (opts.use_cache)
 		{
-			std::clog << "Check schedule ..." << std::endl;
+			files.cache_path = RC_CACHE_PATH;
 		}
-		check_schedule(sched.begin(), sched.end());
+
+		auto loaded = load_schedule(files, now, trace);
+		auto& compiled = loaded.compiled;
+		auto& sched = compiled.actions;
+		trace.cached = loaded.cached == loaded.sources.size();
+		trace.entries = sched.size();
 
 		if (opts.mode == mode_t::test)
 		{
+			for (const auto& source : loaded.sources)
+			{
+				std::clog << "Read schedule " << source << std::endl;
+			}
+			std::clog << loaded.cached << " of " << loaded.sources.size()
+					  << " file(s) from the cache" << std::endl;
+			if (compiled.cmds.zone.empty())
+			{
+				std::clog << "No time zone, the local times are used as they are"
+						  << std::endl;
+			}
+			else
+			{
+				std::clog << "Time zone " << compiled.cmds.zone.source().name
+						  << " with " << compiled.cmds.zone.transitions().size()
+						  << " transitions" << std::endl;
+			}
 			std::clog << "Schedule has " << sched.size() << " entries"
 					  << std::endl;
 		}
@@ -157,62 +376,182 @@ int main(int argc, char* argv[])
 			throw std::runtime_error("Empty schedule");
 		}
 
-		auto state = get_state(sched.begin(), sched.end(), now);
+		const auto& index = compiled.index;
+		const auto& cmds = compiled.cmds;
 
-		if (opts.mode == mode_t::test)
+		if (opts.simulate)
 		{
-			std::clog << "Current state after time: " << std::boolalpha << state
-					  << std::endl;
+			stay_awake_script script;
+			if (!opts.stay_awake_script.empty())
+			{
+				std::ifstream ifs(opts.stay_awake_script);
+				if (!ifs)
+				{
+					throw std::runtime_error("Can not read " +
+											 opts.stay_awake_script);
+				}
+				script.load(ifs);
+			}
+
+			opts.simulation.forced = opts.forced;
+			auto report = simulate(compiled, opts.simulation, script);
+			print_report(std::cout, opts.simulation, report);
+			return report.wrong_wake_ups == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 		}
 
-		// we could enlength the time to stay awake when this command
-		// returns != "0"
-		if (!state)
+		// just show what comes
+		if (opts.next > 0)
 		{
-			state = check_stay_awake(cmds, now);
-
-			// force the shutdown?
-			if (opts.forced)
+			for (const auto& t :
+				 get_next_transitions(index, cmds.overrides, now, opts.next))
 			{
-				state = false;
+				std::cout << to_string(t) << "\n";
 			}
+			std::cout << std::flush;
+			return EXIT_SUCCESS;
+		}
+
+		// the state lookup and building the command. The CheckStayAwake
+		// child is a phase of its own.
+		auto decide_start = run_trace::clock_t::now();
+		run_trace::clock_t::duration check_time{};
+		probe_context_t ctx;
+		ctx.state_path = RC_STATE_PATH;
+		ctx.cgroup_root = RC_CGROUP_PATH;
+		ctx.idle_path = RC_IDLE_PATH;
+		auto d = decide(index, cmds, now, opts.forced,
+						[&]()
+						{
+							auto start = run_trace::clock_t::now();
+							trace.probes = run_stay_awake_checks(cmds, ctx);
+							check_time = run_trace::clock_t::now() - start;
+							return !trace.probes.empty() &&
+								   trace.probes.back().count > 0;
+						});
+		trace.add("state",
+				  run_trace::clock_t::now() - decide_start - check_time);
+		if (!d.scheduled_on)
+		{
+			trace.add("check_stay_awake", check_time);
+		}
+
+		trace.decided = true;
+		trace.decision = d;
+		if (d.power_off)
+		{
+			trace.next_wake = d.alarm_at;
+		}
+		else if (!d.scheduled_on)
+		{
+			trace.next_wake = get_next_on_time(index, cmds.overrides, now);
 		}
+
 		if (opts.mode == mode_t::test)
 		{
+			std::clog << "Current state after time: " << std::boolalpha
+					  << d.scheduled_on << std::endl;
 			std::clog << "Current state after CheckStayAwake: "
-					  << std::boolalpha << state << std::endl;
+					  << std::boolalpha << !d.power_off << std::endl;
+			if (d.warming_up)
+			{
+				std::clog << "Woken up early for the window at "
+						  << boost::posix_time::to_simple_string(
+								 trace.next_wake)
+						  << std::endl;
+			}
+			if (d.power_off && d.alarm_at != d.wake_up_at)
+			{
+				std::clog << "Wake up at "
+						  << boost::posix_time::to_simple_string(d.alarm_at)
+						  << " for the window at "
+						  << boost::posix_time::to_simple_string(d.wake_up_at)
+						  << std::endl;
+			}
 		}
 
-		if (!state)
+#ifndef _WIN32
+		// the checks of this minute, also in the on time
+		if (opts.learn && opts.mode == mode_t::op &&
+			!learn_from_run(RC_LEARN_PATH, cmds, now, trace.probes, ctx))
 		{
-			// we need to shut down
-			auto power_off_cmd =
-				build_power_off_command(sched.begin(), sched.end(), cmds, now);
+			std::cerr << "Can not learn into " << RC_LEARN_PATH
+					  << ", is there a check?" << std::endl;
+		}
+#endif
+
+		// the machine stays up: read the WarmUp= files once
+		if (!d.power_off && opts.mode == mode_t::op)
+		{
+			warm_up_once(cmds, RC_WARMUP_PATH, trace);
+		}
+
+#ifndef _WIN32
+		// for the monitoring, before it may power down
+		if (opts.mode == mode_t::op &&
+			!status_writer(RC_STATUS_PATH)
+				 .publish(make_status(index, cmds, now, d, trace.probes)))
+		{
+			std::cerr << "Can not write the status to " << RC_STATUS_PATH
+					  << std::endl;
+		}
+#endif
+
+#ifndef _WIN32
+		// a newer run took over: it decides
+		if (stop_requested())
+		{
+			throw std::runtime_error("Stopped, a newer run took over");
+		}
+#endif
 
+		if (d.power_off)
+		{
+			// we need to shut down
 			switch (opts.mode)
 			{
 				case mode_t::op:
-					execute(power_off_cmd.c_str());
+					// the trace is written after it returned: flush it
+					// before, when it powers off right away
+					if (opts.trace_json)
+					{
+						std::cout << to_json(trace) << std::endl;
+						opts.trace_json = false;
+					}
+					forget_warm_up(RC_WARMUP_PATH);
+					trace.time("power_down",
+							   [&]() { power_down(d, cmds); });
 					break;
 
 				case mode_t::test:
 				default:
-					std::clog << "Would now execute PowerDown script: "
-							  << power_off_cmd << std::endl;
+					std::clog << "Power down: " << d.tier_reason << std::endl;
+					std::clog << "Would now execute "
+							  << describe_power_down(d, cmds) << std::endl;
 					break;
 			}
 		}
 
-		return EXIT_SUCCESS;
+		rc = EXIT_SUCCESS;
 	}
 	catch (const std::exception& ex)
 	{
 		std::cerr << "Error: " << ex.what() << std::endl;
+		trace.error = ex.what();
 	}
 	catch (...)
 	{
 		std::cerr << "Unknown exception" << std::endl;
+		trace.error = "Unknown exception";
+	}
+
+	if (opts.timings)
+	{
+		print_timings(std::clog, trace);
+	}
+	if (opts.trace_json)
+	{
+		std::cout << to_json(trace) << std::endl;
 	}
 
-	return EXIT_FAILURE;
+	return rc;
 }
@@ -0,0 +1,565 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_cache_h
+#define rtcwake_cache_h
+
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+namespace rtc
+{
+// the identity of the schedule file the cache was compiled from
+struct file_stamp_t
+{
+	std::uint64_t device = 0;
+	std::uint64_t inode = 0;
+	std::int64_t mtime_sec = 0;
+	std::int64_t mtime_nsec = 0;
+	std::uint64_t size = 0;
+	std::uint64_t hash = 0; // fnv1a of the content
+
+	bool operator==(const file_stamp_t& rhs) const
+	{
+		return device == rhs.device && inode == rhs.inode &&
+			   mtime_sec == rhs.mtime_sec && mtime_nsec == rhs.mtime_nsec &&
+			   size == rhs.size && hash == rhs.hash;
+	}
+	bool operator!=(const file_stamp_t& rhs) const { return !(*this == rhs); }
+};
+
+// the parsed, sorted and validated schedule
+struct compiled_schedule_t
+{
+	std::vector<action_t> actions;
+	cmd_t cmds;
+	week_bitmap index;
+};
+
+inline std::uint64_t fnv1a(const char* data, std::size_t size)
+{
+	std::uint64_t hash = 14695981039346656037ull;
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// parse, sort and check the schedule. The phases are added to the trace.
+compiled_schedule_t compile_schedule(std::istream& is, const time_point_t now,
+									 run_trace& trace)
+{
+	compiled_schedule_t c;
+	std::back_insert_iterator<std::vector<action_t>> inserter(c.actions);
+
+	c.cmds = trace.time("parse",
+						[&]() { return read_schedule(inserter, is, now); });
+	trace.time("sort", [&]() { std::sort(c.actions.begin(), c.actions.end()); });
+	trace.time("validate", [&]()
+			   { check_schedule(c.actions.begin(), c.actions.end()); });
+	trace.time("index",
+			   [&]()
+			   {
+				   c.index = week_bitmap(c.actions.begin(), c.actions.end(),
+										 get_week_start(now));
+			   });
+	trace.entries = c.actions.size();
+	return c;
+}
+
+compiled_schedule_t compile_schedule(std::istream& is, const time_point_t now)
+{
+	run_trace trace;
+	return compile_schedule(is, now, trace);
+}
+
+#ifndef _WIN32
+
+// The binary form of a compiled schedule. The times are stored relative to
+// the start of the week, so it stays valid in the next weeks. The date ranges
+// are absolute. The "Key=value" lines are stored as they are and applied
+// again when loading.
+//
+// header | entry_t[count] | bitmap words | range_t[ranges] | zone |
+// directives
+//
+// zone: name | path | zone_stamp_t | zone_t[zones]
+namespace cache
+{
+const char magic[8] = {'R', 'T', 'C', 'W', 'S', 'C', 'H', 'D'};
+const std::uint32_t version = 3;
+
+struct header_t
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t count;	  // of entry_t
+	std::uint32_t directives; // "Key=value" lines
+	std::uint32_t ranges;	  // of range_t
+	std::uint32_t zones;	  // of zone_t
+	std::uint32_t reserved;
+	file_stamp_t stamp;
+};
+
+struct entry_t
+{
+	std::int64_t on;  // seconds since week start
+	std::int64_t off; // seconds since week start
+	std::uint64_t line;
+};
+
+struct range_t
+{
+	std::int64_t from; // seconds since 1970-01-01 00:00 local time
+	std::int64_t to;
+	std::uint64_t line;
+	std::uint64_t on;
+};
+
+// the time zone file the zone_t came from
+struct zone_stamp_t
+{
+	std::uint64_t device;
+	std::uint64_t inode;
+	std::int64_t mtime_sec;
+	std::int64_t mtime_nsec;
+	std::uint64_t size;
+};
+
+struct zone_t
+{
+	std::int64_t at; // seconds since 1970-01-01 00:00 UTC
+	std::int32_t offset;
+	std::int32_t dst;
+};
+
+inline std::int64_t to_seconds(const time_point_t tp)
+{
+	return (tp - time_point_t(date(1970, 1, 1))).total_seconds();
+}
+
+inline time_point_t from_seconds(std::int64_t s)
+{
+	return time_point_t(date(1970, 1, 1)) + seconds(s);
+}
+
+// a read only mapping of a whole file
+class mapped_file
+{
+public:
+	explicit mapped_file(const std::string& path)
+	{
+		fd_handle fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+		if (fd < 0)
+		{
+			return;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size <= 0)
+		{
+			return;
+		}
+
+		void* p = mmap(nullptr, static_cast<std::size_t>(st.st_size),
+					   PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			return;
+		}
+
+		m_data = static_cast<const char*>(p);
+		m_size = static_cast<std::size_t>(st.st_size);
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	~mapped_file()
+	{
+		if (m_data)
+		{
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+	}
+
+	const char* data() const { return m_data; }
+	std::size_t size() const { return m_size; }
+
+private:
+	const char* m_data = nullptr;
+	std::size_t m_size = 0;
+};
+
+// bounds checked reading from the mapping
+class reader
+{
+public:
+	reader(const char* data, std::size_t size) : m_data(data), m_size(size) {}
+
+	template <typename T>
+	bool get(T& value)
+	{
+		if (m_size - m_pos < sizeof(T))
+		{
+			return false;
+		}
+		std::memcpy(&value, m_data + m_pos, sizeof(T));
+		m_pos += sizeof(T);
+		return true;
+	}
+
+	bool get(std::string& value)
+	{
+		std::uint32_t len = 0;
+		if (!get(len) || m_size - m_pos < len)
+		{
+			return false;
+		}
+		value.assign(m_data + m_pos, len);
+		m_pos += len;
+		return true;
+	}
+
+private:
+	const char* m_data;
+	std::size_t m_size;
+	std::size_t m_pos = 0;
+};
+
+template <typename T>
+void put(std::string& out, const T& value)
+{
+	out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void put(std::string& out, const std::string& value)
+{
+	put(out, static_cast<std::uint32_t>(value.size()));
+	out += value;
+}
+} // namespace cache
+
+// read the whole schedule file and stamp it
+inline bool read_file(const std::string& path, std::string& content,
+					  file_stamp_t& stamp)
+{
+	fd_handle fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return false;
+	}
+
+	content.clear();
+	char buf[4096];
+	ssize_t len;
+	while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+	{
+		content.append(buf, static_cast<std::size_t>(len));
+	}
+	if (len < 0)
+	{
+		return false;
+	}
+
+	stamp.device = st.st_dev;
+	stamp.inode = st.st_ino;
+	stamp.mtime_sec = st.st_mtim.tv_sec;
+	stamp.mtime_nsec = st.st_mtim.tv_nsec;
+	stamp.size = content.size();
+	stamp.hash = fnv1a(content.data(), content.size());
+	return true;
+}
+
+// Load the compiled schedule, when it was compiled from a file with this
+// stamp. Returns false when there is no usable cache.
+bool load_compiled_schedule(const std::string& cache_path,
+							const file_stamp_t& stamp, const time_point_t now,
+							compiled_schedule_t& out)
+{
+	cache::mapped_file file(cache_path);
+	if (!file.data())
+	{
+		return false;
+	}
+
+	cache::reader r(file.data(), file.size());
+
+	cache::header_t header;
+	if (!r.get(header) ||
+		std::memcmp(header.magic, cache::magic, sizeof(cache::magic)) != 0 ||
+		header.version != cache::version || header.stamp != stamp ||
+		header.count > file.size() / sizeof(cache::entry_t))
+	{
+		return false;
+	}
+
+	auto week_start = get_week_start(now);
+
+	compiled_schedule_t c;
+	c.actions.reserve(header.count);
+	for (std::uint32_t i = 0; i < header.count; ++i)
+	{
+		cache::entry_t e;
+		if (!r.get(e))
+		{
+			return false;
+		}
+		c.actions.push_back({week_start + seconds(e.on),
+							 week_start + seconds(e.off),
+							 static_cast<std::size_t>(e.line)});
+	}
+
+	week_bitmap::words_t words;
+	for (auto& w : words)
+	{
+		if (!r.get(w))
+		{
+			return false;
+		}
+	}
+	c.index = week_bitmap(words, week_start);
+
+	std::vector<override_t> ranges;
+	for (std::uint32_t i = 0; i < header.ranges; ++i)
+	{
+		cache::range_t e;
+		if (!r.get(e))
+		{
+			return false;
+		}
+		ranges.push_back({cache::from_seconds(e.from), cache::from_seconds(e.to),
+						  e.on != 0, static_cast<std::size_t>(e.line)});
+	}
+
+	zone_source_t source;
+	cache::zone_stamp_t zone_stamp;
+	if (!r.get(source.name) || !r.get(source.path) || !r.get(zone_stamp) ||
+		header.zones > file.size() / sizeof(cache::zone_t))
+	{
+		return false;
+	}
+	source.device = zone_stamp.device;
+	source.inode = zone_stamp.inode;
+	source.mtime_sec = zone_stamp.mtime_sec;
+	source.mtime_nsec = zone_stamp.mtime_nsec;
+	source.size = zone_stamp.size;
+
+	std::vector<zone_transition_t> zones;
+	zones.reserve(header.zones);
+	for (std::uint32_t i = 0; i < header.zones; ++i)
+	{
+		cache::zone_t e;
+		if (!r.get(e))
+		{
+			return false;
+		}
+		zones.push_back({e.at, e.offset, e.dst});
+	}
+
+	for (std::uint32_t i = 0; i < header.directives; ++i)
+	{
+		std::string key;
+		std::string value;
+		if (!r.get(key) || !r.get(value) || !apply_directive(c.cmds, key, value))
+		{
+			return false;
+		}
+	}
+	c.cmds.overrides = override_table(ranges);
+	c.cmds.zone = time_zone_table(std::move(zones), std::move(source));
+
+	out = std::move(c);
+	return true;
+}
+
+// Store the compiled schedule, atomically by renaming a temporary file.
+// content is the text it was compiled from. Returns false on errors.
+bool store_compiled_schedule(const std::string& cache_path,
+							 const file_stamp_t& stamp,
+							 const std::string& content,
+							 const compiled_schedule_t& c)
+{
+	// the directives in the order of the file
+	std::vector<std::pair<std::string, std::string>> directives;
+	{
+		std::istringstream iss(content);
+		std::string line;
+		while (std::getline(iss, line))
+		{
+			detail::line_scanner scanner(line);
+			detail::week_time_t start;
+			detail::week_time_t end;
+			std::string key;
+			std::string value;
+			if (!detail::scan_action(scanner, start, end) &&
+				!detail::scan_comment(scanner) &&
+				detail::scan_directive(scanner, key, value))
+			{
+				directives.emplace_back(key, value);
+			}
+		}
+	}
+
+	cache::header_t header{};
+	std::memcpy(header.magic, cache::magic, sizeof(cache::magic));
+	header.version = cache::version;
+	header.count = static_cast<std::uint32_t>(c.actions.size());
+	header.directives = static_cast<std::uint32_t>(directives.size());
+	header.ranges =
+		static_cast<std::uint32_t>(c.cmds.overrides.ranges().size());
+	header.zones =
+		static_cast<std::uint32_t>(c.cmds.zone.transitions().size());
+	header.stamp = stamp;
+
+	std::string out;
+	cache::put(out, header);
+
+	auto week_start = c.index.week_start();
+	for (const auto& a : c.actions)
+	{
+		cache::entry_t e;
+		e.on = (a.on - week_start).total_seconds();
+		e.off = (a.off - week_start).total_seconds();
+		e.line = a.line;
+		cache::put(out, e);
+	}
+	for (auto w : c.index.raw_words())
+	{
+		cache::put(out, w);
+	}
+	for (const auto& o : c.cmds.overrides.ranges())
+	{
+		cache::range_t e;
+		e.from = cache::to_seconds(o.from);
+		e.to = cache::to_seconds(o.to);
+		e.line = o.line;
+		e.on = o.on ? 1 : 0;
+		cache::put(out, e);
+	}
+
+	const auto& source = c.cmds.zone.source();
+	cache::put(out, source.name);
+	cache::put(out, source.path);
+	cache::put(out, cache::zone_stamp_t{source.device, source.inode,
+										source.mtime_sec, source.mtime_nsec,
+										source.size});
+	for (const auto& z : c.cmds.zone.transitions())
+	{
+		cache::put(out, cache::zone_t{z.at, z.offset, z.dst});
+	}
+	for (const auto& d : directives)
+	{
+		cache::put(out, d.first);
+		cache::put(out, d.second);
+	}
+
+	// create the directories, when they are not there
+	for (auto slash = cache_path.find('/', 1); slash != std::string::npos;
+		 slash = cache_path.find('/', slash + 1))
+	{
+		::mkdir(cache_path.substr(0, slash).c_str(), 0755);
+	}
+
+	std::string tmp = cache_path + ".tmp." + std::to_string(::getpid());
+	{
+		fd_handle fd(
+			::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		const char* p = out.data();
+		std::size_t left = out.size();
+		while (left > 0)
+		{
+			auto len = ::write(fd, p, left);
+			if (len <= 0)
+			{
+				::unlink(tmp.c_str());
+				return false;
+			}
+			p += len;
+			left -= static_cast<std::size_t>(len);
+		}
+	}
+
+	if (::rename(tmp.c_str(), cache_path.c_str()) != 0)
+	{
+		::unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+#else // _WIN32
+
+// there is no cache on windows, just read the file
+inline bool read_file(const std::string& path, std::string& content,
+					  file_stamp_t& stamp)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	if (!ifs)
+	{
+		return false;
+	}
+	content.assign(std::istreambuf_iterator<char>(ifs),
+				   std::istreambuf_iterator<char>());
+	stamp.size = content.size();
+	stamp.hash = fnv1a(content.data(), content.size());
+	return true;
+}
+
+bool load_compiled_schedule(const std::string&, const file_stamp_t&,
+							const time_point_t, compiled_schedule_t&)
+{
+	return false;
+}
+
+bool store_compiled_schedule(const std::string&, const file_stamp_t&,
+							 const std::string&, const compiled_schedule_t&)
+{
+	return false;
+}
+
+#endif // _WIN32
+
+} // namespace rtc
+
+#endif // rtcwake_cache_h
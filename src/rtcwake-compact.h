@@ -0,0 +1,231 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_compact_h
+#define rtcwake_compact_h
+
+#include "rtcwake-schedule.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rtc
+{
+// The sorted schedule as seconds since its week start, with the on and off
+// times in separate arrays. A window takes 8 bytes instead of two ptimes and
+// the scans over it are plain integer loops. Like the bitmap it repeats
+// every week.
+class compact_schedule
+{
+public:
+	using seconds_t = std::uint32_t;
+	static constexpr seconds_t seconds_per_week = 7 * 24 * 3600;
+
+	// the lookups scan linearly up to this many windows
+	static constexpr std::size_t linear_scan_max = 64;
+
+	compact_schedule() = default;
+
+	// from the windows as read_schedule() creates them, in any order. They
+	// have to be in whole seconds from week_start on.
+	template <typename iterator_t>
+	compact_schedule(iterator_t begin, iterator_t end,
+					 const time_point_t week_start)
+		: m_week_start(week_start)
+	{
+		std::vector<action_t> sorted(begin, end);
+		std::stable_sort(sorted.begin(), sorted.end());
+
+		m_on.reserve(sorted.size());
+		m_off.reserve(sorted.size());
+		m_line.reserve(sorted.size());
+		m_source.reserve(sorted.size());
+		for (const auto& a : sorted)
+		{
+			m_on.push_back(to_seconds(a.on));
+			m_off.push_back(to_seconds(a.off));
+			m_line.push_back(static_cast<std::uint32_t>(a.line));
+			m_source.push_back(a.source);
+		}
+	}
+
+	time_point_t week_start() const { return m_week_start; }
+	std::size_t size() const { return m_on.size(); }
+	bool empty() const { return m_on.empty(); }
+
+	const std::vector<seconds_t>& on() const { return m_on; }
+	const std::vector<seconds_t>& off() const { return m_off; }
+
+	// back to the boost types
+	action_t at(std::size_t i) const
+	{
+		action_t a;
+		a.on = m_week_start + seconds(m_on[i]);
+		a.off = m_week_start + seconds(m_off[i]);
+		a.line = m_line[i];
+		a.source = m_source[i];
+		return a;
+	}
+
+	std::vector<action_t> to_actions() const
+	{
+		std::vector<action_t> actions;
+		actions.reserve(size());
+		for (std::size_t i = 0; i < size(); ++i)
+		{
+			actions.push_back(at(i));
+		}
+		return actions;
+	}
+
+	seconds_t to_seconds(const time_point_t tp) const
+	{
+		auto d = tp - m_week_start;
+		if (tp.is_special() || d.is_negative() || d.fractional_seconds() != 0 ||
+			d.total_seconds() > std::numeric_limits<seconds_t>::max())
+		{
+			throw std::runtime_error(
+				"compact_schedule: not in whole seconds after the week start: " +
+				boost::posix_time::to_simple_string(tp));
+		}
+		return static_cast<seconds_t>(d.total_seconds());
+	}
+
+	// tp as the week it is in and the second in that week, floored
+	void fold(const time_point_t tp, time_point_t& week,
+			  seconds_t& second) const
+	{
+		const std::int64_t us_per_second = 1000000;
+		auto us = (tp - m_week_start).total_microseconds();
+		auto sec = us / us_per_second - (us % us_per_second < 0 ? 1 : 0);
+
+		auto w = sec / seconds_per_week - (sec % seconds_per_week < 0 ? 1 : 0);
+		week = m_week_start + hours(7 * 24 * w);
+		second = static_cast<seconds_t>(sec - w * seconds_per_week);
+	}
+
+	// the number of windows that started at second
+	std::size_t count_started(const seconds_t second) const
+	{
+		if (size() > linear_scan_max)
+		{
+			return static_cast<std::size_t>(
+				std::upper_bound(m_on.begin(), m_on.end(), second) -
+				m_on.begin());
+		}
+
+		// no branch in the loop: the compiler vectorizes it
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < m_on.size(); ++i)
+		{
+			count += m_on[i] <= second;
+		}
+		return count;
+	}
+
+private:
+	time_point_t m_week_start;
+	std::vector<seconds_t> m_on;
+	std::vector<seconds_t> m_off;
+	std::vector<std::uint32_t> m_line;
+	std::vector<std::uint32_t> m_source;
+};
+
+inline bool get_state(const compact_schedule& sched, const time_point_t tp)
+{
+	time_point_t week;
+	compact_schedule::seconds_t second;
+	sched.fold(tp, week, second);
+
+	auto started = sched.count_started(second);
+	return started > 0 && second < sched.off()[started - 1];
+}
+
+inline time_point_t get_next_on_time(const compact_schedule& sched,
+									 const time_point_t tp)
+{
+	if (sched.empty())
+	{
+		throw std::runtime_error("get_next_on_time: empty schedule");
+	}
+
+	time_point_t week;
+	compact_schedule::seconds_t second;
+	sched.fold(tp, week, second);
+
+	auto started = sched.count_started(second);
+	if (started < sched.size())
+	{
+		return week + seconds(sched.on()[started]);
+	}
+
+	// in the next week. The second half of a window over the end of the
+	// week is no new start.
+	const auto& on = sched.on();
+	const auto& off = sched.off();
+	week += hours(7 * 24);
+	if (sched.size() > 1 &&
+		off.back() >= on.front() + compact_schedule::seconds_per_week)
+	{
+		return week + seconds(on[1]);
+	}
+	return week + seconds(on.front());
+}
+
+// A valid schedule is found in two passes without a branch. Only when they
+// find something, the sweep over the boost types tells what it is.
+inline std::vector<schedule_issue_t> validate_schedule(
+	const compact_schedule& sched)
+{
+	const auto& on = sched.on();
+	const auto& off = sched.off();
+	const auto n = sched.size();
+
+	bool bad = false;
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		// an inverted window wraps around to a huge length
+		bad |= off[i] - on[i] > compact_schedule::seconds_per_week;
+	}
+	for (std::size_t i = 1; i < n; ++i)
+	{
+		bad |= off[i - 1] >= on[i];
+	}
+
+	if (!bad)
+	{
+		return {};
+	}
+	auto actions = sched.to_actions();
+	return validate_schedule(actions.begin(), actions.end());
+}
+
+inline void check_schedule(const compact_schedule& sched,
+						   const std::vector<std::string>& sources = {})
+{
+	auto issues = validate_schedule(sched);
+	if (!issues.empty())
+	{
+		throw schedule_error(std::move(issues), sources);
+	}
+}
+
+} // namespace rtc
+
+#endif // rtcwake_compact_h
@@ -0,0 +1,483 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_daemon_h
+#define rtcwake_daemon_h
+
+#include "rtcwake-cache.h"
+#include "rtcwake-fragments.h"
+#include "rtcwake-learn.h"
+#include "rtcwake-probes.h"
+#include "rtcwake-process.h"
+#include "rtcwake-schedule.h"
+#include "rtcwake-status.h"
+#include "rtcwake-trace.h"
+#include "rtcwake-wakealarm.h"
+#include "rtcwake-warmup.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace rtc
+{
+struct daemon_options
+{
+	std::string schedule_path;
+	std::string fragment_dir; // *.conf in there
+	bool forced = false;
+	bool test = false; // just log, dont power down
+	bool timings = false;	 // print the phases of each tick to stderr
+	bool trace_json = false; // one JSON object per tick to stdout
+	std::string state_path;	 // of CacheFor=, empty: not kept
+	std::string cgroup_root; // of MemoryMax= and CPUQuota=
+	std::string learn_path;	 // for --learn, empty: no learning
+	std::string idle_path;	 // the samples of StayAwakeIf=busy
+	std::string warm_up_path; // the WarmUp= marker
+	std::string status_path;  // empty: no status page
+	wake_alarm_context_t wake_alarm; // the sysfs tree of WakeAlarm=
+
+	// when CheckStayAwake kept the machine up or the PowerDown command
+	// returned, ask again after this time
+	duration_t recheck = minutes(10);
+};
+
+// Keeps the schedule in memory and sleeps on a timerfd until the next
+// transition. The schedule file is watched with inotify and only read again
+// when it changed.
+class schedule_daemon
+{
+public:
+	explicit schedule_daemon(daemon_options opts) : m_opts(std::move(opts))
+	{
+		m_timer.reset(timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC));
+		if (m_timer < 0)
+		{
+			throw std::runtime_error(error("timerfd_create"));
+		}
+
+		m_inotify.reset(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+		if (m_inotify < 0)
+		{
+			throw std::runtime_error(error("inotify_init1"));
+		}
+
+		// watch the directory: editors replace the file by renaming
+		auto slash = m_opts.schedule_path.rfind('/');
+		std::string dir = slash == std::string::npos
+							  ? std::string(".")
+							  : m_opts.schedule_path.substr(0, slash + 1);
+		m_file_name = slash == std::string::npos
+						  ? m_opts.schedule_path
+						  : m_opts.schedule_path.substr(slash + 1);
+
+		if (inotify_add_watch(m_inotify, dir.c_str(),
+							  IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+								  IN_DELETE | IN_MOVED_FROM) < 0)
+		{
+			throw std::runtime_error(error("inotify_add_watch " + dir));
+		}
+
+		// a fragment dir created later needs a restart
+		if (!m_opts.fragment_dir.empty())
+		{
+			m_fragment_watch = inotify_add_watch(
+				m_inotify, m_opts.fragment_dir.c_str(),
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE |
+					IN_MOVED_FROM);
+		}
+
+		// mapped once, published on every tick
+		if (!m_opts.status_path.empty() && !m_opts.test)
+		{
+			m_status.reset(new status_writer(m_opts.status_path));
+		}
+
+		// the first read must succeed
+		run_trace trace;
+		if (!reload(true, trace))
+		{
+			throw std::runtime_error("daemon: can not read the schedule");
+		}
+	}
+
+	void run()
+	{
+		for (;;)
+		{
+			step();
+			wait();
+		}
+	}
+
+	// Decide once and arm the timer. Returns when it decides again. An
+	// error, like a PowerDown command that can not start or a WakeAlarm
+	// that does not read back, is logged and asked again after recheck.
+	time_point_t step()
+	{
+		run_trace trace;
+		if (m_changed)
+		{
+			reload(false, trace);
+		}
+
+		time_point_t next;
+		try
+		{
+			next = tick(trace);
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << "Error: " << ex.what() << std::endl;
+			trace.error = ex.what();
+			next = local_now() + m_opts.recheck;
+		}
+
+		// learning needs every minute, also in the on time
+		if (!m_opts.learn_path.empty())
+		{
+			next = std::min(next, local_now() + minutes(1));
+		}
+		arm(next);
+		report(trace);
+		return next;
+	}
+
+private:
+	bool reload(bool first, run_trace& trace)
+	{
+		m_changed = false;
+		try
+		{
+			schedule_files_t files;
+			files.schedule_path = m_opts.schedule_path;
+			files.fragment_dir = m_opts.fragment_dir;
+
+			auto c = load_schedule(files, rtc::now(), trace).compiled;
+			if (c.actions.empty())
+			{
+				throw std::runtime_error("Empty schedule");
+			}
+
+			m_cmds = c.cmds;
+			m_index = c.index;
+
+			log("Read schedule with " + std::to_string(c.actions.size()) +
+				" entries");
+			return true;
+		}
+		catch (const std::exception& ex)
+		{
+			// keep the last good schedule
+			std::cerr << "Error: " << ex.what() << std::endl;
+			trace.error = ex.what();
+			if (!first)
+			{
+				std::cerr << "Keeping the last schedule" << std::endl;
+			}
+		}
+		return false;
+	}
+
+	// decide and return when to decide again
+	time_point_t tick(run_trace& trace)
+	{
+		// not rtc::now(): time() lags the timerfd by up to a clock tick, so
+		// we would see the time just before the edge we slept for
+		auto now = local_now();
+		trace.now = now;
+
+		auto decide_start = run_trace::clock_t::now();
+		run_trace::clock_t::duration check_time{};
+		probe_context_t ctx;
+		ctx.state_path = m_opts.state_path;
+		ctx.cgroup_root = m_opts.cgroup_root;
+		ctx.idle_path = m_opts.idle_path;
+		auto d = decide(m_index, m_cmds, now, m_opts.forced,
+						[&]()
+						{
+							auto start = run_trace::clock_t::now();
+							trace.probes = run_stay_awake_checks(m_cmds, ctx);
+							check_time = run_trace::clock_t::now() - start;
+							return !trace.probes.empty() &&
+								   trace.probes.back().count > 0;
+						});
+		trace.add("state",
+				  run_trace::clock_t::now() - decide_start - check_time);
+		if (!d.scheduled_on)
+		{
+			trace.add("check_stay_awake", check_time);
+		}
+		trace.decided = true;
+		trace.decision = d;
+
+		if (!m_opts.learn_path.empty() && !m_opts.test &&
+			!learn_from_run(m_opts.learn_path, m_cmds, now, trace.probes, ctx))
+		{
+			log("Can not learn into " + m_opts.learn_path);
+		}
+
+		// the machine stays up: read the WarmUp= files once
+		if (!d.power_off && !m_opts.test)
+		{
+			warm_up_once(m_cmds, m_opts.warm_up_path, trace);
+		}
+
+		if (m_status && !m_status->publish(make_status(m_index, m_cmds, now, d,
+														trace.probes)))
+		{
+			std::cerr << "Can not write the status to " << m_opts.status_path
+					  << std::endl;
+		}
+
+		if (d.scheduled_on)
+		{
+			// sleep until the window ends. A schedule that is always on
+			// has no end.
+			auto next = get_next_transitions(m_index, m_cmds.overrides, now, 1);
+			if (next.empty())
+			{
+				return now + hours(7 * 24);
+			}
+			log("On until " + boost::posix_time::to_simple_string(next[0].at));
+			return next[0].at;
+		}
+
+		if (d.warming_up)
+		{
+			// woken up early: until the window starts
+			trace.next_wake = get_next_on_time(m_index, m_cmds.overrides, now);
+			log("Woken up early for the window at " +
+				boost::posix_time::to_simple_string(trace.next_wake));
+			return trace.next_wake;
+		}
+
+		if (!d.power_off)
+		{
+			// CheckStayAwake kept it up. Ask again later, but not after
+			// the next window started.
+			trace.next_wake = get_next_on_time(m_index, m_cmds.overrides, now);
+			auto next = std::min(now + m_opts.recheck, trace.next_wake);
+			log("CheckStayAwake keeps it up until " +
+				boost::posix_time::to_simple_string(next));
+			return next;
+		}
+
+		trace.next_wake = d.alarm_at;
+		log("Power down: " + d.tier_reason);
+		if (m_opts.test)
+		{
+			log("Would now execute " +
+				describe_power_down(d, m_cmds, m_opts.wake_alarm));
+		}
+		else
+		{
+			log("Execute " + describe_power_down(d, m_cmds, m_opts.wake_alarm));
+
+			// it may not come back: write the trace before
+			if (m_opts.trace_json)
+			{
+				std::cout << to_json(trace) << std::endl;
+				m_json_written = true;
+			}
+			forget_warm_up(m_opts.warm_up_path);
+			trace.time("power_down", [&]()
+					   { power_down(d, m_cmds, m_opts.wake_alarm); });
+		}
+
+		// We are back: resumed, or the command did not power down (yet).
+		// Decide again at the alarm at the latest: after a resume that is
+		// right away, so the WakeLead= time is not slept through.
+		return std::min(local_now() + m_opts.recheck, d.alarm_at);
+	}
+
+	// from the time zone table, without localtime() on each tick
+	time_point_t local_now() const
+	{
+		if (m_cmds.zone.empty())
+		{
+			return boost::posix_time::microsec_clock::local_time();
+		}
+		return m_cmds.zone.to_local(
+			boost::posix_time::microsec_clock::universal_time());
+	}
+
+	void arm(const time_point_t at)
+	{
+		timespec rt{};
+		clock_gettime(CLOCK_REALTIME, &rt);
+		std::int64_t now_ns = std::int64_t(rt.tv_sec) * 1000000000 + rt.tv_nsec;
+
+		// at is local time: with the time zone table it is a UTC time over
+		// a DST switch, without by the distance to now
+		std::int64_t target = 0;
+		if (!m_cmds.zone.empty())
+		{
+			auto epoch = time_point_t(date(1970, 1, 1));
+			target = (m_cmds.zone.to_utc(at) - epoch).total_microseconds() * 1000;
+		}
+		else
+		{
+			target = now_ns + (at - local_now()).total_microseconds() * 1000;
+		}
+		target = std::max(target, now_ns + 1);
+
+		itimerspec spec{};
+		spec.it_value.tv_sec = static_cast<time_t>(target / 1000000000);
+		spec.it_value.tv_nsec = static_cast<long>(target % 1000000000);
+
+		// TFD_TIMER_CANCEL_ON_SET: wake up when the clock is set
+		if (timerfd_settime(m_timer, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+							&spec, nullptr) < 0)
+		{
+			throw std::runtime_error(error("timerfd_settime"));
+		}
+	}
+
+	// until the timer expires, the clock was set or the schedule changed
+	void wait()
+	{
+		pollfd fds[2] = {{m_timer, POLLIN, 0}, {m_inotify, POLLIN, 0}};
+
+		while (!m_changed)
+		{
+			int rc = poll(fds, 2, -1);
+			if (rc < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (rc < 0)
+			{
+				throw std::runtime_error(error("poll"));
+			}
+
+			if (fds[1].revents & POLLIN)
+			{
+				// other files in the directory dont wake us up
+				drain_inotify();
+			}
+
+			if (fds[0].revents & POLLIN)
+			{
+				// ECANCELED when the clock was set. Just decide again.
+				std::uint64_t expirations;
+				if (read(m_timer, &expirations, sizeof(expirations)) < 0 &&
+					errno != ECANCELED && errno != EAGAIN)
+				{
+					throw std::runtime_error(error("read timerfd"));
+				}
+				return;
+			}
+		}
+	}
+
+	void drain_inotify()
+	{
+		alignas(inotify_event) char buf[4096];
+		for (;;)
+		{
+			auto len = read(m_inotify, buf, sizeof(buf));
+			if (len <= 0)
+			{
+				break;
+			}
+
+			for (char* p = buf; p < buf + len;)
+			{
+				auto* ev = reinterpret_cast<inotify_event*>(p);
+				if (ev->len > 0 && ev->wd == m_fragment_watch)
+				{
+					std::string name = ev->name;
+					if (name.size() > 5 &&
+						name.compare(name.size() - 5, 5, ".conf") == 0)
+					{
+						m_changed = true;
+					}
+				}
+				else if (ev->len > 0 && m_file_name == ev->name)
+				{
+					m_changed = true;
+				}
+				p += sizeof(inotify_event) + ev->len;
+			}
+		}
+
+		if (m_changed)
+		{
+			log("Schedule changed");
+		}
+	}
+
+	// once per tick, when asked for
+	void report(const run_trace& trace)
+	{
+		if (m_opts.timings)
+		{
+			print_timings(std::clog, trace);
+		}
+		if (m_opts.trace_json && !m_json_written)
+		{
+			std::cout << to_json(trace) << std::endl;
+		}
+		m_json_written = false;
+	}
+
+	void log(const std::string& msg)
+	{
+		if (m_opts.test)
+		{
+			std::clog << boost::posix_time::to_simple_string(
+							 boost::posix_time::microsec_clock::local_time())
+					  << ": " << msg << std::endl;
+		}
+	}
+
+	static std::string error(const std::string& what)
+	{
+		return "daemon: " + what + ": " + std::strerror(errno);
+	}
+
+	daemon_options m_opts;
+	std::string m_file_name;
+
+	fd_handle m_timer;
+	fd_handle m_inotify;
+	int m_fragment_watch = -1;
+
+	bool m_changed = false;
+	bool m_json_written = false; // before the PowerDown command
+	cmd_t m_cmds;
+	week_bitmap m_index;
+	std::unique_ptr<status_writer> m_status;
+};
+
+} // namespace rtc
+
+#endif // __linux__
+
+#endif // rtcwake_daemon_h
@@ -0,0 +1,384 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_fragments_h
+#define rtcwake_fragments_h
+
+#include "rtcwake-cache.h"
+#include "rtcwake-schedule.h"
+#include "rtcwake-timezone.h"
+#include "rtcwake-trace.h"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace rtc
+{
+// the schedule file and its fragments in schedule.d/*.conf
+struct schedule_files_t
+{
+	std::string schedule_path;
+	std::string fragment_dir;
+	std::string cache_path; // empty: no cache
+
+	// fragments are parsed in parallel from this many files on
+	std::size_t parallel_from = 4;
+};
+
+struct loaded_schedule_t
+{
+	compiled_schedule_t compiled;
+	std::vector<std::string> sources; // indexed by action_t::source
+	std::size_t cached = 0;			  // of the sources from the cache
+};
+
+// the *.conf files in dir sorted by name. None when there is no dir.
+inline std::vector<std::string> list_fragments(const std::string& dir)
+{
+	std::vector<std::string> files;
+#ifndef _WIN32
+	std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(dir.c_str()), closedir);
+	if (!d)
+	{
+		return files;
+	}
+
+	while (dirent* ent = readdir(d.get()))
+	{
+		std::string name = ent->d_name;
+		if (name.size() > 5 && name[0] != '.' &&
+			name.compare(name.size() - 5, 5, ".conf") == 0)
+		{
+			files.push_back(dir + "/" + name);
+		}
+	}
+	std::sort(files.begin(), files.end());
+#endif
+	return files;
+}
+
+namespace detail
+{
+// One file parsed, sorted and indexed, or loaded from its cache. With check
+// it is validated on its own. The time zone table is cached with it and
+// loaded again when the tzdata changed.
+inline compiled_schedule_t compile_file(const std::string& path,
+										const std::string& cache_path,
+										const time_point_t now, bool check,
+										run_trace& trace, bool& cached)
+{
+	std::string content;
+	file_stamp_t stamp;
+	if (!trace.time("read", [&]() { return read_file(path, content, stamp); }))
+	{
+		throw std::runtime_error("Can not read " + path);
+	}
+
+	auto zone = get_zone_source();
+
+	compiled_schedule_t c;
+	cached = !cache_path.empty() &&
+			 trace.time("cache_load",
+						[&]() {
+							return load_compiled_schedule(cache_path, stamp,
+														  now, c);
+						});
+	if (cached && c.cmds.zone.source() == zone)
+	{
+		return c;
+	}
+	if (cached)
+	{
+		c.cmds.zone = trace.time("zone", [&]() { return load_time_zone(zone); });
+		trace.time("cache_store",
+				   [&]()
+				   {
+					   return store_compiled_schedule(cache_path, stamp,
+													  content, c);
+				   });
+		return c;
+	}
+
+	std::istringstream iss(content);
+	std::back_insert_iterator<std::vector<action_t>> inserter(c.actions);
+	try
+	{
+		c.cmds = trace.time("parse",
+							[&]() { return read_schedule(inserter, iss, now); });
+	}
+	catch (const parse_error& ex)
+	{
+		throw parse_error(path + ": " + ex.what(), ex.line(), ex.column());
+	}
+
+	trace.time("sort", [&]() { std::sort(c.actions.begin(), c.actions.end()); });
+	if (check)
+	{
+		trace.time("validate", [&]()
+				   { check_schedule(c.actions.begin(), c.actions.end()); });
+	}
+	trace.time("index",
+			   [&]()
+			   {
+				   c.index = week_bitmap(c.actions.begin(), c.actions.end(),
+										 get_week_start(now));
+			   });
+	c.cmds.zone = trace.time("zone", [&]() { return load_time_zone(zone); });
+
+	// also a fragment with only Key= lines
+	if (!cache_path.empty())
+	{
+		trace.time(
+			"cache_store", [&]()
+			{ return store_compiled_schedule(cache_path, stamp, content, c); });
+	}
+	return c;
+}
+
+// Merge the sorted runs with a heap over their fronts, instead of sorting
+// them all again. Equal windows keep the order of the runs. A window that an
+// earlier file has as well is dropped: the lookups take every window as a
+// start of its own.
+inline std::vector<action_t> merge_runs(
+	const std::vector<const std::vector<action_t>*>& runs)
+{
+	using cursor_t = std::pair<std::size_t, std::size_t>; // run, position
+
+	auto later = [&runs](const cursor_t& a, const cursor_t& b)
+	{
+		const auto& x = (*runs[a.first])[a.second];
+		const auto& y = (*runs[b.first])[b.second];
+		return y < x || (!(x < y) && a.first > b.first);
+	};
+
+	std::size_t total = 0;
+	std::vector<cursor_t> heap;
+	for (std::size_t i = 0; i < runs.size(); ++i)
+	{
+		total += runs[i]->size();
+		if (!runs[i]->empty())
+		{
+			heap.emplace_back(i, 0);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end(), later);
+
+	std::vector<action_t> merged;
+	merged.reserve(total);
+	while (!heap.empty())
+	{
+		std::pop_heap(heap.begin(), heap.end(), later);
+		auto& c = heap.back();
+		const auto& a = (*runs[c.first])[c.second];
+		if (merged.empty() || merged.back() != a ||
+			merged.back().source == a.source)
+		{
+			merged.push_back(a);
+		}
+
+		if (++c.second < runs[c.first]->size())
+		{
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+		else
+		{
+			heap.pop_back();
+		}
+	}
+	return merged;
+}
+
+// The Key=value lines of later files win, the CheckStayAwake commands, probes
+// and date ranges add up
+inline void merge_cmds(cmd_t& into, const cmd_t& from,
+					   std::vector<override_t>& ranges)
+{
+	if (!from.power_down.empty())
+	{
+		into.power_down = from.power_down;
+	}
+	if (from.command_timeout != cmd_t().command_timeout)
+	{
+		into.command_timeout = from.command_timeout;
+	}
+	if (from.wake_lead != cmd_t().wake_lead)
+	{
+		into.wake_lead = from.wake_lead;
+	}
+	for (const auto& l : from.window_leads)
+	{
+		into.window_leads[l.first] = l.second;
+	}
+	if (!from.warm_up.empty())
+	{
+		into.warm_up = from.warm_up;
+	}
+	if (!from.wake_alarm.empty())
+	{
+		into.wake_alarm = from.wake_alarm;
+	}
+	if (into.zone.empty())
+	{
+		into.zone = from.zone;
+	}
+	for (const auto& t : from.power_tiers)
+	{
+		detail::set_power_tier(into.power_tiers, t);
+	}
+	for (const auto& c : from.cache_for)
+	{
+		into.cache_for[c.first] = c.second;
+	}
+	for (const auto& l : from.limits)
+	{
+		into.limits[l.first] = l.second;
+	}
+	into.check_stay_awake.insert(into.check_stay_awake.end(),
+								 from.check_stay_awake.begin(),
+								 from.check_stay_awake.end());
+	into.probes.insert(into.probes.end(), from.probes.begin(),
+					   from.probes.end());
+	ranges.insert(ranges.end(), from.overrides.ranges().begin(),
+				  from.overrides.ranges().end());
+}
+
+inline std::string fragment_cache_path(const std::string& cache_path,
+									   const std::string& path)
+{
+	auto slash = path.rfind('/');
+	auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+	return cache_path + ".d/" + name + ".bin";
+}
+} // namespace detail
+
+// Read the schedule and its fragments. Without fragments it is the schedule
+// file alone, cached as a whole. With fragments every file is parsed into a
+// sorted run (in parallel, when there are many) or taken from its own cache,
+// the runs are merged and checked together.
+loaded_schedule_t load_schedule(const schedule_files_t& files,
+								const time_point_t now, run_trace& trace)
+{
+	loaded_schedule_t r;
+	r.sources.push_back(files.schedule_path);
+	for (auto& f : list_fragments(files.fragment_dir))
+	{
+		r.sources.push_back(std::move(f));
+	}
+
+	if (r.sources.size() == 1)
+	{
+		bool cached = false;
+		r.compiled = detail::compile_file(files.schedule_path, files.cache_path,
+										  now, true, trace, cached);
+		r.cached = cached ? 1 : 0;
+		return r;
+	}
+
+	struct part_t
+	{
+		compiled_schedule_t compiled;
+		run_trace trace;
+		bool cached = false;
+	};
+	std::vector<part_t> parts(r.sources.size());
+
+	auto compile = [&](std::size_t i)
+	{
+		auto cache_path =
+			files.cache_path.empty()
+				? std::string()
+				: detail::fragment_cache_path(files.cache_path, r.sources[i]);
+		parts[i].compiled =
+			detail::compile_file(r.sources[i], cache_path, now, false,
+								 parts[i].trace, parts[i].cached);
+	};
+
+	trace.time("fragments",
+			   [&]()
+			   {
+				   if (r.sources.size() < files.parallel_from)
+				   {
+					   for (std::size_t i = 0; i < parts.size(); ++i)
+					   {
+						   compile(i);
+					   }
+					   return;
+				   }
+
+				   std::vector<std::future<void>> tasks;
+				   for (std::size_t i = 0; i < parts.size(); ++i)
+				   {
+					   tasks.push_back(
+						   std::async(std::launch::async, compile, i));
+				   }
+				   // rethrows the first error in the order of the files
+				   for (auto& t : tasks)
+				   {
+					   t.get();
+				   }
+			   });
+
+	std::vector<const std::vector<action_t>*> runs;
+	std::vector<override_t> ranges;
+	auto words = week_bitmap::words_t();
+	auto& c = r.compiled;
+	for (std::uint32_t i = 0; i < parts.size(); ++i)
+	{
+		auto& part = parts[i];
+		trace.add(part.trace);
+		r.cached += part.cached ? 1 : 0;
+
+		for (auto& a : part.compiled.actions)
+		{
+			a.source = i;
+		}
+		runs.push_back(&part.compiled.actions);
+
+		detail::merge_cmds(c.cmds, part.compiled.cmds, ranges);
+		for (std::size_t w = 0; w < words.size(); ++w)
+		{
+			words[w] |= part.compiled.index.raw_words()[w];
+		}
+	}
+
+	trace.time("merge",
+			   [&]()
+			   {
+				   c.actions = detail::merge_runs(runs);
+				   c.index = week_bitmap(words, get_week_start(now));
+				   c.cmds.overrides = override_table(ranges);
+			   });
+	trace.time("validate",
+			   [&]()
+			   {
+				   check_schedule(c.actions.begin(), c.actions.end(),
+								  r.sources);
+			   });
+	trace.entries = c.actions.size();
+	return r;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_fragments_h
@@ -0,0 +1,408 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_idle_h
+#define rtcwake_idle_h
+
+#include "rtcwake-process.h"
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+// what the kernel counted since the boot
+struct system_counters_t
+{
+	std::uint64_t cpu_busy = 0;	 // jiffies of all cpus, not idle or iowait
+	std::uint64_t cpu_total = 0;
+	std::uint64_t disk_bytes = 0; // read and written
+	std::uint64_t net_bytes = 0;  // received and sent, without lo
+};
+
+struct idle_sample_t
+{
+	std::int64_t at = 0; // milliseconds since the boot
+	system_counters_t counters;
+};
+
+namespace detail
+{
+// cpu  user nice system idle iowait irq softirq steal guest guest_nice
+inline void read_cpu_counters(const std::string& path, system_counters_t& c)
+{
+	std::ifstream ifs(path);
+	std::string cpu;
+	std::uint64_t v[8] = {};
+	if (ifs >> cpu && cpu == "cpu")
+	{
+		for (auto& n : v)
+		{
+			ifs >> n;
+		}
+	}
+
+	// guest is counted in user already
+	c.cpu_total = 0;
+	for (auto n : v)
+	{
+		c.cpu_total += n;
+	}
+	c.cpu_busy = c.cpu_total - v[3] - v[4];
+}
+
+// The whole disks: a partition follows its disk and starts with its name.
+// Loop, ram and stacked devices would count the same bytes again.
+//   major minor name reads merged sectors ms writes merged sectors ...
+inline std::uint64_t read_disk_bytes(const std::string& path)
+{
+	std::ifstream ifs(path);
+	std::string line;
+	std::string disk;
+	std::uint64_t bytes = 0;
+	while (std::getline(ifs, line))
+	{
+		auto words = split_words(line);
+		if (words.size() < 10)
+		{
+			continue;
+		}
+
+		const auto& name = words[2];
+		if (name.compare(0, 4, "loop") == 0 ||
+			name.compare(0, 3, "ram") == 0 || name.compare(0, 4, "zram") == 0 ||
+			name.compare(0, 3, "dm-") == 0 || name.compare(0, 2, "md") == 0 ||
+			(!disk.empty() && name.compare(0, disk.size(), disk) == 0))
+		{
+			continue;
+		}
+		disk = name;
+		bytes += (std::stoull(words[5]) + std::stoull(words[9])) * 512;
+	}
+	return bytes;
+}
+
+//  face |bytes packets errs drop fifo frame compressed multicast|bytes ...
+//    lo: 1234 ...
+inline std::uint64_t read_net_bytes(const std::string& path)
+{
+	std::ifstream ifs(path);
+	std::string line;
+	std::uint64_t bytes = 0;
+	while (std::getline(ifs, line))
+	{
+		auto colon = line.find(':');
+		if (colon == std::string::npos)
+		{
+			continue; // the header
+		}
+		auto face = split_words(line.substr(0, colon));
+		auto words = split_words(line.substr(colon + 1));
+		if (face.size() != 1 || face[0] == "lo" || words.size() < 9)
+		{
+			continue;
+		}
+		bytes += std::stoull(words[0]) + std::stoull(words[8]);
+	}
+	return bytes;
+}
+} // namespace detail
+
+inline system_counters_t read_system_counters(const std::string& proc_root)
+{
+	system_counters_t c;
+	detail::read_cpu_counters(proc_root + "/stat", c);
+	c.disk_bytes = detail::read_disk_bytes(proc_root + "/diskstats");
+	c.net_bytes = detail::read_net_bytes(proc_root + "/net/dev");
+	return c;
+}
+
+// The samples of the window, the oldest first, in a fixed buffer. A full
+// ring drops the oldest one.
+class idle_ring
+{
+public:
+	static constexpr std::size_t capacity = 512;
+
+	std::size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	void clear() { m_first = m_size = 0; }
+	void pop_back() { --m_size; }
+
+	const idle_sample_t& operator[](std::size_t i) const
+	{
+		return m_samples[(m_first + i) % capacity];
+	}
+	const idle_sample_t& front() const { return (*this)[0]; }
+	const idle_sample_t& back() const { return (*this)[m_size - 1]; }
+
+	void push(const idle_sample_t& s)
+	{
+		if (m_size == capacity)
+		{
+			m_first = (m_first + 1) % capacity;
+			--m_size;
+		}
+		m_samples[(m_first + m_size) % capacity] = s;
+		++m_size;
+	}
+
+	// the window from 'from' on needs only the last sample before it
+	void prune(std::int64_t from)
+	{
+		while (m_size > 1 && (*this)[1].at <= from)
+		{
+			m_first = (m_first + 1) % capacity;
+			--m_size;
+		}
+	}
+
+	// a line per sample: at cpu_busy cpu_total disk_bytes net_bytes. A
+	// missing or broken file is an empty ring.
+	void load(const std::string& path)
+	{
+		clear();
+		std::ifstream ifs(path);
+		std::string line;
+		while (std::getline(ifs, line))
+		{
+			std::istringstream iss(line);
+			idle_sample_t s;
+			auto& c = s.counters;
+			if (!(iss >> s.at >> c.cpu_busy >> c.cpu_total >> c.disk_bytes >>
+				  c.net_bytes))
+			{
+				clear();
+				return;
+			}
+			push(s);
+		}
+	}
+
+	// replaced by renaming, like the CacheFor= results
+	bool store(const std::string& path) const
+	{
+#ifndef _WIN32
+		auto slash = path.rfind('/');
+		if (slash != std::string::npos && slash > 0)
+		{
+			::mkdir(path.substr(0, slash).c_str(), 0755);
+		}
+
+		std::string tmp = path + ".tmp." + std::to_string(::getpid());
+		{
+			std::ofstream ofs(tmp, std::ios::trunc);
+			for (std::size_t i = 0; i < m_size; ++i)
+			{
+				const auto& s = (*this)[i];
+				const auto& c = s.counters;
+				ofs << s.at << " " << c.cpu_busy << " " << c.cpu_total << " "
+					<< c.disk_bytes << " " << c.net_bytes << "\n";
+			}
+			if (!ofs.flush())
+			{
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+		if (std::rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			std::remove(tmp.c_str());
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+private:
+	std::array<idle_sample_t, capacity> m_samples;
+	std::size_t m_first = 0;
+	std::size_t m_size = 0;
+};
+
+// What the window of a busy probe shows. The highest load between two
+// samples, the cpu in percent of all cpus, the others in bytes per second.
+// A step longer than the window, from the run before, counts as if all of
+// its load fell into the window: its average could hide a burst.
+struct idle_verdict_t
+{
+	bool covered = false; // the samples reach back the whole window
+	unsigned busy = 0;	  // steps above a threshold
+	double cpu = 0;
+	double disk = 0;
+	double net = 0;
+};
+
+inline idle_verdict_t judge_idle(const idle_ring& ring,
+								 const probe_spec_t& probe, std::int64_t now)
+{
+	idle_verdict_t v;
+	auto window = probe.window.total_milliseconds();
+	auto from = now - window;
+	v.covered = ring.size() >= 2 && ring.front().at <= from;
+
+	for (std::size_t i = 1; i < ring.size(); ++i)
+	{
+		const auto& a = ring[i - 1];
+		const auto& b = ring[i];
+		if (b.at <= from || b.at <= a.at)
+		{
+			continue;
+		}
+
+		auto secs = (b.at - a.at) / 1000.0;
+		auto scale = std::max(1.0, static_cast<double>(b.at - a.at) / window);
+		auto delta = [](std::uint64_t before, std::uint64_t after)
+		{ return static_cast<double>(after >= before ? after - before : 0); };
+		auto total = delta(a.counters.cpu_total, b.counters.cpu_total);
+		auto busy = delta(a.counters.cpu_busy, b.counters.cpu_busy);
+		auto cpu = total > 0 ? std::min(100.0, busy * 100 / total * scale)
+							 : 0.0;
+		auto disk = delta(a.counters.disk_bytes, b.counters.disk_bytes) /
+					secs * scale;
+		auto net =
+			delta(a.counters.net_bytes, b.counters.net_bytes) / secs * scale;
+
+		v.cpu = std::max(v.cpu, cpu);
+		v.disk = std::max(v.disk, disk);
+		v.net = std::max(v.net, net);
+		if (cpu > probe.cpu_percent || disk > probe.disk_rate ||
+			net > probe.net_rate)
+		{
+			++v.busy;
+		}
+	}
+	return v;
+}
+
+// "cpu 3.5% disk 0 B/s net 1024 B/s", the highest of the window
+inline std::string to_string(const idle_verdict_t& v)
+{
+	char buf[96];
+	std::snprintf(buf, sizeof(buf), "cpu %.1f%% disk %.0f B/s net %.0f B/s",
+				  v.cpu, v.disk, v.net);
+	return buf;
+}
+
+#ifdef __linux__
+// milliseconds of CLOCK_MONOTONIC: it stops in a suspend, like the counters
+inline std::int64_t monotonic_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<std::int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Watch the load until the samples cover the window, a step was busy or the
+// timeout passed. The samples of the runs before are kept in ring_path, so
+// a run from cron judges the step since the last run and is done. Only
+// after a gap longer than gap= or a reboot it watches the window again, up
+// to the timeout. Then the next run goes on from its samples.
+template <typename now_t, typename sleep_t>
+probe_result_t watch_idle(const probe_spec_t& probe,
+						  const std::string& proc_root,
+						  const std::string& ring_path, duration_t timeout,
+						  now_t clock, sleep_t sleep)
+{
+	idle_ring ring;
+	if (!ring_path.empty())
+	{
+		ring.load(ring_path);
+	}
+
+	auto window = probe.window.total_milliseconds();
+	idle_sample_t s{clock(), read_system_counters(proc_root)};
+	if (!ring.empty() &&
+		(s.at < ring.back().at ||
+		 s.at - ring.back().at > probe.gap.total_milliseconds() ||
+		 s.counters.cpu_total < ring.back().counters.cpu_total))
+	{
+		ring.clear();
+	}
+
+	// a run right after the last sample joins its step: in a few
+	// milliseconds any write looks like a rate
+	if (ring.size() >= 2 &&
+		s.at - ring.back().at < probe.interval.total_milliseconds())
+	{
+		ring.pop_back();
+	}
+	ring.push(s);
+
+	auto deadline = s.at + timeout.total_milliseconds();
+	auto v = judge_idle(ring, probe, s.at);
+	while (!v.covered && v.busy == 0 && !stop_requested() && s.at < deadline)
+	{
+		sleep(std::min(probe.interval.total_milliseconds(), deadline - s.at));
+		s = idle_sample_t{clock(), read_system_counters(proc_root)};
+		ring.push(s);
+		v = judge_idle(ring, probe, s.at);
+	}
+
+	ring.prune(s.at - window);
+	if (!ring_path.empty())
+	{
+		ring.store(ring_path);
+	}
+
+	// stopped or timed out early: busy, like a check that hangs
+	probe_result_t r;
+	r.text = probe.text;
+	r.count = v.busy > 0 || !v.covered ? std::max(v.busy, 1u) : 0;
+	r.output = to_string(v);
+	if (v.busy == 0 && !v.covered)
+	{
+		r.output += ", " +
+					std::to_string((s.at - ring.front().at) / 1000) + "s of " +
+					std::to_string(window / 1000) + "s watched";
+	}
+	r.output += "\n";
+	return r;
+}
+
+inline probe_result_t watch_idle(const probe_spec_t& probe,
+								 const std::string& proc_root,
+								 const std::string& ring_path,
+								 duration_t timeout)
+{
+	return watch_idle(probe, proc_root, ring_path, timeout, monotonic_ms,
+					  [](std::int64_t ms)
+					  {
+						  timespec ts{static_cast<time_t>(ms / 1000),
+									  static_cast<long>(ms % 1000) * 1000000};
+						  nanosleep(&ts, nullptr);
+					  });
+}
+#endif // __linux__
+
+} // namespace rtc
+
+#endif // rtcwake_idle_h
@@ -0,0 +1,348 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_learn_h
+#define rtcwake_learn_h
+
+#include "rtcwake-probes.h"
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+// monday 00:00 is 0
+inline std::size_t minute_of_week(const time_point_t now)
+{
+	return static_cast<std::size_t>(
+			   (now - get_week_start(now)).total_seconds() / 60) %
+		   week_bitmap::minutes_per_week;
+}
+
+// One minute of the week: how often a run saw the machine up in it, and how
+// often the checks wanted to stay awake then. The weights fade with a
+// half-life, so the last weeks count most and the file keeps its size
+// however long it learns.
+struct activity_slot_t
+{
+	float seen;
+	float active;
+	std::int64_t updated; // seconds since 1970, 0: never
+};
+
+// what an old week still counts
+const std::int64_t learn_half_life = 4 * 7 * 24 * 3600;
+
+// fade the weights to the time at
+inline void fade(activity_slot_t& s, std::int64_t at)
+{
+	if (at <= s.updated)
+	{
+		return;
+	}
+	if (s.updated != 0)
+	{
+		auto f = static_cast<float>(
+			std::exp2(-static_cast<double>(at - s.updated) / learn_half_life));
+		s.seen *= f;
+		s.active *= f;
+	}
+	s.updated = at;
+}
+
+#ifndef _WIN32
+
+// The file: a header and a slot for each minute of the week. A run reads and
+// writes only its own slot. Runs dont overlap, see the instance lock.
+namespace learn
+{
+const char magic[8] = {'R', 'T', 'C', 'W', 'L', 'E', 'A', 'R'};
+const std::uint32_t version = 1;
+
+struct header_t
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t slots;
+};
+} // namespace learn
+
+class activity_histogram
+{
+public:
+	// A new or foreign file starts empty, when it may be written
+	activity_histogram(const std::string& path, bool writable)
+	{
+		if (writable)
+		{
+			auto slash = path.rfind('/');
+			if (slash != std::string::npos && slash > 0)
+			{
+				::mkdir(path.substr(0, slash).c_str(), 0755);
+			}
+		}
+		m_fd.reset(::open(path.c_str(),
+						  writable ? O_RDWR | O_CREAT | O_CLOEXEC
+								   : O_RDONLY | O_CLOEXEC,
+						  0644));
+		if (m_fd < 0)
+		{
+			return;
+		}
+
+		learn::header_t h;
+		if (::pread(m_fd, &h, sizeof(h), 0) == sizeof(h) &&
+			std::memcmp(h.magic, learn::magic, sizeof(h.magic)) == 0 &&
+			h.version == learn::version &&
+			h.slots == week_bitmap::minutes_per_week)
+		{
+			m_open = true;
+			return;
+		}
+		if (!writable)
+		{
+			return;
+		}
+
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, learn::magic, sizeof(h.magic));
+		h.version = learn::version;
+		h.slots = week_bitmap::minutes_per_week;
+		m_open = ::ftruncate(m_fd, 0) == 0 &&
+				 ::ftruncate(m_fd, offset(week_bitmap::minutes_per_week)) ==
+					 0 &&
+				 ::pwrite(m_fd, &h, sizeof(h), 0) == sizeof(h);
+	}
+
+	bool is_open() const { return m_open; }
+
+	// a run in the minute, at seconds since 1970
+	bool record(std::size_t minute, bool active, std::int64_t at)
+	{
+		activity_slot_t s;
+		if (!m_open || minute >= week_bitmap::minutes_per_week ||
+			::pread(m_fd, &s, sizeof(s), offset(minute)) != sizeof(s))
+		{
+			return false;
+		}
+
+		fade(s, at);
+		s.seen += 1;
+		s.active += active ? 1 : 0;
+		return ::pwrite(m_fd, &s, sizeof(s), offset(minute)) == sizeof(s);
+	}
+
+	// all minutes, faded to at
+	std::vector<activity_slot_t> slots(std::int64_t at) const
+	{
+		std::vector<activity_slot_t> slots(week_bitmap::minutes_per_week);
+		auto size = slots.size() * sizeof(activity_slot_t);
+		if (!m_open || ::pread(m_fd, slots.data(), size, offset(0)) !=
+						   static_cast<ssize_t>(size))
+		{
+			return {};
+		}
+		for (auto& s : slots)
+		{
+			fade(s, at);
+		}
+		return slots;
+	}
+
+private:
+	static off_t offset(std::size_t minute)
+	{
+		return static_cast<off_t>(sizeof(learn::header_t) +
+								  minute * sizeof(activity_slot_t));
+	}
+
+	fd_handle m_fd;
+	bool m_open = false;
+};
+
+// Record the run for --learn. The checks only run in the off time, in the
+// on time they run here for the record. probes gets their results.
+inline bool learn_from_run(const std::string& path, const cmd_t& cmds,
+						   const time_point_t now,
+						   std::vector<probe_result_t>& probes,
+						   const probe_context_t& ctx,
+						   std::int64_t at = std::time(nullptr))
+{
+	// nothing tells whether it is needed
+	if (cmds.check_stay_awake.empty() && cmds.probes.empty())
+	{
+		return false;
+	}
+	if (probes.empty())
+	{
+		probes = run_stay_awake_checks(cmds, ctx);
+	}
+
+	bool active = !probes.empty() && probes.back().count > 0;
+	activity_histogram h(path, true);
+	return h.record(minute_of_week(now), active, at);
+}
+
+#endif // _WIN32
+
+// A schedule from the histogram, see propose_schedule()
+struct schedule_proposal_t
+{
+	// minutes of the week, from < to. to may be past the end of the week.
+	std::vector<std::pair<std::size_t, std::size_t>> windows;
+	std::size_t on_minutes = 0;
+	double activity = 0; // the sum of the chance it is needed, all minutes
+	double covered = 0;	 // of it in the windows
+	double seen = 0;	 // the runs, faded
+};
+
+// The fewest blocks of block minutes that cover target (0..1) of the
+// activity. The activity of a minute is the chance the checks wanted to stay
+// awake in it. The blocks are taken by their activity, the biggest first:
+// that needs the fewest. A minute the machine was never up in has none.
+inline schedule_proposal_t propose_schedule(
+	const std::vector<activity_slot_t>& slots, double target,
+	std::size_t block = 15)
+{
+	schedule_proposal_t p;
+	auto blocks = slots.size() / block;
+	std::vector<double> need(blocks, 0.0);
+	for (std::size_t m = 0; m < blocks * block; ++m)
+	{
+		p.seen += slots[m].seen;
+		if (slots[m].seen > 0)
+		{
+			need[m / block] += slots[m].active / slots[m].seen;
+		}
+	}
+	for (auto n : need)
+	{
+		p.activity += n;
+	}
+
+	std::vector<std::size_t> order(blocks);
+	for (std::size_t b = 0; b < blocks; ++b)
+	{
+		order[b] = b;
+	}
+	std::stable_sort(order.begin(), order.end(),
+					 [&](std::size_t a, std::size_t b)
+					 { return need[a] > need[b]; });
+
+	std::vector<bool> on(blocks, false);
+	for (auto b : order)
+	{
+		if (p.covered >= target * p.activity * (1 - 1e-9) || need[b] <= 0)
+		{
+			break;
+		}
+		on[b] = true;
+		p.covered += need[b];
+		p.on_minutes += block;
+	}
+
+	// the windows, one over the end of the week joins the first
+	for (std::size_t b = 0; b < blocks;)
+	{
+		if (!on[b])
+		{
+			++b;
+			continue;
+		}
+		auto from = b;
+		while (b < blocks && on[b])
+		{
+			++b;
+		}
+		p.windows.emplace_back(from * block, b * block);
+	}
+	if (p.windows.size() > 1 && p.windows.front().first == 0 &&
+		p.windows.back().second == blocks * block)
+	{
+		p.windows.back().second += p.windows.front().second;
+		p.windows.erase(p.windows.begin());
+	}
+	return p;
+}
+
+namespace detail
+{
+// like Mon:16:00, the end of the week is Sun:24:00 or the next Mon:00:00
+inline std::string week_minute_string(std::size_t minute, bool end_of_week)
+{
+	static const char* names[] = {"Mon", "Tue", "Wed", "Thu",
+								  "Fri", "Sat", "Sun"};
+	if (end_of_week && minute == week_bitmap::minutes_per_week)
+	{
+		return "Sun:24:00";
+	}
+	minute %= week_bitmap::minutes_per_week;
+
+	char buf[16];
+	std::snprintf(buf, sizeof(buf), "%s:%02u:%02u", names[minute / 1440],
+				  static_cast<unsigned>(minute / 60 % 24),
+				  static_cast<unsigned>(minute % 60));
+	return buf;
+}
+} // namespace detail
+
+// the windows as schedule lines, with what they cover as comment
+inline void print_proposal(std::ostream& os, const schedule_proposal_t& p,
+						   double target)
+{
+	auto flags = os.flags();
+	os << std::fixed << std::setprecision(1);
+	os << "# proposed for " << target * 100
+	   << "% of the activity, learned from " << p.seen << " runs\n";
+	if (p.activity <= 0)
+	{
+		os << "# no activity recorded" << std::endl;
+		os.flags(flags);
+		return;
+	}
+	os << "# covers " << p.covered / p.activity * 100 << "% with "
+	   << p.on_minutes / 60 << ":" << std::setw(2) << std::setfill('0')
+	   << p.on_minutes % 60 << std::setfill(' ') << " on hours a week\n";
+	for (const auto& w : p.windows)
+	{
+		bool whole_week =
+			w.first == 0 && w.second == week_bitmap::minutes_per_week;
+		os << detail::week_minute_string(w.first, false) << "-"
+		   << detail::week_minute_string(w.second, whole_week) << "\n";
+	}
+	os << std::flush;
+	os.flags(flags);
+}
+
+} // namespace rtc
+
+#endif // rtcwake_learn_h
@@ -0,0 +1,259 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_lock_h
+#define rtcwake_lock_h
+
+#include "rtcwake-schedule.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+// what a run does, when the one before still holds the lock
+enum class lock_policy_t
+{
+	skip = 0, // end right away
+	wait,	  // wait up to the timeout for it
+	takeover  // SIGTERM it, SIGKILL after the timeout
+};
+
+struct lock_options_t
+{
+	lock_policy_t policy = lock_policy_t::skip;
+	duration_t timeout = seconds(30);
+};
+
+// skip, wait or takeover
+inline bool parse_lock_policy(const std::string& s, lock_policy_t& policy)
+{
+	if (s == "skip")
+		policy = lock_policy_t::skip;
+	else if (s == "wait")
+		policy = lock_policy_t::wait;
+	else if (s == "takeover")
+		policy = lock_policy_t::takeover;
+	else
+		return false;
+	return true;
+}
+
+#ifndef _WIN32
+
+// The run that holds the lock, as it wrote it into the lock file
+struct lock_holder_t
+{
+	pid_t pid = 0;			 // 0: not known
+	std::int64_t since = 0; // seconds since 1970
+};
+
+// An flock() on a file in /run. The kernel drops it when the holder exits,
+// however it exits, so there is no stale lock to clean up. The holder writes
+// its pid and start time into the file for the ones that find it locked.
+class instance_lock
+{
+public:
+	explicit instance_lock(const std::string& path) : m_path(path)
+	{
+		auto slash = path.rfind('/');
+		if (slash != std::string::npos && slash > 0)
+		{
+			::mkdir(path.substr(0, slash).c_str(), 0755);
+		}
+		m_fd.reset(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+		if (m_fd < 0)
+		{
+			throw std::runtime_error("lock: can not open " + path + ": " +
+									 std::strerror(errno));
+		}
+	}
+
+	bool locked() const { return m_locked; }
+
+	bool try_lock()
+	{
+		if (!m_locked && ::flock(m_fd, LOCK_EX | LOCK_NB) == 0)
+		{
+			m_locked = true;
+			std::string text = std::to_string(::getpid()) + " " +
+							   std::to_string(std::time(nullptr)) + "\n";
+
+			// for the log only, the lock counts without it
+			bool written = ::ftruncate(m_fd, 0) == 0 &&
+						   ::pwrite(m_fd, text.data(), text.size(), 0) ==
+							   static_cast<ssize_t>(text.size());
+			(void)written;
+		}
+		return m_locked;
+	}
+
+	lock_holder_t holder() const
+	{
+		char buf[64] = {};
+		lock_holder_t h;
+		if (::pread(m_fd, buf, sizeof(buf) - 1, 0) > 0)
+		{
+			std::istringstream iss(buf);
+			long long pid = 0;
+			long long since = 0;
+			if (iss >> pid >> since && pid > 0)
+			{
+				h.pid = static_cast<pid_t>(pid);
+				h.since = since;
+			}
+		}
+		return h;
+	}
+
+	// Take the lock as the policy says. message tells how long the holder
+	// runs, when there was one.
+	bool acquire(const lock_options_t& opts, std::string& message)
+	{
+		message.clear();
+		if (try_lock())
+		{
+			return true;
+		}
+
+		auto h = holder();
+		message = describe(h);
+		auto start = std::chrono::steady_clock::now();
+		auto timeout =
+			std::chrono::microseconds(opts.timeout.total_microseconds());
+
+		switch (opts.policy)
+		{
+			case lock_policy_t::skip:
+				message += ", skipping this run";
+				return false;
+
+			case lock_policy_t::wait:
+				if (wait_for(start + timeout))
+				{
+					message += ", waited " + waited(start);
+					return true;
+				}
+				message += ", gave up after " + waited(start);
+				return false;
+
+			case lock_policy_t::takeover:
+				// a holder that can not be told apart is waited for
+				if (!signal_holder(h, SIGTERM))
+				{
+					wait_for(start + timeout);
+				}
+				else if (!wait_for(start + timeout) &&
+						 signal_holder(h, SIGKILL))
+				{
+					wait_for(start + timeout + std::chrono::seconds(5));
+				}
+				if (locked())
+				{
+					message += ", took it over after " + waited(start);
+					return true;
+				}
+				message += ", can not take it over";
+				return false;
+		}
+		return false;
+	}
+
+private:
+	bool wait_for(std::chrono::steady_clock::time_point until)
+	{
+		while (!try_lock())
+		{
+			if (std::chrono::steady_clock::now() >= until)
+			{
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		return true;
+	}
+
+	// The pid is read from the file, not from the lock: a new holder may not
+	// have written its own yet, and the pid of one that ended may belong to
+	// another process now. So the file has to name the same run still, and
+	// the pid has to run the same program as we do.
+	bool signal_holder(const lock_holder_t& h, int sig) const
+	{
+		if (h.pid <= 0 || h.pid == ::getpid())
+		{
+			return false;
+		}
+		auto now = holder();
+		if (now.pid != h.pid || now.since != h.since)
+		{
+			return false;
+		}
+
+		auto comm = [](const std::string& pid)
+		{
+			std::ifstream ifs("/proc/" + pid + "/comm");
+			std::string name;
+			std::getline(ifs, name);
+			return name;
+		};
+		auto name = comm(std::to_string(h.pid));
+		return !name.empty() && name == comm("self") &&
+			   ::kill(h.pid, sig) == 0;
+	}
+
+	std::string describe(const lock_holder_t& h) const
+	{
+		if (h.pid == 0)
+		{
+			return "lock: " + m_path + " is held";
+		}
+		return "lock: pid " + std::to_string(h.pid) + " holds " + m_path +
+			   " for " + std::to_string(std::time(nullptr) - h.since) + "s";
+	}
+
+	static std::string waited(std::chrono::steady_clock::time_point start)
+	{
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+					  std::chrono::steady_clock::now() - start)
+					  .count();
+		return std::to_string(ms / 1000) + "." + std::to_string(ms % 1000 / 100) +
+			   "s";
+	}
+
+	std::string m_path;
+	fd_handle m_fd;
+	bool m_locked = false;
+};
+
+#endif // _WIN32
+
+} // namespace rtc
+
+#endif // rtcwake_lock_h
@@ -0,0 +1,482 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_probes_h
+#define rtcwake_probes_h
+
+#include "rtcwake-idle.h"
+#include "rtcwake-process.h"
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utmp.h>
+#endif
+
+namespace rtc
+{
+// where the probes read from. Tests point it to a fake tree.
+struct probe_context_t
+{
+	std::string proc_root = "/proc";
+#ifdef _PATH_UTMP
+	std::string utmp_path = _PATH_UTMP;
+#else
+	std::string utmp_path = "/var/run/utmp";
+#endif
+
+	// the results kept for CacheFor=, empty: none are kept
+	std::string state_path;
+
+	// for the MemoryMax= and CPUQuota= cgroups, empty: rlimits
+	std::string cgroup_root;
+
+	// the samples of StayAwakeIf=busy, empty: it watches the whole window
+	std::string idle_path;
+
+	// seconds since 1970, -1: the system clock
+	std::int64_t now = -1;
+};
+
+// The positive results of the checks with CacheFor=, kept across the runs
+// in a small text file. A line is
+//   <seconds since 1970> <count> <text of the check>
+// It is replaced as a whole by renaming, so a run never reads half of it.
+class check_state
+{
+public:
+	struct entry_t
+	{
+		std::int64_t at = 0;
+		unsigned count = 0;
+	};
+
+	// a missing or broken file is an empty state
+	void load(const std::string& path)
+	{
+		m_entries.clear();
+		std::ifstream ifs(path);
+		std::string line;
+		while (std::getline(ifs, line))
+		{
+			std::istringstream iss(line);
+			entry_t e;
+			std::string text;
+			if (iss >> e.at >> e.count && iss.get() == ' ' &&
+				std::getline(iss, text) && !text.empty())
+			{
+				m_entries[text] = e;
+			}
+		}
+	}
+
+	bool store(const std::string& path) const
+	{
+		// create the directories, when they are not there
+		for (auto slash = path.find('/', 1); slash != std::string::npos;
+			 slash = path.find('/', slash + 1))
+		{
+#ifdef __linux__
+			::mkdir(path.substr(0, slash).c_str(), 0755);
+#endif
+		}
+
+		std::string tmp = path + ".tmp." + std::to_string(::getpid());
+		{
+			std::ofstream ofs(tmp, std::ios::trunc);
+			for (const auto& e : m_entries)
+			{
+				ofs << e.second.at << " " << e.second.count << " " << e.first
+					<< "\n";
+			}
+			if (!ofs.flush())
+			{
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+		if (std::rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			std::remove(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// the result of the check, when it is younger than ttl
+	const entry_t* find(const std::string& text, std::int64_t now,
+						const duration_t& ttl) const
+	{
+		auto pos = m_entries.find(text);
+		if (pos == m_entries.end() || now < pos->second.at ||
+			now - pos->second.at >= ttl.total_seconds())
+		{
+			return nullptr;
+		}
+		return &pos->second;
+	}
+
+	void set(const std::string& text, const entry_t& e) { m_entries[text] = e; }
+
+	// drop what expired or is no longer configured
+	void prune(const std::map<std::string, duration_t>& cache_for,
+			   std::int64_t now)
+	{
+		for (auto it = m_entries.begin(); it != m_entries.end();)
+		{
+			auto ttl = cache_for.find(it->first);
+			if (ttl == cache_for.end() || !find(it->first, now, ttl->second))
+			{
+				it = m_entries.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	const std::map<std::string, entry_t>& entries() const { return m_entries; }
+
+private:
+	std::map<std::string, entry_t> m_entries;
+};
+
+namespace detail
+{
+// Established tcp connections in /proc/net/tcp{,6} with one of the local
+// ports. Format of a line:
+//   sl local_address rem_address st ...
+//   0: 0100007F:01BD 0100007F:D2A4 01 ...
+inline unsigned count_tcp_established(const std::string& path,
+									  const std::vector<unsigned>& ports)
+{
+	std::ifstream ifs(path);
+	std::string line;
+	std::getline(ifs, line); // header
+
+	unsigned count = 0;
+	while (std::getline(ifs, line))
+	{
+		auto words = split_words(line);
+		if (words.size() < 4 || words[3] != "01") // TCP_ESTABLISHED
+		{
+			continue;
+		}
+
+		auto colon = words[1].rfind(':');
+		if (colon == std::string::npos)
+		{
+			continue;
+		}
+		auto port = static_cast<unsigned>(
+			std::strtoul(words[1].c_str() + colon + 1, nullptr, 16));
+
+		if (ports.empty() ||
+			std::find(ports.begin(), ports.end(), port) != ports.end())
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+#ifdef __linux__
+inline unsigned count_logged_in_users(const std::string& path)
+{
+	std::ifstream ifs(path, std::ios::binary);
+
+	unsigned count = 0;
+	struct utmp entry;
+	while (ifs.read(reinterpret_cast<char*>(&entry), sizeof(entry)))
+	{
+		if (entry.ut_type == USER_PROCESS)
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+// processes in /proc/<pid>/comm with one of the names
+inline unsigned count_processes(const std::string& proc_root,
+								const std::vector<std::string>& names)
+{
+	std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(proc_root.c_str()),
+											closedir);
+	if (!dir)
+	{
+		return 0;
+	}
+
+	unsigned count = 0;
+	while (dirent* ent = readdir(dir.get()))
+	{
+		if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+		{
+			continue;
+		}
+
+		std::ifstream ifs(proc_root + "/" + ent->d_name + "/comm");
+		std::string comm;
+		if (!std::getline(ifs, comm))
+		{
+			continue; // gone in the meantime
+		}
+
+		// the kernel truncates comm to 15 characters
+		for (const auto& name : names)
+		{
+			if (comm == name.substr(0, 15))
+			{
+				++count;
+				break;
+			}
+		}
+	}
+	return count;
+}
+#endif
+} // namespace detail
+
+// timeout: CommandTimeout=, how long busy may watch the load
+probe_result_t evaluate_probe(const probe_spec_t& probe,
+							  const probe_context_t& ctx,
+							  duration_t timeout = seconds(60))
+{
+	using kind_t = probe_spec_t::kind_t;
+
+	probe_result_t r;
+	r.text = probe.text;
+
+	switch (probe.kind)
+	{
+		case kind_t::tcp_established:
+			r.count = detail::count_tcp_established(
+						  ctx.proc_root + "/net/tcp", probe.ports) +
+					  detail::count_tcp_established(
+						  ctx.proc_root + "/net/tcp6", probe.ports);
+			break;
+
+#ifdef __linux__
+		case kind_t::logged_in_users:
+			r.count = detail::count_logged_in_users(ctx.utmp_path);
+			break;
+
+		case kind_t::process:
+			r.count = detail::count_processes(ctx.proc_root, probe.names);
+			break;
+
+		case kind_t::busy:
+			r = watch_idle(probe, ctx.proc_root, ctx.idle_path, timeout);
+			break;
+#else
+		case kind_t::logged_in_users:
+		case kind_t::process:
+		case kind_t::busy:
+			throw std::runtime_error("StayAwakeIf: " + probe.text +
+									 " is only supported on linux");
+#endif
+	}
+
+	return r;
+}
+
+namespace detail
+{
+// the cached result of the check, when it has a CacheFor= and one
+inline bool find_cached(const cmd_t& cmds, const check_state& state,
+						const std::string& text, std::int64_t now,
+						probe_result_t& r)
+{
+	auto ttl = cmds.cache_for.find(text);
+	if (ttl == cmds.cache_for.end())
+	{
+		return false;
+	}
+	auto e = state.find(text, now, ttl->second);
+	if (!e)
+	{
+		return false;
+	}
+	r.text = text;
+	r.count = e->count;
+	r.cached = true;
+	return true;
+}
+
+// the state file is written, when a new result is kept or one expired
+class check_state_scope
+{
+public:
+	check_state_scope(const cmd_t& cmds, const probe_context_t& ctx)
+		: m_cmds(cmds), m_ctx(ctx),
+		  m_now(ctx.now >= 0 ? ctx.now : std::int64_t(std::time(nullptr))),
+		  m_enabled(!ctx.state_path.empty() && !cmds.cache_for.empty())
+	{
+		if (m_enabled)
+		{
+			m_state.load(ctx.state_path);
+		}
+	}
+
+	~check_state_scope()
+	{
+		if (!m_enabled)
+		{
+			return;
+		}
+		auto before = m_state.entries().size();
+		m_state.prune(m_cmds.cache_for, m_now);
+		if ((m_changed || m_state.entries().size() != before) &&
+			!m_state.store(m_ctx.state_path))
+		{
+			std::cerr << "CacheFor: can not write " << m_ctx.state_path
+					  << std::endl;
+		}
+	}
+
+	bool find(const std::string& text, probe_result_t& r) const
+	{
+		return m_enabled && find_cached(m_cmds, m_state, text, m_now, r);
+	}
+
+	// keep a positive result of a check with CacheFor=
+	void keep(const probe_result_t& r)
+	{
+		if (m_enabled && r.count > 0 && m_cmds.cache_for.count(r.text))
+		{
+			m_state.set(r.text, {m_now, r.count});
+			m_changed = true;
+		}
+	}
+
+private:
+	const cmd_t& m_cmds;
+	const probe_context_t& m_ctx;
+	std::int64_t m_now;
+	bool m_enabled;
+	bool m_changed = false;
+	check_state m_state;
+};
+} // namespace detail
+
+// The StayAwakeIf= probes run first, they are cheap. The CheckStayAwake=
+// commands are only started when none of them wants to stay awake. They run
+// in parallel, the first one that does not say "0" stops the others. Returns
+// the results up to the first one that wants to stay awake, the commands in
+// the order they finished. A positive result of a check with CacheFor= is
+// used again until it expires, without running the check.
+std::vector<probe_result_t> run_stay_awake_checks(
+	const cmd_t& cmds, const probe_context_t& ctx = probe_context_t())
+{
+	detail::check_state_scope state(cmds, ctx);
+
+	std::vector<probe_result_t> results;
+	for (const auto& probe : cmds.probes)
+	{
+		probe_result_t r;
+		if (!state.find(probe.text, r))
+		{
+			r = evaluate_probe(probe, ctx, cmds.command_timeout);
+			state.keep(r);
+		}
+		results.push_back(r);
+		if (r.count > 0)
+		{
+			return results;
+		}
+	}
+
+	// only the built in probes are configured
+	auto commands = cmds.check_stay_awake;
+	if (commands.empty())
+	{
+		if (!cmds.probes.empty())
+		{
+			return results;
+		}
+		commands.push_back(""); // prints nothing: stay awake
+	}
+
+	// a cached one spares starting them
+	for (const auto& c : commands)
+	{
+		probe_result_t r;
+		if (state.find(c, r))
+		{
+			results.push_back(r);
+			return results;
+		}
+	}
+
+	exec_options_t opts;
+	opts.timeout = cmds.command_timeout;
+	opts.cgroup_root = ctx.cgroup_root;
+	for (const auto& c : commands)
+	{
+		auto limits = cmds.limits.find(c);
+		opts.limits.push_back(limits != cmds.limits.end() ? limits->second
+														  : process_limits_t());
+	}
+
+	run_commands(commands, opts,
+				 [&](std::size_t i, const exec_result_t& r)
+				 {
+					 if (!r.exited())
+					 {
+						 // it did not say "0": stay awake
+						 std::cerr << "CheckStayAwake: " << commands[i] << ": "
+								   << to_string(r) << std::endl;
+					 }
+
+					 probe_result_t command;
+					 command.text = commands[i];
+					 command.count = r.output != "0\n" ? 1 : 0;
+					 command.output = r.output;
+					 command.cpu_us = r.cpu_us;
+					 command.max_rss_kb = r.max_rss_kb;
+					 state.keep(command);
+					 results.push_back(command);
+					 return command.count > 0;
+				 });
+	return results;
+}
+
+bool check_stay_awake(cmd_t cmds, const time_point_t now,
+					  const probe_context_t& ctx = probe_context_t())
+{
+	auto results = run_stay_awake_checks(cmds, ctx);
+	return !results.empty() && results.back().count > 0;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_probes_h
@@ -0,0 +1,769 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_process_h
+#define rtcwake_process_h
+
+#include "rtcwake-schedule.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace rtc
+{
+struct exec_options_t
+{
+	// wall clock deadline. pos_infin waits forever.
+	duration_t timeout = boost::posix_time::pos_infin;
+
+	// between SIGTERM and SIGKILL when the deadline passed
+	duration_t kill_grace = seconds(5);
+
+	// the output beyond this is read but dropped
+	std::size_t max_output = 64 * 1024;
+
+	// of the commands, by their index. Missing ones have none.
+	std::vector<process_limits_t> limits;
+
+	// MemoryMax= and CPUQuota= get a cgroup v2 below this directory. Empty
+	// or when that fails: rlimits.
+	std::string cgroup_root;
+};
+
+struct exec_result_t
+{
+	std::string output;
+	bool truncated = false;	 // more than max_output
+	bool timed_out = false;	 // killed after the deadline
+	bool cancelled = false;	 // killed, another one decided
+	int exit_status = -1;	 // when it exited
+	int term_signal = 0;	 // when a signal terminated it
+	std::uint64_t cpu_us = 0;	  // user and system time, from wait4()
+	std::uint64_t max_rss_kb = 0; // peak resident set
+
+	bool exited() const { return term_signal == 0 && exit_status >= 0; }
+};
+
+std::string to_string(const exec_result_t& r)
+{
+	std::string s;
+	if (r.exited())
+		s = "exit status " + std::to_string(r.exit_status);
+	else
+		s = "signal " + std::to_string(r.term_signal);
+	if (r.cancelled)
+		s += ", cancelled";
+	if (r.timed_out)
+		s += ", timed out";
+	if (r.truncated)
+		s += ", output truncated";
+	return s;
+}
+
+// Does the command need /bin/sh? Pipes, redirections, variables, quotes,
+// globs and the like do.
+inline bool needs_shell(const std::string& cmd)
+{
+	if (cmd.find_first_not_of(" \t") == std::string::npos)
+	{
+		// like popen: sh -c "" prints nothing
+		return true;
+	}
+	return cmd.find_first_of("|&;<>()$`\\\"'*?[]#~=%!{}\n") !=
+		   std::string::npos;
+}
+
+// the argv to run the command: split at blanks, or /bin/sh -c cmd
+inline std::vector<std::string> command_argv(const std::string& cmd)
+{
+	if (needs_shell(cmd))
+	{
+		return {"/bin/sh", "-c", cmd};
+	}
+
+	return detail::split_words(cmd);
+}
+
+#ifndef _WIN32
+
+namespace detail
+{
+inline volatile std::sig_atomic_t& stop_flag()
+{
+	static volatile std::sig_atomic_t flag = 0;
+	return flag;
+}
+
+inline void on_stop_signal(int) { stop_flag() = 1; }
+} // namespace detail
+
+// After this SIGTERM does not end the process right away: the running
+// commands are stopped like after their deadline and the run can end
+// without powering down. A newer run that takes over the lock sends it.
+inline void stop_on_sigterm()
+{
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = detail::on_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, nullptr); // no SA_RESTART: poll() returns
+}
+
+inline bool stop_requested() { return detail::stop_flag() != 0; }
+
+namespace detail
+{
+// a cgroup control file, one write()
+inline bool write_control(const std::string& path, const std::string& value)
+{
+	fd_handle fd(::open(path.c_str(), O_WRONLY | O_CLOEXEC));
+	return fd >= 0 && ::write(fd, value.data(), value.size()) ==
+						  static_cast<ssize_t>(value.size());
+}
+
+// A cgroup v2 for one command with its MemoryMax= and CPUQuota=, below
+// root. root gets no processes, so it can hand the memory and cpu
+// controllers to its children. It is removed after the command, what is
+// left in it is killed.
+class transient_cgroup
+{
+public:
+	transient_cgroup(const std::string& root, const process_limits_t& limits)
+	{
+		if (root.empty() || (limits.memory_max == 0 && limits.cpu_quota == 0))
+		{
+			return;
+		}
+
+		// already there and enabled is fine
+		::mkdir(root.c_str(), 0755);
+		write_control(root + "/cgroup.subtree_control", "+memory");
+		write_control(root + "/cgroup.subtree_control", "+cpu");
+
+		static std::atomic<unsigned> counter(0);
+		auto path = root + "/check-" + std::to_string(::getpid()) + "-" +
+					std::to_string(counter++);
+		if (::mkdir(path.c_str(), 0755) != 0)
+		{
+			return;
+		}
+
+		// cpu.max is the time per 100ms period
+		if ((limits.memory_max == 0 ||
+			 write_control(path + "/memory.max",
+						   std::to_string(limits.memory_max))) &&
+			(limits.cpu_quota == 0 ||
+			 write_control(path + "/cpu.max",
+						   std::to_string(limits.cpu_quota * 1000) +
+							   " 100000")))
+		{
+			m_path = path;
+		}
+		else
+		{
+			::rmdir(path.c_str());
+		}
+	}
+
+	transient_cgroup(const transient_cgroup&) = delete;
+	transient_cgroup& operator=(const transient_cgroup&) = delete;
+
+	~transient_cgroup()
+	{
+		if (m_path.empty() || ::rmdir(m_path.c_str()) == 0)
+		{
+			return;
+		}
+
+		// a child that left the process group is still in there
+		write_control(m_path + "/cgroup.kill", "1");
+		for (int i = 0; i < 50 && ::rmdir(m_path.c_str()) != 0 &&
+						errno == EBUSY;
+			 ++i)
+		{
+			::usleep(10000);
+		}
+	}
+
+	bool is_open() const { return !m_path.empty(); }
+	std::string procs_path() const { return m_path + "/cgroup.procs"; }
+
+private:
+	std::string m_path;
+};
+} // namespace detail
+
+// A spawned child with its stdout connected to a pipe. It runs in its own
+// process group, so a shell pipeline can be signaled as a whole. The
+// destructor kills and reaps a child that is still running.
+class child_process
+{
+public:
+	explicit child_process(const std::vector<std::string>& argv)
+		: child_process(argv, process_limits_t(), exec_options_t())
+	{
+	}
+
+	// With limits it is forked and sets them on itself before the exec, so
+	// the processes it starts have them as well. opts.timeout is the budget
+	// for the RLIMIT_CPU in place of a cgroup.
+	child_process(const std::vector<std::string>& argv,
+				  const process_limits_t& limits, const exec_options_t& opts)
+	{
+		if (argv.empty())
+		{
+			throw std::runtime_error("execute: empty command");
+		}
+
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) != 0)
+		{
+			throw std::runtime_error(std::string("execute: pipe: ") +
+									 std::strerror(errno));
+		}
+		m_stdout.reset(fds[0]);
+		fd_handle write_end(fds[1]);
+
+		std::vector<char*> args;
+		for (const auto& a : argv)
+		{
+			args.push_back(const_cast<char*>(a.c_str()));
+		}
+		args.push_back(nullptr);
+
+		int rc = limits.empty() ? spawn(args, write_end)
+								: fork_limited(args, write_end, limits, opts);
+		if (rc != 0)
+		{
+			m_pid = -1;
+			throw std::runtime_error("execute: can not run " + argv[0] + ": " +
+									 std::strerror(rc));
+		}
+	}
+
+	child_process(const child_process&) = delete;
+	child_process& operator=(const child_process&) = delete;
+
+	~child_process()
+	{
+		if (m_pid > 0)
+		{
+			signal_group(SIGKILL);
+			int status;
+			while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR)
+			{
+			}
+		}
+	}
+
+	pid_t pid() const { return m_pid; }
+	int stdout_fd() const { return m_stdout; }
+
+	// it got the MemoryMax= and CPUQuota= through a cgroup
+	bool in_cgroup() const { return m_cgroup && m_cgroup->is_open(); }
+
+	// Read what is there. Returns false on EOF.
+	bool read_some(exec_result_t& r, std::size_t max_output)
+	{
+		char buf[64 * 1024];
+		for (;;)
+		{
+			auto len = ::read(m_stdout, buf, sizeof(buf));
+			if (len < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (len <= 0)
+			{
+				return false;
+			}
+
+			auto n = static_cast<std::size_t>(len);
+			auto room = max_output - std::min(max_output, r.output.size());
+			if (n > room)
+			{
+				r.truncated = true;
+				n = room;
+			}
+			r.output.append(buf, n);
+			return true;
+		}
+	}
+
+	void signal_group(int sig)
+	{
+		if (m_pid > 0)
+		{
+			::kill(-m_pid, sig);
+		}
+	}
+
+	// reap it without blocking. Returns true when it is gone.
+	bool try_wait(exec_result_t& r)
+	{
+		if (m_pid <= 0)
+		{
+			return true;
+		}
+
+		int status = 0;
+		struct rusage usage;
+		std::memset(&usage, 0, sizeof(usage));
+		pid_t rc = wait4(m_pid, &status, WNOHANG, &usage);
+		if (rc == 0 || (rc < 0 && errno == EINTR))
+		{
+			return false;
+		}
+
+		m_pid = -1;
+		if (rc > 0)
+		{
+			if (WIFEXITED(status))
+			{
+				r.exit_status = WEXITSTATUS(status);
+			}
+			else if (WIFSIGNALED(status))
+			{
+				r.term_signal = WTERMSIG(status);
+			}
+
+			// with the children it waited for, like those of a shell
+			auto us = [](const timeval& tv)
+			{
+				return static_cast<std::uint64_t>(tv.tv_sec) * 1000000 +
+					   static_cast<std::uint64_t>(tv.tv_usec);
+			};
+			r.cpu_us = us(usage.ru_utime) + us(usage.ru_stime);
+			r.max_rss_kb = static_cast<std::uint64_t>(usage.ru_maxrss);
+		}
+		return true;
+	}
+
+private:
+	int spawn(std::vector<char*>& args, int write_end)
+	{
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY,
+										 0);
+		posix_spawn_file_actions_adddup2(&actions, write_end, 1);
+
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+											POSIX_SPAWN_SETSIGMASK |
+											POSIX_SPAWN_SETSIGDEF);
+		posix_spawnattr_setpgroup(&attr, 0);
+
+		sigset_t mask;
+		sigemptyset(&mask);
+		posix_spawnattr_setsigmask(&attr, &mask);
+		sigset_t def;
+		sigemptyset(&def);
+		sigaddset(&def, SIGPIPE);
+		sigaddset(&def, SIGTERM);
+		sigaddset(&def, SIGINT);
+		posix_spawnattr_setsigdefault(&attr, &def);
+
+		int rc = posix_spawnp(&m_pid, args[0], &actions, &attr, args.data(),
+							  environ);
+
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		return rc;
+	}
+
+	// Between fork() and exec only async signal safe calls: another thread
+	// could hold a lock. Everything is prepared before. An exec that fails
+	// sends its errno through a pipe, like posix_spawn() returns it.
+	int fork_limited(std::vector<char*>& args, int write_end,
+					 const process_limits_t& limits,
+					 const exec_options_t& opts)
+	{
+		m_cgroup.reset(new detail::transient_cgroup(opts.cgroup_root, limits));
+		auto procs = m_cgroup->is_open() ? m_cgroup->procs_path() : "";
+
+		// without a cgroup: RLIMIT_AS for the memory, and the share of the
+		// timeout as RLIMIT_CPU. SIGXCPU at the soft limit.
+		rlim_t memory = RLIM_INFINITY;
+		rlim_t cpu = RLIM_INFINITY;
+		if (!m_cgroup->is_open())
+		{
+			if (limits.memory_max != 0)
+			{
+				memory = static_cast<rlim_t>(limits.memory_max);
+			}
+			if (limits.cpu_quota != 0 && !opts.timeout.is_special())
+			{
+				cpu = static_cast<rlim_t>(std::max<long long>(
+					1, opts.timeout.total_seconds() * limits.cpu_quota / 100));
+			}
+		}
+		// the class in the top bits, idle has no levels
+		using io_class_t = process_limits_t::io_class_t;
+		int ioprio = -1;
+		if (limits.io_class != io_class_t::none)
+		{
+			ioprio = (static_cast<int>(limits.io_class) << 13) |
+					 (limits.io_class == io_class_t::idle ? 0
+														  : limits.io_priority);
+		}
+
+		fd_handle null(::open("/dev/null", O_RDONLY | O_CLOEXEC));
+		int fds[2];
+		if (null < 0 || pipe2(fds, O_CLOEXEC) != 0)
+		{
+			return errno;
+		}
+		fd_handle error_read(fds[0]);
+		fd_handle error_write(fds[1]);
+
+		m_pid = fork();
+		if (m_pid < 0)
+		{
+			return errno;
+		}
+		if (m_pid == 0)
+		{
+			::setpgid(0, 0);
+			sigset_t mask;
+			sigemptyset(&mask);
+			sigprocmask(SIG_SETMASK, &mask, nullptr);
+			::signal(SIGPIPE, SIG_DFL);
+			::signal(SIGTERM, SIG_DFL);
+			::signal(SIGINT, SIG_DFL);
+			::dup2(null, 0);
+			::dup2(write_end, 1);
+
+			// "0" is the writer itself
+			int err = 0;
+			if (!procs.empty())
+			{
+				int fd = ::open(procs.c_str(), O_WRONLY | O_CLOEXEC);
+				if (fd < 0 || ::write(fd, "0", 1) != 1)
+				{
+					err = errno;
+				}
+				::close(fd);
+			}
+			if (limits.has_nice)
+			{
+				::setpriority(PRIO_PROCESS, 0, limits.nice);
+			}
+#ifdef SYS_ioprio_set
+			if (ioprio >= 0)
+			{
+				::syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+						  ioprio);
+			}
+#endif
+			struct rlimit rl;
+			if (memory != RLIM_INFINITY)
+			{
+				rl.rlim_cur = rl.rlim_max = memory;
+				::setrlimit(RLIMIT_AS, &rl);
+			}
+			if (cpu != RLIM_INFINITY)
+			{
+				rl.rlim_cur = cpu;
+				rl.rlim_max = cpu + 1;
+				::setrlimit(RLIMIT_CPU, &rl);
+			}
+
+			if (err == 0)
+			{
+				::execvp(args[0], args.data());
+				err = errno;
+			}
+			while (::write(error_write, &err, sizeof(err)) < 0 &&
+				   errno == EINTR)
+			{
+			}
+			_exit(127);
+		}
+
+		// no race with a signal to the group
+		::setpgid(m_pid, m_pid);
+		error_write.reset();
+		int err = 0;
+		ssize_t len;
+		while ((len = ::read(error_read, &err, sizeof(err))) < 0 &&
+			   errno == EINTR)
+		{
+		}
+		if (len == sizeof(err))
+		{
+			int status;
+			while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR)
+			{
+			}
+			return err;
+		}
+		return 0;
+	}
+
+	pid_t m_pid = -1;
+	fd_handle m_stdout;
+	std::unique_ptr<detail::transient_cgroup> m_cgroup;
+};
+
+namespace detail
+{
+using steady_t = std::chrono::steady_clock;
+
+inline int ms_until(steady_t::time_point deadline)
+{
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+				  deadline - steady_t::now())
+				  .count();
+	return ms < 0 ? 0 : static_cast<int>(std::min<long long>(ms, 1000));
+}
+
+inline steady_t::time_point deadline_after(const duration_t& d)
+{
+	if (d.is_special())
+	{
+		return steady_t::time_point::max();
+	}
+	return steady_t::now() + std::chrono::microseconds(d.total_microseconds());
+}
+} // namespace detail
+
+// Run the commands at the same time, without a shell when they dont need
+// one. The output is read in big chunks. After the deadline the process
+// groups get SIGTERM and after kill_grace SIGKILL. When done(i, result)
+// returns true for a command that finished, the others are killed and
+// marked as cancelled. The results are in the order of the commands.
+template <typename done_t>
+std::vector<exec_result_t> run_commands(const std::vector<std::string>& cmds,
+										const exec_options_t& opts,
+										done_t done)
+{
+	using detail::steady_t;
+
+	struct running_t
+	{
+		std::unique_ptr<child_process> child;
+		bool open = true;
+	};
+
+	std::vector<exec_result_t> results(cmds.size());
+	std::vector<running_t> running(cmds.size());
+	for (std::size_t i = 0; i < cmds.size(); ++i)
+	{
+		running[i].child.reset(new child_process(
+			command_argv(cmds[i]),
+			i < opts.limits.size() ? opts.limits[i] : process_limits_t(),
+			opts));
+	}
+
+	auto deadline = detail::deadline_after(opts.timeout);
+	auto kill_at = steady_t::time_point::max();
+	bool timed_out = false;
+	std::size_t left = cmds.size();
+
+	std::vector<pollfd> fds;
+	std::vector<std::size_t> polled;
+	while (left > 0)
+	{
+		auto now = steady_t::now();
+		if ((now >= deadline || stop_requested()) && !timed_out)
+		{
+			timed_out = true;
+			for (std::size_t i = 0; i < cmds.size(); ++i)
+			{
+				if (running[i].child)
+				{
+					results[i].timed_out = true;
+					running[i].child->signal_group(SIGTERM);
+				}
+			}
+			kill_at = now + std::chrono::microseconds(
+								opts.kill_grace.total_microseconds());
+		}
+		if (now >= kill_at)
+		{
+			for (auto& r : running)
+			{
+				if (r.child)
+				{
+					r.child->signal_group(SIGKILL);
+				}
+			}
+			kill_at = steady_t::time_point::max();
+		}
+
+		// after the deadline dont wait for a pipe held open by others
+		for (std::size_t i = 0; i < cmds.size(); ++i)
+		{
+			auto& r = running[i];
+			if (!r.child || (r.open && !timed_out) ||
+				!r.child->try_wait(results[i]))
+			{
+				continue;
+			}
+
+			r.child.reset();
+			--left;
+			if (done(i, results[i]))
+			{
+				// the others are killed and reaped by their destructors
+				for (std::size_t k = 0; k < cmds.size(); ++k)
+				{
+					if (running[k].child)
+					{
+						results[k].cancelled = true;
+						running[k].child.reset();
+					}
+				}
+				return results;
+			}
+		}
+		if (left == 0)
+		{
+			break;
+		}
+
+		auto next = timed_out ? kill_at : deadline;
+		int timeout_ms = next == steady_t::time_point::max()
+							 ? 1000
+							 : detail::ms_until(next);
+
+		fds.clear();
+		polled.clear();
+		for (std::size_t i = 0; i < cmds.size(); ++i)
+		{
+			if (running[i].child && running[i].open)
+			{
+				fds.push_back({running[i].child->stdout_fd(), POLLIN, 0});
+				polled.push_back(i);
+			}
+		}
+
+		// stdout is closed, but it still runs: look again soon
+		if (polled.size() < left)
+		{
+			timeout_ms = std::min(timeout_ms, 10) + 1;
+		}
+
+		int rc = poll(fds.data(), fds.size(), timeout_ms);
+		if (rc < 0 && errno != EINTR)
+		{
+			throw std::runtime_error(std::string("execute: poll: ") +
+									 std::strerror(errno));
+		}
+		for (std::size_t k = 0; rc > 0 && k < fds.size(); ++k)
+		{
+			if (fds[k].revents != 0)
+			{
+				auto i = polled[k];
+				running[i].open = running[i].child->read_some(
+					results[i], opts.max_output);
+			}
+		}
+	}
+
+	return results;
+}
+
+exec_result_t run_command(const std::string& cmd, const exec_options_t& opts)
+{
+	return run_commands({cmd}, opts,
+						[](std::size_t, const exec_result_t&) { return false; })
+		.front();
+}
+
+#else // _WIN32
+
+exec_result_t run_command(const std::string& cmd, const exec_options_t&)
+{
+	struct pipe_closer
+	{
+		void operator()(FILE* fp) const { _pclose(fp); }
+	};
+	std::unique_ptr<FILE, pipe_closer> stream(_popen(cmd.c_str(), "r"));
+	if (!stream)
+	{
+		throw std::runtime_error("execute: popen failed");
+	}
+
+	exec_result_t r;
+	char buf[4096];
+	std::size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), stream.get())) > 0)
+	{
+		r.output.append(buf, len);
+	}
+	r.exit_status = 0;
+	return r;
+}
+
+// one after the other
+template <typename done_t>
+std::vector<exec_result_t> run_commands(const std::vector<std::string>& cmds,
+										const exec_options_t& opts,
+										done_t done)
+{
+	std::vector<exec_result_t> results(cmds.size());
+	for (std::size_t i = 0; i < cmds.size(); ++i)
+	{
+		results[i] = run_command(cmds[i], opts);
+		if (done(i, results[i]))
+		{
+			for (++i; i < cmds.size(); ++i)
+			{
+				results[i].cancelled = true;
+			}
+			break;
+		}
+	}
+	return results;
+}
+
+#endif // _WIN32
+
+// run it until it exits and return its output
+std::string execute(std::string cmd)
+{
+	return run_command(cmd, exec_options_t()).output;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_process_h
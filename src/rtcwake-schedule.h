@@ -17,16 +17,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define rtcwake_schedule_h
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstdint>
 #include <iterator>
 
 #include <ctime>
 #include <iterator>
-#include <regex>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <boost/date_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 namespace rtc
 {
 using boost::gregorian::days;
@@ -44,40 +54,417 @@ inline time_point_t now()
 	return boost::posix_time::second_clock::local_time();
 }
 
-class pipe_handle
+#ifndef _WIN32
+// closes the file descriptor when it goes out of scope
+class fd_handle
 {
 public:
-	explicit pipe_handle(FILE* fp) : m_fp(fp) {}
+	explicit fd_handle(int fd = -1) : m_fd(fd) {}
+
+	fd_handle(const fd_handle&) = delete;
+	fd_handle& operator=(const fd_handle&) = delete;
+
+	fd_handle(fd_handle&& rhs) : m_fd(rhs.release()) {}
+	fd_handle& operator=(fd_handle&& rhs)
+	{
+		reset(rhs.release());
+		return *this;
+	}
+
+	~fd_handle() { reset(); }
+
+	operator int() const { return m_fd; }
 
-	operator FILE*() { return m_fp; }
+	int release()
+	{
+		int fd = m_fd;
+		m_fd = -1;
+		return fd;
+	}
 
-	~pipe_handle()
+	void reset(int fd = -1)
 	{
-		if (m_fp)
+		if (m_fd >= 0)
 		{
-#ifdef _WIN32
-			_pclose(m_fp);
-#else
-			pclose(m_fp);
+			::close(m_fd);
+		}
+		m_fd = fd;
+	}
+
+private:
+	int m_fd;
+};
 #endif
-			m_fp = 0;
+
+// a built in check for StayAwakeIf=..., evaluated without a process
+struct probe_spec_t
+{
+	enum class kind_t
+	{
+		tcp_established = 0, // tcp-established [port=445,2049]
+		logged_in_users,	 // logged-in-users
+		process,			 // process name=rsync,borg
+		busy // busy cpu=10% disk=1M net=100K window=5m interval=10s
+	};
+
+	kind_t kind = kind_t::tcp_established;
+	std::vector<unsigned> ports;	// empty: any port
+	std::vector<std::string> names; // process names
+	std::string text;				// as written in the schedule
+
+	// busy: the load has to stay at most this high for the whole window.
+	// The cpu of all cpus, the disk and the network in bytes per second.
+	unsigned cpu_percent = 10;
+	std::uint64_t disk_rate = 1 << 20;
+	std::uint64_t net_rate = 100 << 10;
+	duration_t window = minutes(5);
+	duration_t interval = seconds(10); // between the samples
+
+	// the longest time between two runs that is judged as one step, about
+	// the cron interval. After a longer one the window is watched again.
+	duration_t gap = minutes(15);
+};
+
+// WakeAlarm=rtc0 [state=mem]: set the wake up time in the RTC without
+// rtcwake. With a state it is written to /sys/power/state, without the
+// PowerDown= command runs after the alarm was set.
+struct wake_alarm_t
+{
+	std::string rtc;   // rtc0, empty: PowerDown= does it all
+	std::string state; // mem, disk, freeze or standby
+
+	bool empty() const { return rtc.empty(); }
+};
+
+// PowerDownBelow=2h /usr/sbin/rtcwake -m mem -s %d: the command for a sleep
+// shorter than 2h, instead of PowerDown=
+struct power_tier_t
+{
+	duration_t below;
+	std::string text; // of below, as written in the schedule
+	std::string command;
+};
+
+// Nice=, IOSchedulingClass=, IOSchedulingPriority=, MemoryMax= and
+// CPUQuota= of a CheckStayAwake= command, so it does not disturb the load
+// it checks for
+struct process_limits_t
+{
+	// the ioprio classes of the kernel
+	enum class io_class_t
+	{
+		none = 0,
+		realtime = 1,
+		best_effort = 2,
+		idle = 3
+	};
+
+	bool has_nice = false;
+	int nice = 0; // -20..19
+	io_class_t io_class = io_class_t::none;
+	int io_priority = 4;		  // 0..7, 0 goes first
+	std::uint64_t memory_max = 0; // bytes, 0: no limit
+	unsigned cpu_quota = 0;		  // percent of one cpu, 0: no limit
+
+	bool empty() const
+	{
+		return !has_nice && io_class == io_class_t::none && memory_max == 0 &&
+			   cpu_quota == 0;
+	}
+};
+
+// a date range that is on or off, whatever the weekly windows say
+struct override_t
+{
+	time_point_t from;
+	time_point_t to; // excluded
+	bool on = false;
+	std::size_t line = 0; // in the schedule file, for diagnostics
+
+	bool operator==(const override_t& rhs) const
+	{
+		return from == rhs.from && to == rhs.to && on == rhs.on;
+	}
+};
+
+// The overrides flattened to sorted, disjoint ranges, so a lookup is a
+// binary search. Where they overlap, the later line wins.
+class override_table
+{
+public:
+	override_table() = default;
+
+	explicit override_table(const std::vector<override_t>& overrides)
+	{
+		// sweep over the boundaries, the active override with the highest
+		// index decides
+		struct event_t
+		{
+			time_point_t at;
+			std::size_t index;
+			bool start;
+		};
+		std::vector<event_t> events;
+		for (std::size_t i = 0; i < overrides.size(); ++i)
+		{
+			if (overrides[i].from < overrides[i].to)
+			{
+				events.push_back({overrides[i].from, i, true});
+				events.push_back({overrides[i].to, i, false});
+			}
+		}
+		std::sort(events.begin(), events.end(),
+				  [](const event_t& a, const event_t& b)
+				  { return a.at < b.at; });
+
+		std::set<std::size_t> active;
+		for (std::size_t i = 0; i < events.size();)
+		{
+			auto at = events[i].at;
+			for (; i < events.size() && events[i].at == at; ++i)
+			{
+				if (events[i].start)
+					active.insert(events[i].index);
+				else
+					active.erase(events[i].index);
+			}
+
+			if (active.empty() || i == events.size())
+			{
+				continue;
+			}
+
+			const auto& winner = overrides[*active.rbegin()];
+			auto to = events[i].at;
+			if (!m_ranges.empty() && m_ranges.back().to == at &&
+				m_ranges.back().on == winner.on)
+			{
+				m_ranges.back().to = to;
+			}
+			else
+			{
+				m_ranges.push_back({at, to, winner.on, winner.line});
+			}
+		}
+	}
+
+	bool empty() const { return m_ranges.empty(); }
+	const std::vector<override_t>& ranges() const { return m_ranges; }
+
+	// the range with tp in it or nullptr
+	const override_t* find(const time_point_t tp) const
+	{
+		auto pos = after(tp);
+		if (pos == m_ranges.begin() || !(tp < std::prev(pos)->to))
+		{
+			return nullptr;
+		}
+		return &*std::prev(pos);
+	}
+
+	// the start of the first range after tp, pos_infin when there is none
+	time_point_t next_start(const time_point_t tp) const
+	{
+		auto pos = after(tp);
+		return pos == m_ranges.end()
+				   ? time_point_t(boost::posix_time::pos_infin)
+				   : pos->from;
+	}
+
+private:
+	std::vector<override_t>::const_iterator after(const time_point_t tp) const
+	{
+		return std::upper_bound(m_ranges.begin(), m_ranges.end(), tp,
+								[](const time_point_t& t, const override_t& o)
+								{ return t < o.from; });
+	}
+
+	std::vector<override_t> m_ranges;
+};
+
+// a change of the UTC offset
+struct zone_transition_t
+{
+	std::int64_t at;	   // seconds since 1970-01-01 00:00 UTC
+	std::int32_t offset;   // seconds east of UTC from then on
+	std::int32_t dst = 0; // it is daylight saving time
+
+	bool operator==(const zone_transition_t& rhs) const
+	{
+		return at == rhs.at && offset == rhs.offset && dst == rhs.dst;
+	}
+};
+
+// the tzdata file a time_zone_table was loaded from, to see when it changed
+struct zone_source_t
+{
+	std::string name; // $TZ or the path
+	std::string path;
+	std::uint64_t device = 0;
+	std::uint64_t inode = 0;
+	std::int64_t mtime_sec = 0;
+	std::int64_t mtime_nsec = 0;
+	std::uint64_t size = 0;
+
+	bool operator==(const zone_source_t& rhs) const
+	{
+		return name == rhs.name && path == rhs.path &&
+			   device == rhs.device && inode == rhs.inode &&
+			   mtime_sec == rhs.mtime_sec &&
+			   mtime_nsec == rhs.mtime_nsec && size == rhs.size;
+	}
+	bool operator!=(const zone_source_t& rhs) const { return !(*this == rhs); }
+};
+
+// The UTC offsets of the local time zone over the years, loaded once from
+// the tzdata. Wake up times are local times of the schedule, the sleep
+// between two of them is the difference of their UTC times. A local time
+// in the hour skipped in spring is at the switch, one in the repeated hour
+// in autumn is its first occurrence. Without transitions the local times are
+// taken as they are.
+class time_zone_table
+{
+public:
+	time_zone_table() = default;
+
+	// the transitions sorted by time. The first one holds the offset before
+	// all others, its time does not matter.
+	time_zone_table(std::vector<zone_transition_t> transitions,
+					zone_source_t source = zone_source_t())
+		: m_transitions(std::move(transitions)), m_source(std::move(source))
+	{
+		if (!m_transitions.empty())
+		{
+			m_transitions.front().at = std::numeric_limits<std::int64_t>::min();
+		}
+	}
+
+	bool empty() const { return m_transitions.empty(); }
+	const std::vector<zone_transition_t>& transitions() const
+	{
+		return m_transitions;
+	}
+	const zone_source_t& source() const { return m_source; }
+
+	// seconds east of UTC at the UTC time
+	std::int32_t offset_at(std::int64_t utc) const
+	{
+		return empty() ? 0 : m_transitions[index_at(utc)].offset;
+	}
+
+	time_point_t to_local(const time_point_t utc) const
+	{
+		return utc + seconds(offset_at(to_seconds(utc)));
+	}
+
+	time_point_t to_utc(const time_point_t local) const
+	{
+		if (empty() || local.is_special())
+		{
+			return local;
+		}
+
+		// the offsets are much shorter than the time between transitions:
+		// only the neighbours of the one at 'local' come into question
+		auto l = to_seconds(local);
+		auto frac = local - epoch() - seconds(l);
+		auto i = index_at(l);
+		auto first = i > 0 ? i - 1 : 0;
+		auto last = std::min(i + 1, m_transitions.size() - 1);
+
+		// the first occurence
+		for (auto k = first; k <= last; ++k)
+		{
+			auto utc = l - m_transitions[k].offset;
+			if (index_at(utc) == k)
+			{
+				return epoch() + seconds(utc) + frac;
+			}
+		}
+
+		// skipped: the clock jumped over it at the switch
+		for (auto k = std::max<std::size_t>(first, 1); k <= last; ++k)
+		{
+			auto at = m_transitions[k].at;
+			if (l - m_transitions[k].offset < at &&
+				at <= l - m_transitions[k - 1].offset)
+			{
+				return epoch() + seconds(at);
+			}
 		}
+		return epoch() + seconds(l - m_transitions[i].offset) + frac;
+	}
+
+	// the time between two local times, as the clock of the world runs
+	duration_t between(const time_point_t from, const time_point_t to) const
+	{
+		return to_utc(to) - to_utc(from);
 	}
 
 private:
-	FILE* m_fp;
+	static time_point_t epoch() { return time_point_t(date(1970, 1, 1)); }
+
+	// floored seconds since epoch
+	static std::int64_t to_seconds(const time_point_t tp)
+	{
+		auto us = (tp - epoch()).total_microseconds();
+		return us / 1000000 - (us % 1000000 < 0 ? 1 : 0);
+	}
+
+	std::size_t index_at(std::int64_t utc) const
+	{
+		auto pos = std::upper_bound(
+			m_transitions.begin(), m_transitions.end(), utc,
+			[](std::int64_t t, const zone_transition_t& z) { return t < z.at; });
+		return pos == m_transitions.begin()
+				   ? 0
+				   : static_cast<std::size_t>(pos - m_transitions.begin()) - 1;
+	}
+
+	std::vector<zone_transition_t> m_transitions;
+	zone_source_t m_source;
 };
 
 struct cmd_t
 {
 	std::string power_down;
-	std::string check_stay_awake;
+	std::vector<std::string> check_stay_awake; // they run in parallel
+	std::vector<probe_spec_t> probes;
+	wake_alarm_t wake_alarm;
+	std::vector<power_tier_t> power_tiers; // sorted by below
+
+	// WakeLead=: wake up this much before a window starts. By the second
+	// of the week the window starts at, or for all of them.
+	duration_t wake_lead = seconds(0);
+	std::map<long, duration_t> window_leads;
+
+	// WarmUp=: the files to read into the page cache after the wake up
+	std::string warm_up;
+
+	// CheckStayAwake gets killed after this time
+	duration_t command_timeout = seconds(60);
+
+	// CacheFor=: how long a positive result of the check with this text is
+	// reused. It applies to the CheckStayAwake= or StayAwakeIf= line before.
+	std::map<std::string, duration_t> cache_for;
+	std::string last_check;
+
+	// the limits of the CheckStayAwake= command with this text
+	std::map<std::string, process_limits_t> limits;
+
+	// the dated lines like "2026-08-01..2026-08-14 off"
+	override_table overrides;
+
+	// the local time zone, not from the schedule file
+	time_zone_table zone;
 };
 
 struct action_t
 {
 	time_point_t on;
 	time_point_t off;
+	std::size_t line = 0;	   // in the schedule file, for diagnostics
+	std::uint32_t source = 0; // the file, when there are fragments
 
 	bool operator==(const action_t& rhs) const
 	{
@@ -152,297 +539,1707 @@ duration_t to_day_duration(std::string s)
 	return hours(scale * 24);
 }
 
-duration_t to_hour_duration(std::string s)
+// error while reading the schedule. Knows where in the file it happened.
+class parse_error : public std::runtime_error
 {
-	std::regex ex("([0-2][0-9]):([0-5][0-9])");
-	std::smatch what;
-	if (std::regex_match(s, what, ex))
-	{
-		auto h = std::atol(what[1].str().c_str());
-		auto m = std::atol(what[2].str().c_str());
-		return hours(h) + minutes(m);
-	}
-	else
+public:
+	parse_error(const std::string& what, std::size_t line, std::size_t column)
+		: std::runtime_error(what), m_line(line), m_column(column)
 	{
-		std::string msg = "to_hour_duration(): Unrecognized string: " + s;
-		throw std::runtime_error(msg);
 	}
-}
 
-template <typename inserter_t>
-cmd_t read_schedule(inserter_t inserter, std::istream& is,
-					const time_point_t now)
+	// 1 based
+	std::size_t line() const { return m_line; }
+	std::size_t column() const { return m_column; }
+
+private:
+	std::size_t m_line;
+	std::size_t m_column;
+};
+
+namespace detail
 {
-	// get the begin of this week
-	auto week_start = get_week_start(now);
+// "Day:HH:MM" as written in the schedule
+struct week_time_t
+{
+	int day = 0;
+	int hour = 0;
+	int minute = 0;
+};
 
-	// clang-format off
-	std::regex ex_action("(Mon|Tue|Wed|Thu|Fri|Sat|Sun):([0-2][0-9]):([0-5][0-9])\\-(Mon|Tue|Wed|Thu|Fri|Sat|Sun):([0-2][0-9]):([0-5][0-9])( |\t|#.*)*");
-	// clang-format on
-	std::regex ex_comment("^(#.*)|( |\\t)*");
-	std::regex ex_stay_awake("CheckStayAwake=(.*)");
-	std::regex ex_power_down("PowerDown=(.*)");
+// A cursor over a single line of the schedule. It works directly on the
+// characters and remembers the furthest position it could match, so a
+// rejected line can be reported with the column where it went wrong.
+class line_scanner
+{
+public:
+	explicit line_scanner(const std::string& line) : m_line(line) {}
 
-	cmd_t cmd;
+	bool at_end() const { return m_pos == m_line.size(); }
+	std::size_t pos() const { return m_pos; }
+	std::size_t furthest() const { return m_furthest; }
+	void rewind(std::size_t pos) { m_pos = pos; }
 
-	std::string line;
-	std::smatch what;
-	while (std::getline(is, line))
+	bool accept(char c)
 	{
-		if (std::regex_match(line, what, ex_action))
+		if (m_pos < m_line.size() && m_line[m_pos] == c)
 		{
-			std::string start_day = what[1].str();
-			std::string start_time = what[2].str() + ":" + what[3].str();
+			advance(1);
+			return true;
+		}
+		return false;
+	}
 
-			std::string end_day = what[4].str();
-			std::string end_time = what[5].str() + ":" + what[6].str();
+	// a single digit in the range [lo, hi]
+	bool accept_digit(char lo, char hi, int& value)
+	{
+		if (m_pos < m_line.size() && m_line[m_pos] >= lo &&
+			m_line[m_pos] <= hi)
+		{
+			value = m_line[m_pos] - '0';
+			advance(1);
+			return true;
+		}
+		return false;
+	}
 
-			// convert it to a action
-			time_point_t on = week_start;
-			time_point_t off = on;
+	// Mon|Tue|Wed|Thu|Fri|Sat|Sun
+	bool accept_day(int& day)
+	{
+		static const char* names[] = {"Mon", "Tue", "Wed", "Thu",
+									  "Fri", "Sat", "Sun"};
+		for (int i = 0; i < 7; ++i)
+		{
+			std::size_t n = 0;
+			while (n < 3 && m_pos + n < m_line.size() &&
+				   m_line[m_pos + n] == names[i][n])
+			{
+				++n;
+			}
+			m_furthest = std::max(m_furthest, m_pos + n);
 
-			on += to_hour_duration(start_time);
-			on += to_day_duration(start_day);
+			if (n == 3)
+			{
+				day = i;
+				advance(3);
+				return true;
+			}
+		}
+		return false;
+	}
 
-			off += to_hour_duration(end_time);
-			off += to_day_duration(end_day);
+	// [0-2][0-9]:[0-5][0-9]
+	bool accept_time(int& hour, int& minute)
+	{
+		int h1, h2, m1, m2;
+		if (accept_digit('0', '2', h1) && accept_digit('0', '9', h2) &&
+			accept(':') && accept_digit('0', '5', m1) &&
+			accept_digit('0', '9', m2))
+		{
+			hour = h1 * 10 + h2;
+			minute = m1 * 10 + m2;
+			return true;
+		}
+		return false;
+	}
 
-			// handle the special case: like "Sun:16:00-Mon:01:00"
-			if (off < on)
+	// YYYY-MM-DD, a valid date
+	bool accept_date(date& d)
+	{
+		int v[8];
+		if (accept_digit('0', '9', v[0]) && accept_digit('0', '9', v[1]) &&
+			accept_digit('0', '9', v[2]) && accept_digit('0', '9', v[3]) &&
+			accept('-') && accept_digit('0', '1', v[4]) &&
+			accept_digit('0', '9', v[5]) && accept('-') &&
+			accept_digit('0', '3', v[6]) && accept_digit('0', '9', v[7]))
+		{
+			try
+			{
+				d = date(static_cast<unsigned short>(v[0] * 1000 + v[1] * 100 +
+													 v[2] * 10 + v[3]),
+						 static_cast<unsigned short>(v[4] * 10 + v[5]),
+						 static_cast<unsigned short>(v[6] * 10 + v[7]));
+				return true;
+			}
+			catch (const std::out_of_range&)
 			{
-				// but this also means we need to add on time week_start to off
-				inserter = {week_start, off};
-
-				// this is the last entry
-				off += hours(7 * 24);
 			}
+		}
+		return false;
+	}
 
-			inserter = {on, off};
+	// [A-Za-z]+
+	bool accept_identifier(std::string& id)
+	{
+		auto start = m_pos;
+		while (m_pos < m_line.size() &&
+			   ((m_line[m_pos] >= 'a' && m_line[m_pos] <= 'z') ||
+				(m_line[m_pos] >= 'A' && m_line[m_pos] <= 'Z')))
+		{
+			advance(1);
 		}
-		else if (std::regex_match(line, what, ex_comment))
+		id.assign(m_line, start, m_pos - start);
+		return m_pos != start;
+	}
+
+	// the rest of the line. Like ".*" it does not accept a '\r'
+	bool accept_rest(std::string& rest)
+	{
+		auto cr = m_line.find('\r', m_pos);
+		if (cr != std::string::npos)
 		{
-			// skip this comment
+			m_furthest = std::max(m_furthest, cr);
+			return false;
 		}
-		else if (std::regex_match(line, what, ex_power_down))
+		rest.assign(m_line, m_pos, std::string::npos);
+		advance(m_line.size() - m_pos);
+		return true;
+	}
+
+	// ( |\t)*
+	void skip_blanks()
+	{
+		while (m_pos < m_line.size() &&
+			   (m_line[m_pos] == ' ' || m_line[m_pos] == '\t'))
 		{
-			// this is the command to power down the PC
-			cmd.power_down = what[1].str();
+			advance(1);
 		}
-		else if (std::regex_match(line, what, ex_stay_awake))
+	}
+
+private:
+	void advance(std::size_t n)
+	{
+		m_pos += n;
+		m_furthest = std::max(m_furthest, m_pos);
+	}
+
+	const std::string& m_line;
+	std::size_t m_pos = 0;
+	std::size_t m_furthest = 0;
+};
+
+// Day:HH:MM-Day:HH:MM( |\t|#.*)*
+inline bool scan_action(line_scanner& scanner, week_time_t& start,
+						week_time_t& end)
+{
+	if (scanner.accept_day(start.day) && scanner.accept(':') &&
+		scanner.accept_time(start.hour, start.minute) && scanner.accept('-') &&
+		scanner.accept_day(end.day) && scanner.accept(':') &&
+		scanner.accept_time(end.hour, end.minute))
+	{
+		scanner.skip_blanks();
+
+		std::string comment;
+		if (scanner.accept('#') && scanner.accept_rest(comment))
 		{
-			// this is the command to power down the PC
-			cmd.check_stay_awake = what[1].str();
+			return true;
 		}
-		else
+		if (scanner.at_end())
 		{
-			std::string msg =
-				"read_schedule(): Unrecognized syntax at line: " + line;
-			throw std::runtime_error(msg);
+			return true;
 		}
 	}
 
-	return cmd;
+	scanner.rewind(0);
+	return false;
 }
 
-template <typename iterator_t>
-void check_schedule(iterator_t begin, iterator_t end)
-{
-	// 1. check on < off and next on > last off
-	auto pos1 = std::adjacent_find(
-		begin, end, [](const action_t& a1, const action_t& a2) -> bool
-		{ return a1.off > a2.on; });
-	if (pos1 != end)
-	{
-		throw std::runtime_error(
-			"check_schedule: next off time < current on time");
-	}
-
-	// 2. check that each items on < off
-	auto pos2 = std::find_if(begin, end,
-							 [](const action_t& a) -> bool
-							 {
-								 bool tmp = a.off > a.on;
-								 if (!tmp)
-									 return false;
-								 else
-								 {
-									 // everything ok, if we go to the next week
-									 assert(a.off > a.on);
-									 return (a.off - a.on) > hours(24 * 7);
-								 }
-							 });
-	if (pos2 != end)
-	{
-		throw std::runtime_error("check_schedule: off time < on time");
-	}
-
-	// 3. check for overlaps
-	auto pos3 =
-		std::find_if(begin, end,
-					 [begin, end](const action_t& a) -> bool
-					 {
-						 auto p = std::find_if(
-							 begin, end,
-							 [a](const action_t& b) -> bool
-							 {
-								 if (a == b) // same action, dont mind
-									 return false;
-								 else
-								 {
-									 return (a.on >= b.on && a.on <= b.off);
-								 }
-							 });
-
-						 return p != end;
-					 });
-	if (pos3 != end)
-	{
-		throw std::runtime_error("check_schedule: overlaping schedules");
+// ( |\t)*(#.*)?
+inline bool scan_line_end(line_scanner& scanner)
+{
+	scanner.skip_blanks();
+
+	std::string comment;
+	if (scanner.accept('#'))
+	{
+		return scanner.accept_rest(comment);
 	}
+	return scanner.at_end();
 }
 
-template <typename iterator_t>
-bool get_state(iterator_t begin, iterator_t end, const time_point_t tp)
+// Date ranges:
+//   YYYY-MM-DD HH:MM-YYYY-MM-DD HH:MM on|off
+//   YYYY-MM-DD..YYYY-MM-DD on|off (whole days)
+//   YYYY-MM-DD on|off
+// followed by ( |\t|#.*)*
+inline bool scan_override(line_scanner& scanner, override_t& o)
 {
-	auto pos_is_on = std::find_if(begin, end,
-								  [tp](const action_t& a) -> bool
-								  {
-									  if (a.on < a.off)
-									  {
-										  return a.on <= tp && tp < a.off;
-									  }
-									  else
-									  {
-										  // sunday->monday
-										  if (a.on <= tp)
-											  return true;
-										  else if (tp < a.off)
-											  return true;
-										  else
-											  return false;
-									  }
-								  });
-
-	return pos_is_on != end;
-}
+	date first;
+	if (scanner.accept_date(first))
+	{
+		auto mark = scanner.pos();
+		date last;
+		int h1, m1, h2, m2;
 
-template <typename iterator_t>
-time_point_t get_next_on_time(iterator_t begin, iterator_t end,
-							  const time_point_t tp)
-{
-	// 1. check on < off and next on > last off
-	auto pos = std::adjacent_find(
-		begin, end, [tp](const action_t& a1, const action_t& a2) -> bool
-		{ return a1.off <= tp && tp < a2.on; });
+		scanner.skip_blanks();
+		bool timed = scanner.accept_time(h1, m1) && scanner.accept('-') &&
+					 scanner.accept_date(last);
+		if (timed)
+		{
+			scanner.skip_blanks();
+			timed = scanner.accept_time(h2, m2);
+		}
 
-	if (pos == end)
-	{
-		// the time is before or after the last entry in the schedule
-		auto distance = std::distance(begin, end);
-		if (std::distance(begin, end) > 0)
+		if (timed)
+		{
+			o.from = time_point_t(first, hours(h1) + minutes(m1));
+			o.to = time_point_t(last, hours(h2) + minutes(m2));
+		}
+		else
 		{
-			// is the time before the first entry?
-			if (tp < begin->on)
+			scanner.rewind(mark);
+			if (scanner.accept('.'))
 			{
-				// ok we need to sleep until the first entry in the schedule
-				return begin->on;
+				if (!scanner.accept('.') || !scanner.accept_date(last))
+				{
+					scanner.rewind(0);
+					return false;
+				}
 			}
-
-			// is the next start in the next week?
-			if (tp > (begin + distance)->off)
+			else
 			{
-				// ok: wee need to sleep until the start in the next week
-				return begin->on + boost::posix_time::hours(7 * 24);
+				last = first;
 			}
+			o.from = time_point_t(first);
+			o.to = time_point_t(last + days(1));
 		}
 
-		// we failed to get the next on time: Print some debug info
-		std::string debug;
-		debug += "TP: " + boost::posix_time::to_iso_string(tp) + "\n";
-		for (iterator_t it = begin; it != end; ++it)
+		std::string state;
+		auto blanks = scanner.pos();
+		scanner.skip_blanks();
+		if (scanner.pos() != blanks && scanner.accept_identifier(state) &&
+			(state == "on" || state == "off") && scan_line_end(scanner))
 		{
-			debug += to_string(*it) + "\n";
+			o.on = state == "on";
+			return true;
 		}
+	}
+
+	scanner.rewind(0);
+	return false;
+}
 
-		throw std::runtime_error("get_next_on_time: pos == end failed\n" +
-								 debug);
+// #.* or ( |\t)*
+inline bool scan_comment(line_scanner& scanner)
+{
+	std::string comment;
+	if (scanner.accept('#') && scanner.accept_rest(comment))
+	{
+		return true;
 	}
+	scanner.rewind(0);
 
-	pos++;
-	if (pos == end)
+	scanner.skip_blanks();
+	if (scanner.at_end())
 	{
-		// The last entry reached, go to the forst one
-		pos = begin;
+		return true;
 	}
 
-	auto a = *pos;
-	return a.on;
+	scanner.rewind(0);
+	return false;
 }
 
-// we return the command. This way we can test the function much easier
-template <typename iterator_t>
-std::string build_power_off_command(iterator_t begin, iterator_t end,
-									cmd_t cmds, const time_point_t now)
+// Key=.*
+inline bool scan_directive(line_scanner& scanner, std::string& key,
+						   std::string& value)
 {
-	// execute the power down command
-	auto wake_up_at = get_next_on_time(begin, end, now);
-	if (wake_up_at < now)
+	if (scanner.accept_identifier(key) && scanner.accept('=') &&
+		scanner.accept_rest(value))
 	{
-		std::string msg = "power_off: wake_up_at < now: Software error";
+		return true;
+	}
+
+	scanner.rewind(0);
+	return false;
+}
+
+// "90", "90s", "10m", "2h", "1d" or combined like "1h30m". Without a unit
+// it is seconds.
+inline bool parse_duration(const std::string& s, duration_t& d)
+{
+	line_scanner scanner(s);
+	duration_t sum = seconds(0);
+	do
+	{
+		int digit = 0;
+		if (!scanner.accept_digit('0', '9', digit))
+		{
+			return false;
+		}
+
+		long value = digit;
+		while (scanner.accept_digit('0', '9', digit))
+		{
+			if (value > 100000000)
+			{
+				return false;
+			}
+			value = value * 10 + digit;
+		}
+
+		if (scanner.accept('d'))
+			sum += hours(24 * value);
+		else if (scanner.accept('h'))
+			sum += hours(value);
+		else if (scanner.accept('m'))
+			sum += minutes(value);
+		else
+		{
+			scanner.accept('s');
+			sum += seconds(value);
+		}
+	} while (!scanner.at_end());
+
+	d = sum;
+	return true;
+}
+
+// the blank separated words of s
+inline std::vector<std::string> split_words(const std::string& s,
+											const char* separators = " \t")
+{
+	std::vector<std::string> words;
+	std::size_t pos = 0;
+	for (;;)
+	{
+		auto start = s.find_first_not_of(separators, pos);
+		if (start == std::string::npos)
+		{
+			break;
+		}
+		pos = s.find_first_of(separators, start);
+		words.push_back(s.substr(start, pos - start));
+	}
+	return words;
+}
+
+// a whole number from min to max
+inline bool parse_number(const std::string& s, long min, long max, long& n)
+{
+	std::size_t digits = s.find_first_not_of("0123456789", s[0] == '-');
+	if (s.empty() || s == "-" || digits != std::string::npos ||
+		s.size() > 10)
+	{
+		return false;
+	}
+	n = std::stol(s);
+	return min <= n && n <= max;
+}
+
+// "512K", "256M", "1G" or bytes
+inline bool parse_bytes(const std::string& s, std::uint64_t& bytes)
+{
+	std::uint64_t unit = 1;
+	auto digits = s;
+	switch (s.empty() ? 0 : s.back())
+	{
+		case 'K':
+			unit = 1ULL << 10;
+			break;
+		case 'M':
+			unit = 1ULL << 20;
+			break;
+		case 'G':
+			unit = 1ULL << 30;
+			break;
+	}
+	if (unit != 1)
+	{
+		digits.pop_back();
+	}
+
+	long n = 0;
+	if (!parse_number(digits, 1, 1L << 30, n))
+	{
+		return false;
+	}
+	bytes = static_cast<std::uint64_t>(n) * unit;
+	return true;
+}
+
+// "tcp-established port=445,2049", "logged-in-users", "process name=rsync",
+// "busy cpu=10% disk=1M net=100K window=5m interval=10s"
+inline bool parse_probe(const std::string& value, probe_spec_t& probe)
+{
+	using kind_t = probe_spec_t::kind_t;
+
+	auto words = split_words(value);
+	if (words.empty())
+	{
+		return false;
+	}
+
+	probe = probe_spec_t();
+	probe.text = value;
+	if (words[0] == "tcp-established")
+		probe.kind = kind_t::tcp_established;
+	else if (words[0] == "logged-in-users")
+		probe.kind = kind_t::logged_in_users;
+	else if (words[0] == "process")
+		probe.kind = kind_t::process;
+	else if (words[0] == "busy")
+		probe.kind = kind_t::busy;
+	else
+		return false;
+
+	for (std::size_t i = 1; i < words.size(); ++i)
+	{
+		auto eq = words[i].find('=');
+		if (eq == std::string::npos)
+		{
+			return false;
+		}
+		auto key = words[i].substr(0, eq);
+		auto arg = words[i].substr(eq + 1);
+		auto list = split_words(arg, ",");
+		if (list.empty())
+		{
+			return false;
+		}
+
+		long percent = 0;
+		if (probe.kind == kind_t::busy)
+		{
+			if (key == "cpu" && arg.back() == '%' &&
+				parse_number(arg.substr(0, arg.size() - 1), 0, 100, percent))
+			{
+				probe.cpu_percent = static_cast<unsigned>(percent);
+			}
+			else if (!(key == "disk" && parse_bytes(arg, probe.disk_rate)) &&
+					 !(key == "net" && parse_bytes(arg, probe.net_rate)) &&
+					 !(key == "window" && parse_duration(arg, probe.window)) &&
+					 !(key == "interval" &&
+					   parse_duration(arg, probe.interval)) &&
+					 !(key == "gap" && parse_duration(arg, probe.gap)))
+			{
+				return false;
+			}
+		}
+		else if (key == "port" && probe.kind == kind_t::tcp_established)
+		{
+			for (const auto& p : list)
+			{
+				if (p.size() > 5 ||
+					p.find_first_not_of("0123456789") != std::string::npos)
+				{
+					return false;
+				}
+				auto port = std::stoul(p);
+				if (port == 0 || port > 65535)
+				{
+					return false;
+				}
+				probe.ports.push_back(static_cast<unsigned>(port));
+			}
+		}
+		else if (key == "name" && probe.kind == kind_t::process)
+		{
+			probe.names.insert(probe.names.end(), list.begin(), list.end());
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	// the ring keeps up to 500 samples of the window
+	if (probe.kind == kind_t::busy)
+	{
+		return probe.interval >= seconds(1) && probe.window >= probe.interval &&
+			   probe.gap >= probe.interval &&
+			   probe.window.total_seconds() / probe.interval.total_seconds() <=
+				   500;
+	}
+
+	// which process?
+	return probe.kind != kind_t::process || !probe.names.empty();
+}
+
+// PowerDownBelow=2h /usr/sbin/rtcwake -m mem -s %d
+inline bool parse_power_tier(const std::string& value, power_tier_t& tier)
+{
+	auto space = value.find_first_of(" \t");
+	auto command = space == std::string::npos
+					   ? std::string::npos
+					   : value.find_first_not_of(" \t", space);
+	if (command == std::string::npos)
+	{
+		return false;
+	}
+
+	tier = power_tier_t();
+	tier.text = value.substr(0, space);
+	tier.command = value.substr(command);
+	return parse_duration(tier.text, tier.below) && tier.below > seconds(0);
+}
+
+// the tiers stay sorted by their limit, the same limit again replaces it
+inline void set_power_tier(std::vector<power_tier_t>& tiers,
+						   const power_tier_t& tier)
+{
+	auto pos = std::lower_bound(tiers.begin(), tiers.end(), tier,
+								[](const power_tier_t& a, const power_tier_t& b)
+								{ return a.below < b.below; });
+	if (pos != tiers.end() && pos->below == tier.below)
+	{
+		*pos = tier;
+	}
+	else
+	{
+		tiers.insert(pos, tier);
+	}
+}
+
+// the limits follow the CheckStayAwake= line, they make no sense for the
+// built in probes
+inline process_limits_t* last_command_limits(cmd_t& cmd)
+{
+	if (cmd.check_stay_awake.empty() ||
+		cmd.check_stay_awake.back() != cmd.last_check)
+	{
+		return nullptr;
+	}
+	return &cmd.limits[cmd.last_check];
+}
+
+// Nice=10, IOSchedulingClass=idle, IOSchedulingPriority=7, MemoryMax=256M,
+// CPUQuota=20%
+inline bool parse_limit(const std::string& key, const std::string& value,
+						process_limits_t& limits)
+{
+	using io_class_t = process_limits_t::io_class_t;
+
+	long n = 0;
+	if (key == "Nice")
+	{
+		limits.has_nice = parse_number(value, -20, 19, n);
+		limits.nice = static_cast<int>(n);
+		return limits.has_nice;
+	}
+	if (key == "IOSchedulingClass")
+	{
+		if (value == "realtime")
+			limits.io_class = io_class_t::realtime;
+		else if (value == "best-effort")
+			limits.io_class = io_class_t::best_effort;
+		else if (value == "idle")
+			limits.io_class = io_class_t::idle;
+		else
+			return false;
+		return true;
+	}
+	if (key == "IOSchedulingPriority")
+	{
+		if (!parse_number(value, 0, 7, n))
+		{
+			return false;
+		}
+		limits.io_priority = static_cast<int>(n);
+		if (limits.io_class == io_class_t::none)
+		{
+			limits.io_class = io_class_t::best_effort;
+		}
+		return true;
+	}
+	if (key == "MemoryMax")
+	{
+		return parse_bytes(value, limits.memory_max);
+	}
+	if (key == "CPUQuota")
+	{
+		if (value.empty() || value.back() != '%' ||
+			!parse_number(value.substr(0, value.size() - 1), 1, 100000, n))
+		{
+			return false;
+		}
+		limits.cpu_quota = static_cast<unsigned>(n);
+		return true;
+	}
+	return false;
+}
+
+// WakeLead=10m [Mon:16:00]
+inline bool parse_wake_lead(const std::string& value, cmd_t& cmd)
+{
+	auto words = split_words(value);
+	duration_t lead;
+	if (words.empty() || words.size() > 2 || !parse_duration(words[0], lead))
+	{
+		return false;
+	}
+	if (words.size() == 1)
+	{
+		cmd.wake_lead = lead;
+		return true;
+	}
+
+	line_scanner scanner(words[1]);
+	week_time_t t;
+	if (!scanner.accept_day(t.day) || !scanner.accept(':') ||
+		!scanner.accept_time(t.hour, t.minute) || !scanner.at_end() ||
+		t.hour > 23)
+	{
+		return false;
+	}
+	cmd.window_leads[(t.day * 24L + t.hour) * 3600 + t.minute * 60] = lead;
+	return true;
+}
+
+// WakeAlarm=rtc0 state=mem
+inline bool parse_wake_alarm(const std::string& value, wake_alarm_t& alarm)
+{
+	auto words = split_words(value);
+	if (words.empty() || words.size() > 2 ||
+		words[0].find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_-") !=
+			std::string::npos)
+	{
+		return false;
+	}
+
+	alarm = wake_alarm_t();
+	alarm.rtc = words[0];
+	if (words.size() == 2)
+	{
+		const std::string key = "state=";
+		if (words[1].compare(0, key.size(), key) != 0)
+		{
+			return false;
+		}
+		alarm.state = words[1].substr(key.size());
+		if (alarm.state != "mem" && alarm.state != "disk" &&
+			alarm.state != "freeze" && alarm.state != "standby")
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+inline duration_t to_duration(const week_time_t& t)
+{
+	return hours(t.day * 24 + t.hour) + minutes(t.minute);
+}
+
+inline parse_error syntax_error(const std::string& line, std::size_t line_no,
+								std::size_t column)
+{
+	std::string msg = "read_schedule(): Unrecognized syntax at line " +
+					  std::to_string(line_no) + ", column " +
+					  std::to_string(column) + ": " + line;
+	return parse_error(msg, line_no, column);
+}
+} // namespace detail
+
+duration_t to_hour_duration(std::string s)
+{
+	detail::line_scanner scanner(s);
+
+	int h = 0;
+	int m = 0;
+	if (scanner.accept_time(h, m) && scanner.at_end())
+	{
+		return hours(h) + minutes(m);
+	}
+	else
+	{
+		std::string msg = "to_hour_duration(): Unrecognized string: " + s;
+		throw std::runtime_error(msg);
+	}
+}
+
+// a "Key=value" line of the schedule. Returns false for an unknown key.
+bool apply_directive(cmd_t& cmd, const std::string& key,
+					 const std::string& value)
+{
+	if (key == "PowerDown")
+	{
+		// this is the command to power down the PC
+		cmd.power_down = value;
+	}
+	else if (key == "CheckStayAwake")
+	{
+		// a command to check if we should stay awake. There can be more.
+		cmd.check_stay_awake.push_back(value);
+		cmd.last_check = value;
+	}
+	else if (key == "CommandTimeout")
+	{
+		return detail::parse_duration(value, cmd.command_timeout);
+	}
+	else if (key == "StayAwakeIf")
+	{
+		// a built in check, evaluated without starting a process
+		probe_spec_t probe;
+		if (!detail::parse_probe(value, probe))
+		{
+			return false;
+		}
+		cmd.probes.push_back(probe);
+		cmd.last_check = probe.text;
+	}
+	else if (key == "CacheFor")
+	{
+		duration_t d;
+		if (cmd.last_check.empty() || !detail::parse_duration(value, d))
+		{
+			return false;
+		}
+		cmd.cache_for[cmd.last_check] = d;
+	}
+	else if (key == "Nice" || key == "IOSchedulingClass" ||
+			 key == "IOSchedulingPriority" || key == "MemoryMax" ||
+			 key == "CPUQuota")
+	{
+		// how the CheckStayAwake= command before is started
+		auto* limits = detail::last_command_limits(cmd);
+		return limits && detail::parse_limit(key, value, *limits);
+	}
+	else if (key == "PowerDownBelow")
+	{
+		// the command for shorter sleeps
+		power_tier_t tier;
+		if (!detail::parse_power_tier(value, tier))
+		{
+			return false;
+		}
+		detail::set_power_tier(cmd.power_tiers, tier);
+	}
+	else if (key == "WakeLead")
+	{
+		// wake up earlier, for all windows or the one starting then
+		return detail::parse_wake_lead(value, cmd);
+	}
+	else if (key == "WarmUp")
+	{
+		cmd.warm_up = value;
+	}
+	else if (key == "WakeAlarm")
+	{
+		// the RTC is set directly, instead of %d in PowerDown=
+		return detail::parse_wake_alarm(value, cmd.wake_alarm);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+template <typename inserter_t>
+cmd_t read_schedule(inserter_t inserter, std::istream& is,
+					const time_point_t now)
+{
+	// get the begin of this week
+	auto week_start = get_week_start(now);
+
+	cmd_t cmd;
+	std::vector<override_t> overrides;
+
+	std::string line;
+	std::size_t line_no = 0;
+	while (std::getline(is, line))
+	{
+		++line_no;
+
+		detail::line_scanner scanner(line);
+		detail::week_time_t start;
+		detail::week_time_t end;
+		override_t o;
+		std::string key;
+		std::string value;
+
+		if (detail::scan_action(scanner, start, end))
+		{
+			// convert it to a action
+			time_point_t on = week_start + detail::to_duration(start);
+			time_point_t off = week_start + detail::to_duration(end);
+
+			// handle the special case: like "Sun:16:00-Mon:01:00"
+			if (off < on)
+			{
+				// but this also means we need to add on time week_start to off
+				inserter = {week_start, off, line_no};
+
+				// this is the last entry
+				off += hours(7 * 24);
+			}
+
+			inserter = {on, off, line_no};
+		}
+		else if (detail::scan_override(scanner, o))
+		{
+			if (!(o.from < o.to))
+			{
+				// ends before it starts
+				throw detail::syntax_error(line, line_no, 1);
+			}
+			o.line = line_no;
+			overrides.push_back(o);
+		}
+		else if (detail::scan_comment(scanner))
+		{
+			// skip this comment
+		}
+		else if (detail::scan_directive(scanner, key, value))
+		{
+			if (!apply_directive(cmd, key, value))
+			{
+				throw detail::syntax_error(line, line_no, 1);
+			}
+		}
+		else
+		{
+			throw detail::syntax_error(line, line_no, scanner.furthest() + 1);
+		}
+	}
+
+	cmd.overrides = override_table(overrides);
+	return cmd;
+}
+
+// a problem found by validate_schedule()
+struct schedule_issue_t
+{
+	enum class kind_t
+	{
+		overlap = 0, // first and second overlap or touch
+		inverted,	 // off < on
+		too_long	 // longer than a week
+	};
+
+	kind_t kind;
+	action_t first;
+	action_t second; // only used by overlap
+};
+
+// sources are the names of the files, indexed by action_t::source
+std::string to_string(const schedule_issue_t& issue,
+					  const std::vector<std::string>& sources = {})
+{
+	auto line = [&sources](const action_t& a)
+	{
+		std::string file;
+		if (a.source < sources.size())
+		{
+			file = sources[a.source] + " ";
+		}
+		return file + "line " + std::to_string(a.line) + " (" + to_string(a) +
+			   ")";
+	};
+
+	switch (issue.kind)
+	{
+		case schedule_issue_t::kind_t::overlap:
+			return "overlaping schedules: " + line(issue.first) + " and " +
+				   line(issue.second);
+		case schedule_issue_t::kind_t::inverted:
+			return "off time < on time: " + line(issue.first);
+		case schedule_issue_t::kind_t::too_long:
+			return "longer than a week: " + line(issue.first);
+	}
+	return "unknown issue";
+}
+
+// thrown by check_schedule(). Holds every issue that was found.
+class schedule_error : public std::runtime_error
+{
+public:
+	explicit schedule_error(std::vector<schedule_issue_t> issues,
+							const std::vector<std::string>& sources = {})
+		: std::runtime_error(build_message(issues, sources)),
+		  m_issues(std::move(issues))
+	{
+	}
+
+	const std::vector<schedule_issue_t>& issues() const { return m_issues; }
+
+private:
+	static std::string build_message(const std::vector<schedule_issue_t>& v,
+									 const std::vector<std::string>& sources)
+	{
+		std::string msg = "check_schedule: " + std::to_string(v.size()) +
+						  " issue(s) in the schedule";
+		for (const auto& issue : v)
+		{
+			msg += "\n\t" + to_string(issue, sources);
+		}
+		return msg;
+	}
+
+	std::vector<schedule_issue_t> m_issues;
+};
+
+// Sweep line over the windows sorted by their on time. The windows still
+// open at an on time are kept in a min heap on their off time, so every
+// overlapping pair is found in O(n log n + pairs). The input needs not to be
+// sorted.
+template <typename iterator_t>
+std::vector<schedule_issue_t> validate_schedule(iterator_t begin,
+												iterator_t end)
+{
+	using kind_t = schedule_issue_t::kind_t;
+
+	std::vector<schedule_issue_t> issues;
+	std::vector<const action_t*> windows;
+	for (; begin != end; ++begin)
+	{
+		const action_t& a = *begin;
+		if (a.off < a.on)
+		{
+			issues.push_back({kind_t::inverted, a, action_t()});
+			continue;
+		}
+		if (a.off - a.on > hours(24 * 7))
+		{
+			issues.push_back({kind_t::too_long, a, action_t()});
+		}
+		windows.push_back(&a);
+	}
+
+	std::sort(windows.begin(), windows.end(),
+			  [](const action_t* a, const action_t* b)
+			  { return a->on < b->on || (a->on == b->on && a->off < b->off); });
+
+	auto later_off = [](const action_t* a, const action_t* b)
+	{ return a->off > b->off; };
+
+	std::vector<const action_t*> open;
+	for (const action_t* a : windows)
+	{
+		// close all windows that ended before this one starts
+		while (!open.empty() && open.front()->off < a->on)
+		{
+			std::pop_heap(open.begin(), open.end(), later_off);
+			open.pop_back();
+		}
+
+		for (const action_t* b : open)
+		{
+			// the same empty window twice does not hurt
+			if (*a == *b && a->on == a->off)
+			{
+				continue;
+			}
+			issues.push_back({kind_t::overlap, *b, *a});
+		}
+
+		open.push_back(a);
+		std::push_heap(open.begin(), open.end(), later_off);
+	}
+
+	return issues;
+}
+
+template <typename iterator_t>
+void check_schedule(iterator_t begin, iterator_t end,
+					const std::vector<std::string>& sources = {})
+{
+	auto issues = validate_schedule(begin, end);
+	if (!issues.empty())
+	{
+		throw schedule_error(std::move(issues), sources);
+	}
+}
+
+// The lookups on the schedule need it sorted by on time and without
+// overlaps, as check_schedule() accepts it.
+template <typename iterator_t>
+bool get_state(iterator_t begin, iterator_t end, const time_point_t tp)
+{
+	// the first window that starts after tp. The one before might be on.
+	auto pos = std::upper_bound(begin, end, tp,
+								[](const time_point_t& t, const action_t& a)
+								{ return t < a.on; });
+	if (pos == begin)
+	{
+		return false;
+	}
+
+	return tp < std::prev(pos)->off;
+}
+
+template <typename iterator_t>
+time_point_t get_next_on_time(iterator_t begin, iterator_t end,
+							  const time_point_t tp)
+{
+	if (begin == end)
+	{
+		throw std::runtime_error("get_next_on_time: empty schedule");
+	}
+
+	// the first window that starts after tp
+	auto pos = std::upper_bound(begin, end, tp,
+								[](const time_point_t& t, const action_t& a)
+								{ return t < a.on; });
+	if (pos != end)
+	{
+		return pos->on;
+	}
+
+	// in the next week. A window over the end of the week is split in two:
+	// its second half is no new start.
+	const auto week = boost::posix_time::hours(7 * 24);
+	auto last = std::prev(end);
+	if (last != begin && last->off >= begin->on + week)
+	{
+		return std::next(begin)->on + week;
+	}
+	return begin->on + week;
+}
+
+// a switch of the state
+struct transition_t
+{
+	time_point_t at;
+	bool on = false; // switched on or off
+
+	bool operator==(const transition_t& rhs) const
+	{
+		return at == rhs.at && on == rhs.on;
+	}
+};
+
+inline std::string to_string(const transition_t& t)
+{
+	return boost::posix_time::to_simple_string(t.at) + (t.on ? " on" : " off");
+}
+
+// The next n transitions after tp. The halves of a window over the end of
+// the week dont switch in between. A schedule that is always on (or off) has
+// none.
+template <typename iterator_t>
+std::vector<transition_t> get_next_transitions(iterator_t begin,
+											   iterator_t end,
+											   const time_point_t tp,
+											   std::size_t n)
+{
+	std::vector<transition_t> out;
+	if (begin == end)
+	{
+		return out;
+	}
+
+	const auto week = boost::posix_time::hours(7 * 24);
+	duration_t shift = boost::posix_time::seconds(0);
+
+	// the first window that ends after tp
+	auto pos = std::upper_bound(begin, end, tp,
+								[](const time_point_t& t, const action_t& a)
+								{ return t < a.off; });
+	if (pos == end)
+	{
+		pos = begin;
+		shift = week;
+	}
+
+	// no end in sight: always on
+	auto give_up = tp + week * static_cast<int>(n + 2);
+	while (pos->on + shift < give_up)
+	{
+		auto on = pos->on + shift;
+		auto off = pos->off + shift;
+
+		if (on < off)
+		{
+			if (!out.empty() && on <= out.back().at)
+			{
+				// it goes on: the halves of a window over the end of the
+				// week overlap
+				out.back().at = std::max(out.back().at, off);
+			}
+			else
+			{
+				// the last off is final now
+				if (out.size() >= n)
+				{
+					break;
+				}
+				if (tp < on)
+				{
+					out.push_back({on, true});
+				}
+				out.push_back({off, false});
+			}
+		}
+
+		if (++pos == end)
+		{
+			pos = begin;
+			shift += week;
+		}
+	}
+
+	if (pos->on + shift >= give_up)
+	{
+		out.clear();
+	}
+	if (out.size() > n)
+	{
+		out.resize(n);
+	}
+	return out;
+}
+
+namespace detail
+{
+inline unsigned count_trailing_zeros(std::uint64_t word)
+{
+	assert(word != 0);
+#if defined(__GNUC__) || defined(__clang__)
+	return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+	unsigned n = 0;
+	while ((word & 1) == 0)
+	{
+		word >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+} // namespace detail
+
+// The schedule compiled to one bit per minute of the week. Bit m is set
+// when the machine should be on in the minute week_start + m. A lookup is a
+// single bit test, the next transition a scan for the next (un)set bit. The
+// index repeats every week, so it answers for any time point.
+class week_bitmap
+{
+public:
+	static constexpr std::size_t minutes_per_week = 7 * 24 * 60;
+	static constexpr std::size_t npos = std::size_t(-1);
+
+	week_bitmap() = default;
+
+	// build it from the (sorted) schedule as read_schedule() creates it
+	template <typename iterator_t>
+	week_bitmap(iterator_t begin, iterator_t end, const time_point_t week_start)
+		: m_week_start(week_start)
+	{
+		for (; begin != end; ++begin)
+		{
+			set(to_minutes(begin->on), to_minutes(begin->off));
+		}
+	}
+
+	static constexpr std::size_t word_bits = 64;
+	static constexpr std::size_t words =
+		(minutes_per_week + word_bits - 1) / word_bits;
+	using words_t = std::array<std::uint64_t, words>;
+
+	// from the raw bits, see raw_words()
+	week_bitmap(const words_t& bits, const time_point_t week_start)
+		: m_week_start(week_start), m_words(bits)
+	{
+	}
+
+	time_point_t week_start() const { return m_week_start; }
+	const words_t& raw_words() const { return m_words; }
+
+	bool test(std::size_t minute) const
+	{
+		assert(minute < minutes_per_week);
+		return (m_words[minute / word_bits] >> (minute % word_bits)) & 1;
+	}
+
+	// set the minutes [first, last) relative to week_start. Wraps around
+	// the end of the week.
+	void set(std::int64_t first, std::int64_t last)
+	{
+		if (last <= first)
+		{
+			return;
+		}
+
+		const std::int64_t week = minutes_per_week;
+		if (last - first >= week)
+		{
+			set_range(0, minutes_per_week);
+			return;
+		}
+
+		auto begin = static_cast<std::size_t>(((first % week) + week) % week);
+		auto end = begin + static_cast<std::size_t>(last - first);
+		if (end <= minutes_per_week)
+		{
+			set_range(begin, end);
+		}
+		else
+		{
+			set_range(begin, minutes_per_week);
+			set_range(0, end - minutes_per_week);
+		}
+	}
+
+	// distance in minutes from 'from' to the next bit equal to 'value',
+	// wrapping around the week. npos if there is none.
+	std::size_t find_next(std::size_t from, bool value) const
+	{
+		assert(from < minutes_per_week);
+
+		auto pos = scan(from, minutes_per_week, value);
+		if (pos != npos)
+		{
+			return pos - from;
+		}
+
+		pos = scan(0, from, value);
+		if (pos != npos)
+		{
+			return pos + minutes_per_week - from;
+		}
+
+		return npos;
+	}
+
+	// the minute of tp since week_start, floored. Might be negative or
+	// beyond this week.
+	std::int64_t to_minutes(const time_point_t tp) const
+	{
+		auto sec = (tp - m_week_start).total_seconds();
+		auto min = sec / 60;
+		if (sec % 60 < 0)
+		{
+			--min;
+		}
+		return min;
+	}
+
+	std::size_t minute_of_week(const time_point_t tp) const
+	{
+		const std::int64_t week = minutes_per_week;
+		return static_cast<std::size_t>(((to_minutes(tp) % week) + week) %
+										week);
+	}
+
+	// the start of the minute containing tp
+	time_point_t minute_start(const time_point_t tp) const
+	{
+		return m_week_start + minutes(to_minutes(tp));
+	}
+
+private:
+	void set_range(std::size_t begin, std::size_t end)
+	{
+		for (; begin < end && begin % word_bits != 0; ++begin)
+		{
+			m_words[begin / word_bits] |= std::uint64_t(1)
+										  << (begin % word_bits);
+		}
+		for (; begin + word_bits <= end; begin += word_bits)
+		{
+			m_words[begin / word_bits] = ~std::uint64_t(0);
+		}
+		for (; begin < end; ++begin)
+		{
+			m_words[begin / word_bits] |= std::uint64_t(1)
+										  << (begin % word_bits);
+		}
+	}
+
+	// the first position in [first, last) equal to value
+	std::size_t scan(std::size_t first, std::size_t last, bool value) const
+	{
+		while (first < last)
+		{
+			auto w = first / word_bits;
+			std::uint64_t word = value ? m_words[w] : ~m_words[w];
+			word &= ~std::uint64_t(0) << (first % word_bits);
+			if (word)
+			{
+				auto pos = w * word_bits + detail::count_trailing_zeros(word);
+				return pos < last ? pos : npos;
+			}
+			first = (w + 1) * word_bits;
+		}
+		return npos;
+	}
+
+	time_point_t m_week_start;
+	words_t m_words{};
+};
+
+inline bool get_state(const week_bitmap& index, const time_point_t tp)
+{
+	return index.test(index.minute_of_week(tp));
+}
+
+namespace detail
+{
+// the next edge to 'value' after tp. The current run of 'value' (if tp is in
+// one) is skipped.
+inline time_point_t get_next_edge(const week_bitmap& index,
+								  const time_point_t tp, bool value,
+								  const char* name)
+{
+	auto from = index.minute_of_week(tp);
+
+	std::size_t skip = 0;
+	if (index.test(from) == value)
+	{
+		skip = index.find_next(from, !value);
+	}
+
+	std::size_t distance = week_bitmap::npos;
+	if (skip != week_bitmap::npos)
+	{
+		distance = index.find_next(
+			(from + skip) % week_bitmap::minutes_per_week, value);
+	}
+
+	if (distance == week_bitmap::npos)
+	{
+		throw std::runtime_error(std::string(name) +
+								 ": the schedule has no such transition");
+	}
+
+	return index.minute_start(tp) + minutes(skip + distance);
+}
+} // namespace detail
+
+inline time_point_t get_next_on_time(const week_bitmap& index,
+									 const time_point_t tp)
+{
+	return detail::get_next_edge(index, tp, true, "get_next_on_time");
+}
+
+inline time_point_t get_next_off_time(const week_bitmap& index,
+									  const time_point_t tp)
+{
+	return detail::get_next_edge(index, tp, false, "get_next_off_time");
+}
+
+inline std::vector<transition_t> get_next_transitions(const week_bitmap& index,
+													  const time_point_t tp,
+													  std::size_t n)
+{
+	std::vector<transition_t> out;
+
+	// always on or always off
+	if (index.find_next(0, true) == week_bitmap::npos ||
+		index.find_next(0, false) == week_bitmap::npos)
+	{
+		return out;
+	}
+
+	bool state = get_state(index, tp);
+	auto t = tp;
+	while (out.size() < n)
+	{
+		t = state ? get_next_off_time(index, t) : get_next_on_time(index, t);
+		state = !state;
+		out.push_back({t, state});
+	}
+	return out;
+}
+
+// The weekly windows with the date ranges over them
+inline bool get_state(const week_bitmap& index, const override_table& overrides,
+					  const time_point_t tp)
+{
+	if (const auto* o = overrides.find(tp))
+	{
+		return o->on;
+	}
+	return get_state(index, tp);
+}
+
+namespace detail
+{
+// the first time from tp on with the state 'value', not_a_date_time when
+// there is none
+inline time_point_t find_state(const week_bitmap& index,
+							   const override_table& overrides,
+							   time_point_t tp, bool value)
+{
+	// the weekly windows alone have it at all?
+	bool weekly = index.find_next(0, value) != week_bitmap::npos;
+
+	// every round skips a range
+	for (std::size_t i = 0; i <= overrides.ranges().size() + 1; ++i)
+	{
+		if (const auto* o = overrides.find(tp))
+		{
+			if (o->on == value)
+			{
+				return tp;
+			}
+			tp = o->to;
+			continue;
+		}
+
+		// until the next range the weekly windows decide
+		auto next = overrides.next_start(tp);
+		if (weekly)
+		{
+			auto at = get_state(index, tp) == value
+						  ? tp
+						  : get_next_edge(index, tp, value, "find_state");
+			if (at < next)
+			{
+				return at;
+			}
+		}
+		if (next.is_special())
+		{
+			break;
+		}
+		tp = next;
+	}
+	return time_point_t(boost::date_time::not_a_date_time);
+}
+
+inline time_point_t get_next_edge(const week_bitmap& index,
+								  const override_table& overrides,
+								  const time_point_t tp, bool value,
+								  const char* name)
+{
+	// skip the current run of 'value'
+	auto from = find_state(index, overrides, tp, !value);
+	auto at = from.is_special() ? from
+								: find_state(index, overrides, from, value);
+	if (at.is_special())
+	{
+		throw std::runtime_error(std::string(name) +
+								 ": the schedule has no such transition");
+	}
+	return at;
+}
+} // namespace detail
+
+inline time_point_t get_next_on_time(const week_bitmap& index,
+									 const override_table& overrides,
+									 const time_point_t tp)
+{
+	return detail::get_next_edge(index, overrides, tp, true,
+								 "get_next_on_time");
+}
+
+inline time_point_t get_next_off_time(const week_bitmap& index,
+									  const override_table& overrides,
+									  const time_point_t tp)
+{
+	return detail::get_next_edge(index, overrides, tp, false,
+								 "get_next_off_time");
+}
+
+inline std::vector<transition_t> get_next_transitions(
+	const week_bitmap& index, const override_table& overrides,
+	const time_point_t tp, std::size_t n)
+{
+	std::vector<transition_t> out;
+
+	bool state = get_state(index, overrides, tp);
+	auto t = tp;
+	while (out.size() < n)
+	{
+		t = detail::find_state(index, overrides, t, !state);
+		if (t.is_special())
+		{
+			break;
+		}
+		state = !state;
+		out.push_back({t, state});
+	}
+	return out;
+}
+
+// seconds since 1970 UTC of the local time tp, by the time zone table.
+// Without one mktime() tells the offset, like localtime() tells rtc::now().
+inline std::int64_t to_epoch(const cmd_t& cmds, const time_point_t tp)
+{
+	if (cmds.zone.empty())
+	{
+		auto tm = boost::posix_time::to_tm(tp);
+		tm.tm_isdst = -1;
+		return std::int64_t(std::mktime(&tm));
+	}
+	auto epoch = time_point_t(date(1970, 1, 1));
+	return (cmds.zone.to_utc(tp) - epoch).total_seconds();
+}
+
+// how much earlier to wake up for the window starting at on
+inline duration_t get_wake_lead(const cmd_t& cmds, const time_point_t on)
+{
+	if (!cmds.window_leads.empty())
+	{
+		auto second = (on - get_week_start(on)).total_seconds();
+		auto pos = cmds.window_leads.find(second);
+		if (pos != cmds.window_leads.end())
+		{
+			return pos->second;
+		}
+	}
+	return cmds.wake_lead;
+}
+
+// the PowerDownBelow= tier for a sleep that long, nullptr: PowerDown=
+inline const power_tier_t* find_power_tier(const cmd_t& cmds,
+										   const duration_t sleep)
+{
+	auto pos = std::upper_bound(cmds.power_tiers.begin(), cmds.power_tiers.end(),
+								sleep,
+								[](const duration_t& d, const power_tier_t& t)
+								{ return d < t.below; });
+	return pos == cmds.power_tiers.end() ? nullptr : &*pos;
+}
+
+// which command was chosen and why, for --test
+inline std::string explain_power_tier(const cmd_t& cmds,
+									  const duration_t sleep)
+{
+	auto s = "sleep of " + boost::posix_time::to_simple_string(sleep);
+	if (const auto* tier = find_power_tier(cmds, sleep))
+	{
+		return s + " is below " + tier->text + ": " + tier->command;
+	}
+	if (cmds.power_tiers.empty())
+	{
+		return s + ": PowerDown";
+	}
+	return s + " is not below " + cmds.power_tiers.back().text +
+		   ": PowerDown";
+}
+
+// we return the command. This way we can test the function much easier
+std::string build_power_off_command(const time_point_t wake_up_at,
+									const cmd_t& cmds, const time_point_t now)
+{
+	// execute the power down command
+	if (wake_up_at < now)
+	{
+		std::string msg = "power_off: wake_up_at < now: Software error";
 		throw std::runtime_error(msg);
 	}
 
 	// build the command
 	std::string cmd;
 	{
-		auto sec_to_sleep = (wake_up_at - now).total_seconds();
-		auto s_sec = std::to_string(sec_to_sleep);
+		auto sleep = cmds.zone.between(now, wake_up_at);
+		auto s_sec = std::to_string(sleep.total_seconds());
+
+		// a short sleep has its own command
+		const auto* tier = find_power_tier(cmds, sleep);
+		const auto& power_down = tier ? tier->command : cmds.power_down;
 
-		auto pos = cmds.power_down.find("%d");
+		// with WakeAlarm= it is the command after the alarm was set, with
+		// a state there is none, unless a tier was chosen
+		const auto& alarm = cmds.wake_alarm;
+		if (!alarm.empty() && !alarm.state.empty() && !tier)
+		{
+			return "";
+		}
+		if (!alarm.empty() && power_down.empty())
+		{
+			throw std::runtime_error(
+				"power_off: WakeAlarm needs state= or PowerDown");
+		}
+
+		auto pos = power_down.find("%d");
+		if (!alarm.empty() && pos == std::string::npos)
+		{
+			return power_down;
+		}
 		if (pos == std::string::npos)
 		{
 			std::string msg = "power_off: PowerDown needs %d argument: line: " +
-							  cmds.power_down;
+							  power_down;
 			throw std::runtime_error(msg);
 		}
 
-		std::back_insert_iterator<std::string> cmd_inserter(cmd);
-		std::regex ex_replace("%d");
-		std::regex_replace(cmd_inserter, cmds.power_down.begin(),
-						   cmds.power_down.end(), ex_replace, s_sec);
+		// every %d, the simulation builds it for each tick
+		std::size_t from = 0;
+		for (; pos != std::string::npos;
+			 from = pos + 2, pos = power_down.find("%d", from))
+		{
+			cmd.append(power_down, from, pos - from);
+			cmd += s_sec;
+		}
+		cmd.append(power_down, from, std::string::npos);
 	}
 
 	return cmd;
 }
 
-std::string execute(std::string cmd)
+template <typename iterator_t>
+std::string build_power_off_command(iterator_t begin, iterator_t end,
+									const cmd_t& cmds, const time_point_t now)
 {
-#ifdef _WIN32
-	pipe_handle stream(_popen(cmd.c_str(), "r"));
-#else
-	pipe_handle stream(popen(cmd.c_str(), "r"));
-#endif
+	auto wake_up_at = get_next_on_time(begin, end, now);
+	return build_power_off_command(wake_up_at, cmds, now);
+}
+
+std::string build_power_off_command(const week_bitmap& index,
+									const cmd_t& cmds, const time_point_t now)
+{
+	auto wake_up_at = get_next_on_time(index, cmds.overrides, now);
+	return build_power_off_command(wake_up_at, cmds, now);
+}
+
+// what one run decided
+struct decision_t
+{
+	bool scheduled_on = false; // the state from the schedule
+	bool stay_awake = false;   // CheckStayAwake wanted to stay awake
+	bool power_off = false;	   // we need to shut down
+	bool warming_up = false;   // in the WakeLead= before a window
+	time_point_t wake_up_at;   // only when power_off
+	time_point_t alarm_at;	   // wake_up_at less the WakeLead=
+	std::string power_off_cmd; // only when power_off
+	bool tier = false;		   // a PowerDownBelow= command was chosen
+	std::string tier_reason;   // why, only when power_off
+};
+
+// The decision of a run. check_stay_awake() is only called in the off time
+// of the schedule. The cron run, the daemon and the tests share it.
+template <typename stay_awake_t>
+decision_t decide(const week_bitmap& index, const cmd_t& cmds,
+				  const time_point_t now, bool forced,
+				  stay_awake_t check_stay_awake)
+{
+	decision_t d;
+	d.scheduled_on = get_state(index, cmds.overrides, now);
+
+	bool state = d.scheduled_on;
 
-	if (!stream)
+	// woken up early for the next window: stay up for it
+	time_point_t next_on;
+	if (!state && (cmds.wake_lead > seconds(0) || !cmds.window_leads.empty()))
 	{
-		throw std::runtime_error("execute: popen failed");
+		next_on = get_next_on_time(index, cmds.overrides, now);
+		d.warming_up = next_on - get_wake_lead(cmds, next_on) <= now;
+		state = d.warming_up;
 	}
 
-	// read response until process exits
-	std::string response;
+	// we could enlength the time to stay awake when this command
+	// returns != "0"
+	if (!state)
 	{
-		char c;
-		while ((c = fgetc(stream)) != EOF)
-			response += c;
+		d.stay_awake = check_stay_awake();
+		state = d.stay_awake;
+
+		// force the shutdown?
+		if (forced)
+		{
+			state = false;
+		}
 	}
 
-	return response;
-}
+	if (!state)
+	{
+		d.power_off = true;
+		d.wake_up_at = next_on.is_special()
+						   ? get_next_on_time(index, cmds.overrides, now)
+						   : next_on;
+		d.alarm_at = d.wake_up_at - get_wake_lead(cmds, d.wake_up_at);
+		d.power_off_cmd = build_power_off_command(d.alarm_at, cmds, now);
 
-bool check_stay_awake(cmd_t cmds, const time_point_t now)
-{
-	auto response = execute(cmds.check_stay_awake);
-	return response != "0\n";
+		auto sleep = cmds.zone.between(now, d.alarm_at);
+		d.tier = find_power_tier(cmds, sleep) != nullptr;
+		d.tier_reason = explain_power_tier(cmds, sleep);
+	}
+
+	return d;
 }
 
 } // namespace rtc
@@ -0,0 +1,290 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_simulate_h
+#define rtcwake_simulate_h
+
+#include "rtcwake-cache.h"
+#include "rtcwake-schedule.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rtc
+{
+// "2026-01-01", "2026-01-01T08:00" or "2026-01-01 08:00:30"
+inline bool parse_time_point(std::string s, time_point_t& tp)
+{
+	if (s.size() == 10)
+	{
+		s += " 00:00:00";
+	}
+	if (s.size() > 10 && s[10] == 'T')
+	{
+		s[10] = ' ';
+	}
+	if (s.size() == 16)
+	{
+		s += ":00";
+	}
+
+	try
+	{
+		tp = boost::posix_time::time_from_string(s);
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+	return !tp.is_special();
+}
+
+// What CheckStayAwake prints over time, for the simulation. Each line of the
+// script sets the output from its time on:
+//   2026-03-01 10:00 1
+//   2026-03-01 12:30 0
+// Before the first line it prints "0".
+class stay_awake_script
+{
+public:
+	void load(std::istream& is)
+	{
+		std::string line;
+		std::size_t line_no = 0;
+		while (std::getline(is, line))
+		{
+			++line_no;
+			auto words = detail::split_words(line);
+			if (words.empty() || words[0][0] == '#')
+			{
+				continue;
+			}
+
+			time_point_t tp;
+			if (words.size() != 3 ||
+				!parse_time_point(words[0] + " " + words[1], tp))
+			{
+				throw std::runtime_error(
+					"stay_awake_script: Unrecognized syntax at line " +
+					std::to_string(line_no) + ": " + line);
+			}
+			m_steps.emplace_back(tp, words[2] + "\n");
+		}
+
+		std::stable_sort(m_steps.begin(), m_steps.end(),
+						 [](const step_t& a, const step_t& b)
+						 { return a.first < b.first; });
+	}
+
+	// the output at tp
+	const std::string& output(const time_point_t tp) const
+	{
+		static const std::string zero = "0\n";
+		auto pos = std::upper_bound(
+			m_steps.begin(), m_steps.end(), tp,
+			[](const time_point_t& t, const step_t& s) { return t < s.first; });
+		return pos == m_steps.begin() ? zero : std::prev(pos)->second;
+	}
+
+private:
+	using step_t = std::pair<time_point_t, std::string>;
+	std::vector<step_t> m_steps;
+};
+
+struct simulation_options_t
+{
+	time_point_t from;
+	time_point_t to;
+	duration_t step = minutes(1); // between the cron runs
+	bool forced = false;
+	std::size_t longest_gaps = 3;
+};
+
+struct simulation_report_t
+{
+	struct gap_t
+	{
+		time_point_t from; // powered off
+		time_point_t to;   // woken up
+	};
+
+	std::size_t ticks = 0; // the machine was up to run
+	duration_t on_time = seconds(0);
+	std::size_t power_cycles = 0;
+	std::size_t stay_awake_ticks = 0; // CheckStayAwake kept it up
+	std::vector<gap_t> longest_gaps;  // the longest first
+
+	// ticks that computed a wake up time in the off time or behind the
+	// start of the next window
+	std::size_t wrong_wake_ups = 0;
+	std::vector<std::string> wrong; // the first ones
+};
+
+// Replay the cron runs from..to through decide(). The machine is up at
+// 'from'. After a power off the runs until the wake up are skipped.
+simulation_report_t simulate(const compiled_schedule_t& compiled,
+							 const simulation_options_t& opts,
+							 const stay_awake_script& script)
+{
+	if (opts.step <= seconds(0) || opts.to < opts.from)
+	{
+		throw std::runtime_error("simulate: invalid time range or step");
+	}
+	if (compiled.actions.empty())
+	{
+		throw std::runtime_error("simulate: empty schedule");
+	}
+
+	// the command is just built, a schedule without PowerDown= is fine
+	cmd_t cmds = compiled.cmds;
+	if (cmds.power_down.empty())
+	{
+		cmds.power_down = "%d";
+	}
+
+	const auto& actions = compiled.actions;
+	const auto& index = compiled.index;
+	const auto anchor = index.week_start();
+
+	simulation_report_t r;
+	auto add_gap = [&](const time_point_t from, const time_point_t to)
+	{
+		auto& gaps = r.longest_gaps;
+		auto pos = std::find_if(gaps.begin(), gaps.end(),
+								[&](const simulation_report_t::gap_t& g)
+								{ return g.to - g.from < to - from; });
+		gaps.insert(pos, {from, to});
+		if (gaps.size() > opts.longest_gaps)
+		{
+			gaps.pop_back();
+		}
+	};
+
+	auto up_since = opts.from;
+	auto tp = opts.from;
+	while (tp <= opts.to)
+	{
+		++r.ticks;
+
+		bool asked = false;
+		auto d = decide(index, cmds, tp, opts.forced,
+						[&]()
+						{
+							asked = true;
+							return script.output(tp) != "0\n";
+						});
+		if (asked && d.stay_awake)
+		{
+			++r.stay_awake_ticks;
+		}
+
+		if (!d.power_off)
+		{
+			tp += opts.step;
+			continue;
+		}
+
+		// check the wake up time against the sorted schedule, moved to
+		// the week of tp. With date ranges it must wake up at the start
+		// of an on time.
+		auto expected = d.wake_up_at;
+		if (cmds.overrides.empty())
+		{
+			auto shift = get_week_start(tp) - anchor;
+			expected =
+				get_next_on_time(actions.begin(), actions.end(), tp - shift) +
+				shift;
+		}
+		if (d.wake_up_at != expected ||
+			!get_state(index, cmds.overrides, d.wake_up_at) ||
+			get_state(index, cmds.overrides, d.wake_up_at - seconds(1)))
+		{
+			++r.wrong_wake_ups;
+			if (r.wrong.size() < 10)
+			{
+				r.wrong.push_back(boost::posix_time::to_simple_string(tp) +
+								  ": wakes up at " +
+								  boost::posix_time::to_simple_string(
+									  d.wake_up_at) +
+								  ", expected " +
+								  boost::posix_time::to_simple_string(expected));
+			}
+		}
+
+		++r.power_cycles;
+		r.on_time += tp - up_since;
+		add_gap(tp, d.alarm_at);
+
+		// the next cron run after the wake up, WakeLead= before the window
+		up_since = std::max(tp, d.alarm_at);
+		auto steps = (up_since - tp).ticks() / opts.step.ticks();
+		tp += opts.step * static_cast<int>(steps);
+		while (tp < up_since)
+		{
+			tp += opts.step;
+		}
+	}
+
+	if (up_since < opts.to)
+	{
+		r.on_time += opts.to - up_since;
+	}
+	return r;
+}
+
+void print_report(std::ostream& os, const simulation_options_t& opts,
+				  const simulation_report_t& r)
+{
+	using boost::posix_time::to_simple_string;
+
+	auto flags = os.flags();
+	auto total = opts.to - opts.from;
+	os << std::fixed << std::setprecision(1);
+	os << "Simulated " << to_simple_string(opts.from) << " - "
+	   << to_simple_string(opts.to) << " every "
+	   << to_simple_string(opts.step) << "\n";
+	os << "Ticks: " << r.ticks << "\n";
+	os << "On: " << r.on_time.total_seconds() / 3600.0 << " h";
+	if (total.total_seconds() > 0)
+	{
+		os << " (" << 100.0 * r.on_time.total_seconds() / total.total_seconds()
+		   << " %)";
+	}
+	os << "\n";
+	os << "Power cycles: " << r.power_cycles << "\n";
+	os << "Kept up by CheckStayAwake: " << r.stay_awake_ticks << " ticks\n";
+	for (const auto& g : r.longest_gaps)
+	{
+		os << "Off: " << to_simple_string(g.from) << " - "
+		   << to_simple_string(g.to) << " ("
+		   << (g.to - g.from).total_seconds() / 3600.0 << " h)\n";
+	}
+	os << "Wrong wake up times: " << r.wrong_wake_ups << "\n";
+	for (const auto& w : r.wrong)
+	{
+		os << "\t" << w << "\n";
+	}
+	os << std::flush;
+	os.flags(flags);
+}
+
+} // namespace rtc
+
+#endif // rtcwake_simulate_h
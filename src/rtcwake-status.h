@@ -0,0 +1,321 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_status_h
+#define rtcwake_status_h
+
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+// What the last run decided, for monitoring and login banners. The times are
+// seconds since 1970 UTC, 0 is none.
+struct status_t
+{
+	static constexpr std::size_t max_probes = 8;
+
+	struct probe_t
+	{
+		char text[64]; // cut, always terminated
+		std::uint32_t count;
+		std::uint32_t cached;
+	};
+
+	std::uint64_t generation; // counts the runs that published
+	std::int64_t updated;
+	std::uint32_t scheduled_on;
+	std::uint32_t stay_awake;
+	std::uint32_t power_off;
+	std::uint32_t warming_up;
+	std::int64_t next_off; // the end of the window
+	std::int64_t next_on;  // the start of the next window
+	std::int64_t next_wake; // the alarm, only when it powers off
+	std::uint32_t probe_count;
+	std::uint32_t reserved;
+	probe_t probes[max_probes];
+};
+
+static_assert(std::is_trivially_copyable<status_t>::value,
+			  "status_t is copied as bytes");
+
+// The decision as status. The last probe results are the ones of the trace.
+inline status_t make_status(const week_bitmap& index, const cmd_t& cmds,
+							const time_point_t now, const decision_t& d,
+							const std::vector<probe_result_t>& probes)
+{
+	status_t s;
+	std::memset(&s, 0, sizeof(s));
+	s.updated = std::time(nullptr);
+	s.scheduled_on = d.scheduled_on;
+	s.stay_awake = d.stay_awake;
+	s.power_off = d.power_off;
+	s.warming_up = d.warming_up;
+
+	for (const auto& t : get_next_transitions(index, cmds.overrides, now, 2))
+	{
+		auto& edge = t.on ? s.next_on : s.next_off;
+		if (edge == 0)
+		{
+			edge = to_epoch(cmds, t.at);
+		}
+	}
+	if (d.power_off)
+	{
+		s.next_wake = to_epoch(cmds, d.alarm_at);
+	}
+
+	s.probe_count = static_cast<std::uint32_t>(
+		std::min(probes.size(), status_t::max_probes));
+	for (std::uint32_t i = 0; i < s.probe_count; ++i)
+	{
+		auto& p = s.probes[i];
+		const auto& text = probes[i].text;
+		auto n = std::min(text.size(), sizeof(p.text) - 1);
+		std::memcpy(p.text, text.data(), n);
+		p.count = probes[i].count;
+		p.cached = probes[i].cached;
+	}
+	return s;
+}
+
+#ifndef _WIN32
+
+// The status file: a header and the status behind a sequence counter. The
+// writer makes the counter odd, writes the status and makes it even again.
+// A reader copies the status and takes it, when the counter was even and
+// the same before and after. Writers serialize with flock(), readers never
+// block them.
+namespace status
+{
+const char magic[8] = {'R', 'T', 'C', 'W', 'S', 'T', 'A', 'T'};
+const std::uint32_t version = 1;
+
+struct page_t
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t size; // of page_t
+	std::atomic<std::uint64_t> seq;
+	status_t status;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+			  "the counter is shared between processes");
+
+// a shared mapping of the status file
+class mapping
+{
+public:
+	mapping(const std::string& path, bool writable)
+	{
+		m_fd.reset(::open(path.c_str(),
+						  writable ? O_RDWR | O_CREAT | O_CLOEXEC
+								   : O_RDONLY | O_CLOEXEC,
+						  0644));
+		struct stat st;
+		if (m_fd < 0 || fstat(m_fd, &st) != 0)
+		{
+			return;
+		}
+		if (writable && st.st_size != sizeof(page_t) &&
+			::ftruncate(m_fd, sizeof(page_t)) != 0)
+		{
+			return;
+		}
+		if (!writable && st.st_size != sizeof(page_t))
+		{
+			return;
+		}
+
+		void* p = mmap(nullptr, sizeof(page_t),
+					   writable ? PROT_READ | PROT_WRITE : PROT_READ,
+					   MAP_SHARED, m_fd, 0);
+		if (p != MAP_FAILED)
+		{
+			m_page = static_cast<page_t*>(p);
+		}
+	}
+
+	mapping(const mapping&) = delete;
+	mapping& operator=(const mapping&) = delete;
+
+	~mapping()
+	{
+		if (m_page)
+		{
+			munmap(m_page, sizeof(page_t));
+		}
+	}
+
+	page_t* page() const { return m_page; }
+	int fd() const { return m_fd; }
+
+private:
+	fd_handle m_fd;
+	page_t* m_page = nullptr;
+};
+} // namespace status
+
+// Publishes the status. The file and its directory are created.
+class status_writer
+{
+public:
+	explicit status_writer(const std::string& path)
+		: m_map(make_parent(path), true)
+	{
+	}
+
+	bool is_open() const { return m_map.page() != nullptr; }
+
+	bool publish(const status_t& s)
+	{
+		auto* page = m_map.page();
+		if (!page || ::flock(m_map.fd(), LOCK_EX) != 0)
+		{
+			return false;
+		}
+
+		// a new or foreign file starts over
+		if (std::memcmp(page->magic, status::magic, sizeof(status::magic)) !=
+				0 ||
+			page->version != status::version || page->size != sizeof(*page))
+		{
+			page->seq.store(0, std::memory_order_relaxed);
+			std::memset(&page->status, 0, sizeof(page->status));
+			std::memcpy(page->magic, status::magic, sizeof(status::magic));
+			page->version = status::version;
+			page->size = sizeof(*page);
+		}
+
+		auto seq = page->seq.load(std::memory_order_relaxed);
+		page->seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		auto generation = page->status.generation + 1;
+		std::memcpy(&page->status, &s, sizeof(s));
+		page->status.generation = generation;
+
+		page->seq.store(seq + 2, std::memory_order_release);
+		::flock(m_map.fd(), LOCK_UN);
+		return true;
+	}
+
+private:
+	static const std::string& make_parent(const std::string& path)
+	{
+		auto slash = path.rfind('/');
+		if (slash != std::string::npos && slash > 0)
+		{
+			::mkdir(path.substr(0, slash).c_str(), 0755);
+		}
+		return path;
+	}
+
+	status::mapping m_map;
+};
+
+// Reads the status without a lock or a system call after the mapping.
+class status_reader
+{
+public:
+	explicit status_reader(const std::string& path) : m_map(path, false) {}
+
+	bool is_open() const { return m_map.page() != nullptr; }
+
+	// false: no status yet, or a writer was busy on every try
+	bool read(status_t& out, unsigned tries = 1000) const
+	{
+		const auto* page = m_map.page();
+		if (!page ||
+			std::memcmp(page->magic, status::magic, sizeof(status::magic)) !=
+				0 ||
+			page->version != status::version || page->size != sizeof(*page))
+		{
+			return false;
+		}
+
+		for (unsigned i = 0; i < tries; ++i)
+		{
+			auto before = page->seq.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				continue;
+			}
+			std::memcpy(&out, &page->status, sizeof(out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (page->seq.load(std::memory_order_relaxed) == before)
+			{
+				return before != 0;
+			}
+		}
+		return false;
+	}
+
+private:
+	status::mapping m_map;
+};
+
+#endif // _WIN32
+
+// for --status
+inline void print_status(std::ostream& os, const status_t& s)
+{
+	auto time = [](std::int64_t t)
+	{
+		return t == 0 ? std::string("-")
+					  : boost::posix_time::to_simple_string(
+							boost::posix_time::from_time_t(t)) +
+							" UTC";
+	};
+
+	os << "Generation: " << s.generation << "\n"
+	   << "Updated: " << time(s.updated) << "\n"
+	   << "Scheduled on: " << (s.scheduled_on ? "yes" : "no") << "\n"
+	   << "Stay awake: " << (s.stay_awake ? "yes" : "no") << "\n"
+	   << "Warming up: " << (s.warming_up ? "yes" : "no") << "\n"
+	   << "Power off: " << (s.power_off ? "yes" : "no") << "\n"
+	   << "Next off: " << time(s.next_off) << "\n"
+	   << "Next on: " << time(s.next_on) << "\n"
+	   << "Next wake up: " << time(s.next_wake) << "\n";
+	for (std::uint32_t i = 0; i < s.probe_count; ++i)
+	{
+		os << "Check: " << s.probes[i].text << ": " << s.probes[i].count
+		   << (s.probes[i].cached ? " (cached)" : "") << "\n";
+	}
+	os << std::flush;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_status_h
@@ -0,0 +1,524 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_timezone_h
+#define rtcwake_timezone_h
+
+#include "rtcwake-schedule.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace rtc
+{
+namespace detail
+{
+// the rules after the last transition of a TZif file are expanded up to
+// this year
+const int zone_last_year = 2100;
+
+// a rule like "M3.5.0/2", "J60" or "59/-1" of a POSIX TZ string
+struct tz_rule_t
+{
+	enum class kind_t
+	{
+		month_week_day, // Mm.w.d: day d of week w (5: the last) of month m
+		julian,			// Jn: day n of 1..365, February 29 never counts
+		zero_based		// n: day n of 0..365
+	};
+
+	kind_t kind = kind_t::month_week_day;
+	int month = 0;
+	int week = 0;
+	int day = 0;
+	std::int64_t time = 2 * 3600; // local time of the switch
+};
+
+// A cursor over the POSIX TZ string, like "CET-1CEST,M3.5.0,M10.5.0/3"
+class tz_scanner
+{
+public:
+	explicit tz_scanner(const std::string& s) : m_s(s) {}
+
+	bool done() const { return m_pos == m_s.size(); }
+	bool accept(char c)
+	{
+		if (!done() && m_s[m_pos] == c)
+		{
+			++m_pos;
+			return true;
+		}
+		return false;
+	}
+
+	// "CET" or "<+03>"
+	bool name()
+	{
+		if (accept('<'))
+		{
+			auto end = m_s.find('>', m_pos);
+			if (end == std::string::npos || end == m_pos)
+			{
+				return false;
+			}
+			m_pos = end + 1;
+			return true;
+		}
+
+		auto start = m_pos;
+		while (!done() && std::isalpha(static_cast<unsigned char>(m_s[m_pos])))
+		{
+			++m_pos;
+		}
+		return m_pos - start >= 3;
+	}
+
+	bool number(int& n)
+	{
+		auto start = m_pos;
+		n = 0;
+		while (!done() && std::isdigit(static_cast<unsigned char>(m_s[m_pos])))
+		{
+			n = n * 10 + (m_s[m_pos++] - '0');
+		}
+		return m_pos > start;
+	}
+
+	// [+-]hh[:mm[:ss]]
+	bool time(std::int64_t& t)
+	{
+		int sign = 1;
+		if (accept('-'))
+		{
+			sign = -1;
+		}
+		else
+		{
+			accept('+');
+		}
+
+		int h = 0;
+		int m = 0;
+		int s = 0;
+		if (!number(h) || h > 167)
+		{
+			return false;
+		}
+		if (accept(':') && (!number(m) || (accept(':') && !number(s))))
+		{
+			return false;
+		}
+		t = sign * (h * 3600 + m * 60 + s);
+		return true;
+	}
+
+	bool rule(tz_rule_t& r)
+	{
+		using kind_t = tz_rule_t::kind_t;
+		if (accept('M'))
+		{
+			r.kind = kind_t::month_week_day;
+			if (!number(r.month) || !accept('.') || !number(r.week) ||
+				!accept('.') || !number(r.day) || r.month < 1 ||
+				r.month > 12 || r.week < 1 || r.week > 5 || r.day > 6)
+			{
+				return false;
+			}
+		}
+		else if (accept('J'))
+		{
+			r.kind = kind_t::julian;
+			if (!number(r.day) || r.day < 1 || r.day > 365)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			r.kind = kind_t::zero_based;
+			if (!number(r.day) || r.day > 365)
+			{
+				return false;
+			}
+		}
+		return !accept('/') || time(r.time);
+	}
+
+private:
+	const std::string& m_s;
+	std::size_t m_pos = 0;
+};
+
+// seconds since 1970 of the local midnight the rule points to in year
+inline std::int64_t rule_day(const tz_rule_t& r, int year)
+{
+	using kind_t = tz_rule_t::kind_t;
+	using boost::gregorian::gregorian_calendar;
+
+	date d;
+	switch (r.kind)
+	{
+		case kind_t::month_week_day:
+		{
+			date first(year, r.month, 1);
+			int offset = (r.day - first.day_of_week().as_number() + 7) % 7;
+			d = first + days(offset + (r.week - 1) * 7);
+			while (d.month() != r.month)
+			{
+				d -= days(7); // there is no 5th one
+			}
+			break;
+		}
+		case kind_t::julian:
+		{
+			int n = r.day - 1;
+			if (gregorian_calendar::is_leap_year(year) && n >= 59)
+			{
+				++n;
+			}
+			d = date(year, 1, 1) + days(n);
+			break;
+		}
+		case kind_t::zero_based:
+			d = date(year, 1, 1) + days(r.day);
+			break;
+	}
+	return std::int64_t((d - date(1970, 1, 1)).days()) * 24 * 3600;
+}
+
+// Big endian numbers of a TZif file
+class tzif_reader
+{
+public:
+	tzif_reader(const std::string& data) : m_data(data) {}
+
+	std::size_t pos() const { return m_pos; }
+	void skip(std::size_t n)
+	{
+		need(n);
+		m_pos += n;
+	}
+
+	std::uint64_t get(std::size_t bytes)
+	{
+		need(bytes);
+		std::uint64_t v = 0;
+		for (std::size_t i = 0; i < bytes; ++i)
+		{
+			v = (v << 8) | static_cast<unsigned char>(m_data[m_pos++]);
+		}
+		return v;
+	}
+
+	std::int64_t get_signed(std::size_t bytes)
+	{
+		auto v = get(bytes);
+		if (bytes < 8 && (v >> (bytes * 8 - 1)) != 0)
+		{
+			v |= ~std::uint64_t(0) << (bytes * 8);
+		}
+		return static_cast<std::int64_t>(v);
+	}
+
+	std::string rest() const { return m_data.substr(m_pos); }
+
+private:
+	void need(std::size_t n) const
+	{
+		if (m_data.size() - m_pos < n)
+		{
+			throw std::runtime_error("tzif: truncated file");
+		}
+	}
+
+	const std::string& m_data;
+	std::size_t m_pos = 0;
+};
+
+struct tzif_counts_t
+{
+	std::uint64_t isut, isstd, leap, time, type, chars;
+
+	// the size of the data block with times of that many bytes
+	std::size_t block_size(std::size_t time_size) const
+	{
+		return time * time_size + time + type * 6 + chars +
+			   leap * (time_size + 4) + isstd + isut;
+	}
+};
+
+inline tzif_counts_t read_tzif_header(tzif_reader& r, char& version)
+{
+	if (r.get(4) != 0x545a6966) // "TZif"
+	{
+		throw std::runtime_error("tzif: no TZif file");
+	}
+	version = static_cast<char>(r.get(1));
+	r.skip(15);
+
+	tzif_counts_t c;
+	c.isut = r.get(4);
+	c.isstd = r.get(4);
+	c.leap = r.get(4);
+	c.time = r.get(4);
+	c.type = r.get(4);
+	c.chars = r.get(4);
+	if (c.type == 0)
+	{
+		throw std::runtime_error("tzif: no local time types");
+	}
+	return c;
+}
+} // namespace detail
+
+// Append the transitions of a POSIX TZ string like "CET-1CEST,M3.5.0,
+// M10.5.0/3" after 'after' up to the year detail::zone_last_year. Without
+// a daylight saving time it is one offset. Returns false on a syntax error.
+inline bool expand_posix_tz(const std::string& tz, std::int64_t after,
+							std::vector<zone_transition_t>& out)
+{
+	detail::tz_scanner s(tz);
+
+	// POSIX counts west of UTC
+	std::int64_t std_offset = 0;
+	if (!s.name() || !s.time(std_offset))
+	{
+		return false;
+	}
+	std_offset = -std_offset;
+
+	// the offset before, when there is no other
+	if (out.empty())
+	{
+		out.push_back({after, static_cast<std::int32_t>(std_offset), 0});
+	}
+	if (s.done())
+	{
+		return true;
+	}
+
+	std::int64_t dst_offset = std_offset + 3600;
+	if (!s.name())
+	{
+		return false;
+	}
+	if (!s.done() && !s.accept(','))
+	{
+		if (!s.time(dst_offset) || !s.accept(','))
+		{
+			return false;
+		}
+		dst_offset = -dst_offset;
+	}
+
+	detail::tz_rule_t start;
+	detail::tz_rule_t end;
+	if (!s.rule(start) || !s.accept(',') || !s.rule(end) || !s.done())
+	{
+		return false;
+	}
+
+	int first_year = 1970;
+	if (after > 0)
+	{
+		first_year = (date(1970, 1, 1) + days(after / (24 * 3600))).year();
+	}
+
+	for (int year = first_year; year <= detail::zone_last_year; ++year)
+	{
+		// the switch to dst happens in standard time and back in dst
+		zone_transition_t on{detail::rule_day(start, year) + start.time -
+								 std_offset,
+							 static_cast<std::int32_t>(dst_offset), 1};
+		zone_transition_t off{detail::rule_day(end, year) + end.time -
+								  dst_offset,
+							  static_cast<std::int32_t>(std_offset), 0};
+		if (off.at < on.at)
+		{
+			std::swap(on, off); // southern hemisphere
+		}
+
+		for (const auto& t : {on, off})
+		{
+			if (t.at > after)
+			{
+				out.push_back(t);
+			}
+		}
+	}
+	return true;
+}
+
+// Parse the content of a TZif file (RFC 8536). Versions 2 and later have
+// 64 bit times and a TZ string for the times after their last transition.
+inline std::vector<zone_transition_t> parse_tzif(const std::string& data)
+{
+	detail::tzif_reader r(data);
+
+	char version = 0;
+	auto counts = detail::read_tzif_header(r, version);
+	std::size_t time_size = 4;
+	if (version >= '2')
+	{
+		r.skip(counts.block_size(4));
+		counts = detail::read_tzif_header(r, version);
+		time_size = 8;
+	}
+
+	std::vector<std::int64_t> times;
+	for (std::uint64_t i = 0; i < counts.time; ++i)
+	{
+		times.push_back(r.get_signed(time_size));
+	}
+	std::vector<std::size_t> indices;
+	for (std::uint64_t i = 0; i < counts.time; ++i)
+	{
+		indices.push_back(r.get(1));
+		if (indices.back() >= counts.type)
+		{
+			throw std::runtime_error("tzif: invalid local time type");
+		}
+	}
+
+	struct type_t
+	{
+		std::int32_t offset;
+		std::int32_t dst;
+	};
+	std::vector<type_t> types;
+	for (std::uint64_t i = 0; i < counts.type; ++i)
+	{
+		auto offset = static_cast<std::int32_t>(r.get_signed(4));
+		auto dst = static_cast<std::int32_t>(r.get(1));
+		r.skip(1); // the index of the abbreviation
+		types.push_back({offset, dst});
+	}
+	r.skip(counts.chars + counts.leap * (time_size + 4) + counts.isstd +
+		   counts.isut);
+
+	// before the first transition the first type is in effect
+	std::vector<zone_transition_t> out;
+	out.push_back({0, types[0].offset, types[0].dst});
+	for (std::size_t i = 0; i < times.size(); ++i)
+	{
+		const auto& t = types[indices[i]];
+		out.push_back({times[i], t.offset, t.dst});
+	}
+
+	// the footer: "\nTZ\n"
+	auto footer = r.rest();
+	if (time_size == 8 && footer.size() >= 2 && footer[0] == '\n')
+	{
+		auto end = footer.find('\n', 1);
+		auto tz = footer.substr(1, end == std::string::npos ? std::string::npos
+															: end - 1);
+		if (!tz.empty() &&
+			!expand_posix_tz(tz, times.empty() ? 0 : times.back(), out))
+		{
+			throw std::runtime_error("tzif: invalid TZ string: " + tz);
+		}
+	}
+	return out;
+}
+
+// Where the local time zone comes from: $TZ or /etc/localtime. A TZ that is
+// no file is taken as a POSIX TZ string.
+inline zone_source_t get_zone_source()
+{
+	zone_source_t source;
+
+	const char* tz = std::getenv("TZ");
+	std::string name = tz ? tz : "";
+	if (!name.empty() && name[0] == ':')
+	{
+		name.erase(0, 1);
+	}
+
+	if (name.empty())
+	{
+		source.name = source.path = "/etc/localtime";
+	}
+	else
+	{
+		source.name = name;
+		source.path = name[0] == '/' ? name : "/usr/share/zoneinfo/" + name;
+	}
+
+#ifndef _WIN32
+	struct stat st;
+	if (::stat(source.path.c_str(), &st) == 0)
+	{
+		source.device = st.st_dev;
+		source.inode = st.st_ino;
+		source.mtime_sec = st.st_mtim.tv_sec;
+		source.mtime_nsec = st.st_mtim.tv_nsec;
+		source.size = static_cast<std::uint64_t>(st.st_size);
+	}
+	else
+	{
+		source.path.clear();
+	}
+#endif
+	return source;
+}
+
+// the table of the local time zone. Empty when there is none, then the
+// local times are used as they are.
+inline time_zone_table load_time_zone(const zone_source_t& source)
+{
+	std::vector<zone_transition_t> transitions;
+	if (source.path.empty())
+	{
+		if (!source.name.empty() && source.name[0] != '/' &&
+			!expand_posix_tz(source.name, 0, transitions))
+		{
+			transitions.clear();
+		}
+		return time_zone_table(std::move(transitions), source);
+	}
+
+	std::ifstream ifs(source.path, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(ifs)),
+					 std::istreambuf_iterator<char>());
+	try
+	{
+		transitions = parse_tzif(data);
+	}
+	catch (const std::exception& ex)
+	{
+		throw std::runtime_error(source.path + ": " + ex.what());
+	}
+	return time_zone_table(std::move(transitions), source);
+}
+
+inline time_zone_table load_time_zone()
+{
+	return load_time_zone(get_zone_source());
+}
+
+} // namespace rtc
+
+#endif // rtcwake_timezone_h
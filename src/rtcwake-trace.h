@@ -0,0 +1,260 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_trace_h
+#define rtcwake_trace_h
+
+#include "rtcwake-schedule.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rtc
+{
+// one StayAwakeIf= probe or the CheckStayAwake= command
+struct probe_result_t
+{
+	std::string text;	// the probe as written in the schedule
+	unsigned count = 0; // reasons to stay awake
+	std::string output; // of the command
+	bool cached = false; // an earlier result, see CacheFor=
+
+	// of the command, for Nice=, MemoryMax= and the like
+	std::uint64_t cpu_us = 0;
+	std::uint64_t max_rss_kb = 0;
+};
+
+// What a run did and how long each phase took. The phases are measured with
+// the monotonic clock, in the order they ran.
+class run_trace
+{
+public:
+	using clock_t = std::chrono::steady_clock;
+
+	run_trace() : m_start(clock_t::now()) {}
+
+	// a phase that ran before is summed up
+	void add(const std::string& phase, clock_t::duration d)
+	{
+		add(phase, std::chrono::duration<double, std::micro>(d).count());
+	}
+
+	void add(const std::string& phase, double us)
+	{
+		for (auto& p : m_phases)
+		{
+			if (p.first == phase)
+			{
+				p.second += us;
+				return;
+			}
+		}
+		m_phases.emplace_back(phase, us);
+	}
+
+	// the phases of another trace, like from a thread
+	void add(const run_trace& other)
+	{
+		for (const auto& p : other.phases())
+		{
+			add(p.first, p.second);
+		}
+	}
+
+	// run fn and add its time as phase
+	template <typename fn_t>
+	auto time(const std::string& phase, fn_t fn) -> decltype(fn())
+	{
+		scoped_phase p(*this, phase);
+		return fn();
+	}
+
+	// name, microseconds
+	const std::vector<std::pair<std::string, double>>& phases() const
+	{
+		return m_phases;
+	}
+
+	// since the trace was created
+	double total_us() const
+	{
+		return std::chrono::duration<double, std::micro>(clock_t::now() -
+														 m_start)
+			.count();
+	}
+
+	time_point_t now;
+	bool cached = false; // the compiled schedule came from the cache
+	std::size_t entries = 0;
+
+	bool decided = false;
+	decision_t decision;
+	time_point_t next_wake; // not_a_date_time while it is on
+
+	std::vector<probe_result_t> probes;
+	std::string error;
+
+private:
+	class scoped_phase
+	{
+	public:
+		scoped_phase(run_trace& trace, const std::string& phase)
+			: m_trace(trace), m_phase(phase), m_start(clock_t::now())
+		{
+		}
+		~scoped_phase() { m_trace.add(m_phase, clock_t::now() - m_start); }
+
+	private:
+		run_trace& m_trace;
+		std::string m_phase;
+		clock_t::time_point m_start;
+	};
+
+	clock_t::time_point m_start;
+	std::vector<std::pair<std::string, double>> m_phases;
+};
+
+namespace detail
+{
+inline std::string json_string(const std::string& s)
+{
+	std::string out = "\"";
+	for (unsigned char c : s)
+	{
+		switch (c)
+		{
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '\n':
+				out += "\\n";
+				break;
+			case '\t':
+				out += "\\t";
+				break;
+			default:
+				if (c < 0x20)
+				{
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				}
+				else
+				{
+					out += static_cast<char>(c);
+				}
+				break;
+		}
+	}
+	return out + "\"";
+}
+
+inline std::string json_time(const time_point_t& tp)
+{
+	if (tp.is_special())
+	{
+		return "null";
+	}
+	return json_string(boost::posix_time::to_iso_extended_string(tp));
+}
+} // namespace detail
+
+// the trace as one line of JSON
+std::string to_json(const run_trace& trace)
+{
+	using detail::json_string;
+	using detail::json_time;
+
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1) << std::boolalpha;
+
+	oss << "{\"time\":" << json_time(trace.now) << ",\"cached\":" << trace.cached
+		<< ",\"entries\":" << trace.entries << ",\"phases_us\":{";
+	for (std::size_t i = 0; i < trace.phases().size(); ++i)
+	{
+		const auto& p = trace.phases()[i];
+		oss << (i ? "," : "") << json_string(p.first) << ":" << p.second;
+	}
+	oss << "},\"total_us\":" << trace.total_us();
+
+	if (trace.decided)
+	{
+		const auto& d = trace.decision;
+		oss << ",\"decision\":{\"scheduled_on\":" << d.scheduled_on
+			<< ",\"stay_awake\":" << d.stay_awake
+			<< ",\"power_off\":" << d.power_off
+			<< ",\"next_wake\":" << json_time(trace.next_wake)
+			<< ",\"power_off_cmd\":" << json_string(d.power_off_cmd)
+			<< ",\"tier\":" << json_string(d.tier_reason) << "}";
+	}
+
+	oss << ",\"probes\":[";
+	for (std::size_t i = 0; i < trace.probes.size(); ++i)
+	{
+		const auto& p = trace.probes[i];
+		oss << (i ? "," : "") << "{\"probe\":" << json_string(p.text)
+			<< ",\"count\":" << p.count << ",\"cached\":" << p.cached
+			<< ",\"output\":" << json_string(p.output)
+			<< ",\"cpu_us\":" << p.cpu_us << ",\"max_rss_kb\":" << p.max_rss_kb
+			<< "}";
+	}
+	oss << "]";
+
+	if (!trace.error.empty())
+	{
+		oss << ",\"error\":" << json_string(trace.error);
+	}
+	oss << "}";
+	return oss.str();
+}
+
+// the phases for humans
+void print_timings(std::ostream& os, const run_trace& trace)
+{
+	auto flags = os.flags();
+	os << std::fixed << std::setprecision(1);
+	for (const auto& p : trace.phases())
+	{
+		os << std::left << std::setw(20) << p.first << std::right
+		   << std::setw(12) << p.second << " us\n";
+	}
+	os << std::left << std::setw(20) << "total" << std::right << std::setw(12)
+	   << trace.total_us() << " us" << std::endl;
+
+	// what the commands cost, to tune their limits
+	for (const auto& p : trace.probes)
+	{
+		if (p.cpu_us != 0 || p.max_rss_kb != 0)
+		{
+			os << "check " << p.text << ": " << p.cpu_us << " us cpu, "
+			   << p.max_rss_kb << " kB max rss" << std::endl;
+		}
+	}
+	os.flags(flags);
+}
+
+} // namespace rtc
+
+#endif // rtcwake_trace_h
@@ -0,0 +1,171 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_wakealarm_h
+#define rtcwake_wakealarm_h
+
+#include "rtcwake-process.h"
+#include "rtcwake-schedule.h"
+
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+// where the RTC and the power state are. Tests point it to a fake tree.
+struct wake_alarm_context_t
+{
+	std::string sys_root = "/sys";
+};
+
+inline std::string wake_alarm_path(const wake_alarm_t& alarm,
+								   const wake_alarm_context_t& ctx)
+{
+	return ctx.sys_root + "/class/rtc/" + alarm.rtc + "/wakealarm";
+}
+
+inline std::string power_state_path(const wake_alarm_context_t& ctx)
+{
+	return ctx.sys_root + "/power/state";
+}
+
+// seconds since 1970 of the wake up
+inline std::int64_t wake_up_epoch(const cmd_t& cmds,
+								  const time_point_t wake_up_at)
+{
+	return to_epoch(cmds, wake_up_at);
+}
+
+#ifndef _WIN32
+namespace detail
+{
+// one write(), sysfs takes the value as a whole
+inline void write_sysfs(const std::string& path, const std::string& value)
+{
+	fd_handle fd(::open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC));
+	if (fd < 0 || ::write(fd, value.data(), value.size()) !=
+					  static_cast<ssize_t>(value.size()))
+	{
+		throw std::runtime_error("Can not write " + value + " to " + path +
+								 ": " + std::strerror(errno));
+	}
+}
+
+inline std::string read_sysfs(const std::string& path)
+{
+	fd_handle fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	char buf[64];
+	auto len = fd < 0 ? -1 : ::read(fd, buf, sizeof(buf) - 1);
+	if (len < 0)
+	{
+		throw std::runtime_error("Can not read " + path + ": " +
+								 std::strerror(errno));
+	}
+
+	std::string value(buf, static_cast<std::size_t>(len));
+	while (!value.empty() && (value.back() == '\n' || value.back() == ' '))
+	{
+		value.pop_back();
+	}
+	return value;
+}
+} // namespace detail
+
+// Set the alarm to at (seconds since 1970) and read it back. A set alarm has
+// to be cleared first, the kernel refuses to replace it.
+inline void set_wake_alarm(const wake_alarm_t& alarm, std::int64_t at,
+						   const wake_alarm_context_t& ctx)
+{
+	auto path = wake_alarm_path(alarm, ctx);
+	detail::write_sysfs(path, "0");
+	detail::write_sysfs(path, std::to_string(at));
+
+	auto set = detail::read_sysfs(path);
+	if (set != std::to_string(at))
+	{
+		throw std::runtime_error("WakeAlarm: " + alarm.rtc + " reads '" + set +
+								 "' instead of " + std::to_string(at));
+	}
+}
+
+// returns after the resume
+inline void enter_power_state(const std::string& state,
+							  const wake_alarm_context_t& ctx)
+{
+	detail::write_sysfs(power_state_path(ctx), state);
+}
+#endif // _WIN32
+
+// What the decision powers down with. Without WakeAlarm= it is the PowerDown=
+// command with %d, with it the alarm is set and checked first and then the
+// state is entered or the command runs. A PowerDownBelow= command wins over
+// the state.
+inline void power_down(const decision_t& d, const cmd_t& cmds,
+					   const wake_alarm_context_t& ctx = wake_alarm_context_t())
+{
+	if (cmds.wake_alarm.empty())
+	{
+		execute(d.power_off_cmd);
+		return;
+	}
+
+#ifndef _WIN32
+	set_wake_alarm(cmds.wake_alarm, wake_up_epoch(cmds, d.alarm_at), ctx);
+	if (!cmds.wake_alarm.state.empty() && !d.tier)
+	{
+		enter_power_state(cmds.wake_alarm.state, ctx);
+	}
+	else
+	{
+		execute(d.power_off_cmd);
+	}
+#else
+	throw std::runtime_error("WakeAlarm is not supported on windows");
+#endif
+}
+
+// for --test and the daemon log
+inline std::string describe_power_down(
+	const decision_t& d, const cmd_t& cmds,
+	const wake_alarm_context_t& ctx = wake_alarm_context_t())
+{
+	if (cmds.wake_alarm.empty())
+	{
+		return "PowerDown script: " + d.power_off_cmd;
+	}
+
+	auto s = "WakeAlarm: " +
+			 std::to_string(wake_up_epoch(cmds, d.alarm_at)) + " to " +
+			 wake_alarm_path(cmds.wake_alarm, ctx);
+	if (!cmds.wake_alarm.state.empty() && !d.tier)
+	{
+		return s + ", " + cmds.wake_alarm.state + " to " +
+			   power_state_path(ctx);
+	}
+	return s + ", PowerDown script: " + d.power_off_cmd;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_wakealarm_h
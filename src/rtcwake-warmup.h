@@ -0,0 +1,219 @@
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcwake_warmup_h
+#define rtcwake_warmup_h
+
+#include "rtcwake-schedule.h"
+#include "rtcwake-trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rtc
+{
+struct warm_up_result_t
+{
+	std::size_t files = 0;
+	std::uint64_t bytes = 0;
+	std::size_t missing = 0; // paths of the manifest that are not there
+};
+
+// The WarmUp= manifest: a file or directory per line, # starts a comment.
+// A directory stands for all files below it.
+inline std::vector<std::string> read_warm_up_manifest(std::istream& is)
+{
+	std::vector<std::string> paths;
+	std::string line;
+	while (std::getline(is, line))
+	{
+		auto first = line.find_first_not_of(" \t");
+		if (first == std::string::npos || line[first] == '#')
+		{
+			continue;
+		}
+		auto last = line.find_last_not_of(" \t\r");
+		paths.push_back(line.substr(first, last - first + 1));
+	}
+	return paths;
+}
+
+#ifndef _WIN32
+namespace detail
+{
+// read the file into the page cache, readahead() waits until it is there
+inline void warm_up_file(const std::string& path, warm_up_result_t& r)
+{
+	fd_handle fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		++r.missing;
+		return;
+	}
+
+	auto size = static_cast<std::size_t>(st.st_size);
+#ifdef __linux__
+	::readahead(fd, 0, size);
+#else
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+	++r.files;
+	r.bytes += size;
+}
+
+// symbolic links below a directory are not followed, they could loop
+inline void warm_up_path(const std::string& path, bool top,
+						 warm_up_result_t& r)
+{
+	struct stat st;
+	if ((top ? ::stat(path.c_str(), &st) : ::lstat(path.c_str(), &st)) != 0)
+	{
+		r.missing += top ? 1 : 0;
+		return;
+	}
+
+	if (S_ISREG(st.st_mode))
+	{
+		warm_up_file(path, r);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		return;
+	}
+
+	std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(path.c_str()), closedir);
+	if (!d)
+	{
+		++r.missing;
+		return;
+	}
+	while (dirent* ent = readdir(d.get()))
+	{
+		std::string name = ent->d_name;
+		if (name != "." && name != "..")
+		{
+			warm_up_path(path + "/" + name, false, r);
+		}
+	}
+}
+} // namespace detail
+#endif // _WIN32
+
+inline warm_up_result_t warm_up(const std::vector<std::string>& paths)
+{
+	warm_up_result_t r;
+#ifndef _WIN32
+	for (const auto& p : paths)
+	{
+		detail::warm_up_path(p, true, r);
+	}
+#endif
+	return r;
+}
+
+// The marker lives in /run: it is gone after a boot. It is removed before
+// powering down, so a resume from a suspend warms up again as well.
+inline bool is_warmed_up(const std::string& marker_path)
+{
+	return std::ifstream(marker_path).good();
+}
+
+inline void forget_warm_up(const std::string& marker_path)
+{
+	std::remove(marker_path.c_str());
+}
+
+// "time files bytes", replaced by renaming
+inline bool mark_warmed_up(const std::string& marker_path,
+						   const warm_up_result_t& r)
+{
+#ifndef _WIN32
+	auto slash = marker_path.rfind('/');
+	if (slash != std::string::npos && slash > 0)
+	{
+		::mkdir(marker_path.substr(0, slash).c_str(), 0755);
+	}
+
+	std::string tmp = marker_path + ".tmp." + std::to_string(::getpid());
+	{
+		std::ofstream ofs(tmp, std::ios::trunc);
+		ofs << std::time(nullptr) << " " << r.files << " " << r.bytes << "\n";
+		if (!ofs.flush())
+		{
+			std::remove(tmp.c_str());
+			return false;
+		}
+	}
+	if (std::rename(tmp.c_str(), marker_path.c_str()) != 0)
+	{
+		std::remove(tmp.c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Warm up from the WarmUp= manifest, once after each wake up. Returns true
+// when it ran now.
+inline bool warm_up_once(const cmd_t& cmds, const std::string& marker_path,
+						 run_trace& trace)
+{
+	if (cmds.warm_up.empty() || marker_path.empty() ||
+		is_warmed_up(marker_path))
+	{
+		return false;
+	}
+
+	std::ifstream ifs(cmds.warm_up);
+	if (!ifs)
+	{
+		std::cerr << "WarmUp: can not read " << cmds.warm_up << std::endl;
+		return false;
+	}
+
+	auto r = trace.time("warm_up",
+						[&]() { return warm_up(read_warm_up_manifest(ifs)); });
+	if (r.missing > 0)
+	{
+		std::cerr << "WarmUp: " << r.missing << " path(s) of " << cmds.warm_up
+				  << " not found" << std::endl;
+	}
+	if (!mark_warmed_up(marker_path, r))
+	{
+		std::cerr << "WarmUp: can not write " << marker_path << std::endl;
+	}
+	return true;
+}
+
+} // namespace rtc
+
+#endif // rtcwake_warmup_h
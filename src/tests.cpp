@@ -17,12 +17,32 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <boost/test/unit_test.hpp>
 namespace utf = boost::unit_test;
 
+#include "rtcwake-cache.h"
+#include "rtcwake-compact.h"
+#include "rtcwake-daemon.h"
+#include "rtcwake-fragments.h"
+#include "rtcwake-idle.h"
+#include "rtcwake-learn.h"
+#include "rtcwake-lock.h"
+#include "rtcwake-probes.h"
+#include "rtcwake-process.h"
 #include "rtcwake-schedule.h"
+#include "rtcwake-simulate.h"
+#include "rtcwake-status.h"
+#include "rtcwake-timezone.h"
+#include "rtcwake-trace.h"
+#include "rtcwake-wakealarm.h"
+#include "rtcwake-warmup.h"
 using namespace rtc;
 
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
 
 // test schedule
 const std::string test_schedule =
@@ -135,11 +155,62 @@ BOOST_AUTO_TEST_CASE(syntax_error_test)
 		auto cmds = read_schedule(back_inserter, iss, rtc::now());
 		BOOST_REQUIRE(false);
 	}
-	catch (const std::exception& ex)
+	catch (const rtc::parse_error& ex)
 	{
 		std::string msg = ex.what();
-		BOOST_CHECK(msg == "read_schedule(): Unrecognized syntax at line: "
-						   "Sat:16:xx-Sun:01:00 # Hmmm?");
+		BOOST_CHECK(msg == "read_schedule(): Unrecognized syntax at line 20, "
+						   "column 8: Sat:16:xx-Sun:01:00 # Hmmm?");
+		BOOST_CHECK(ex.line() == 20);
+		BOOST_CHECK(ex.column() == 8);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(grammar_test)
+{
+	// every line must be accepted or rejected like the former regex parser
+	struct
+	{
+		std::string line;
+		std::size_t column; // 0 == accepted
+	} cases[] = {
+		{"Mon:16:00-Tue:01:00", 0},
+		{"Mon:16:00-Tue:01:00 \t # comment", 0},
+		{"Mon:16:00-Tue:01:00#comment", 0},
+		{"Mon:29:59-Tue:01:00", 0},
+		{"", 0},
+		{" \t ", 0},
+		{"# comment", 0},
+		{"PowerDown=", 0},
+		{"CheckStayAwake=echo 0 | wc -l", 0},
+		{"Mon:16:00-Tue:01:00\r", 20},
+		{"Mon:36:00-Tue:01:00", 5},
+		{"Mon:16:60-Tue:01:00", 8},
+		{"Mon:16:00 Tue:01:00", 10},
+		{"Mon:16:00-Tux:01:00", 13},
+		{"Mon:16:00-Tue:01:00 x", 21},
+		{" # indented comment", 2},
+		{"PowerDown =x", 10},
+		{"PowerDown=x\r", 12},
+		{"Unknown=x", 1},
+	};
+
+	for (const auto& c : cases)
+	{
+		std::istringstream iss(c.line);
+		std::vector<action_t> sched;
+		std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+
+		try
+		{
+			read_schedule(back_inserter, iss, rtc::now());
+			BOOST_CHECK_MESSAGE(c.column == 0, "accepted: " + c.line);
+		}
+		catch (const rtc::parse_error& ex)
+		{
+			BOOST_CHECK_MESSAGE(ex.column() == c.column,
+								"column " + std::to_string(ex.column()) +
+									": " + c.line);
+		}
 	}
 }
 
@@ -203,7 +274,7 @@ BOOST_AUTO_TEST_CASE(get_next_on_time_test_1)
 	auto debug_schedule = to_string(sched.begin(), sched.end());
 
 	BOOST_CHECK(cmds.power_down == "/usr/sbin/rtcwake -m off -s %d");
-	BOOST_CHECK(cmds.check_stay_awake == "echo 0");
+	BOOST_CHECK(cmds.check_stay_awake == std::vector<std::string>{"echo 0"});
 
 	std::sort(sched.begin(), sched.end());
 	check_schedule(sched.begin(), sched.end());
@@ -232,7 +303,7 @@ BOOST_AUTO_TEST_CASE(get_next_on_time_test_2)
 	auto debug_schedule = to_string(sched.begin(), sched.end());
 
 	BOOST_CHECK(cmds.power_down == "/usr/sbin/rtcwake -m off -s %d");
-	BOOST_CHECK(cmds.check_stay_awake == "echo 0");
+	BOOST_CHECK(cmds.check_stay_awake == std::vector<std::string>{"echo 0"});
 
 	std::sort(sched.begin(), sched.end());
 	check_schedule(sched.begin(), sched.end());
@@ -326,7 +397,7 @@ BOOST_AUTO_TEST_CASE(main_test)
 	auto debug_schedule = to_string(sched.begin(), sched.end());
 
 	BOOST_CHECK(cmds.power_down == "/usr/sbin/rtcwake -m off -s %d");
-	BOOST_CHECK(cmds.check_stay_awake == "echo 0");
+	BOOST_CHECK(cmds.check_stay_awake == std::vector<std::string>{"echo 0"});
 
 	std::sort(sched.begin(), sched.end());
 	check_schedule(sched.begin(), sched.end());
@@ -405,7 +476,8 @@ BOOST_AUTO_TEST_CASE(main_test2)
 
 	BOOST_CHECK(cmds.power_down == "/usr/sbin/rtcwake -m off -s %d");
 	BOOST_CHECK(cmds.check_stay_awake ==
-				"netstat -n | grep tcp | grep -v TIME_WAIT | wc -l");
+				std::vector<std::string>{
+					"netstat -n | grep tcp | grep -v TIME_WAIT | wc -l"});
 
 	std::sort(sched.begin(), sched.end());
 	check_schedule(sched.begin(), sched.end());
@@ -469,3 +541,1804 @@ BOOST_AUTO_TEST_CASE(main_test2)
 
 	BOOST_CHECK(cnt == 7 * 24 * 60 + 60);
 }
+
+void CompareBitmap(const std::string& schedule)
+{
+	std::istringstream iss(schedule);
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	read_schedule(back_inserter, iss, now);
+	std::sort(sched.begin(), sched.end());
+	check_schedule(sched.begin(), sched.end());
+
+	auto week_start = get_week_start(now);
+	week_bitmap index(sched.begin(), sched.end(), week_start);
+
+	// every minute of the week and the first hour of the next one, also
+	// in the middle of a minute
+	for (int i = 0; i < 7 * 24 * 60 + 60; ++i)
+	{
+		for (auto tp : {week_start + minutes(i),
+						week_start + minutes(i) + seconds(30)})
+		{
+			bool state = get_state(sched.begin(), sched.end(), tp);
+			BOOST_CHECK(get_state(index, tp) == state);
+
+			if (!state)
+			{
+				auto expected =
+					get_next_on_time(sched.begin(), sched.end(), tp);
+				BOOST_CHECK(get_next_on_time(index, tp) == expected);
+				BOOST_CHECK(build_power_off_command(index, cmd_t{"%d", {}},
+													tp) ==
+							std::to_string((expected - tp).total_seconds()));
+			}
+			else
+			{
+				// the end of the window we are in
+				auto pos = std::find_if(sched.begin(), sched.end(),
+										[tp](const action_t& a)
+										{ return a.on <= tp && tp < a.off; });
+				BOOST_REQUIRE(pos != sched.end());
+
+				BOOST_CHECK(get_next_off_time(index, tp) == pos->off);
+			}
+
+			if (i % 37 == 0)
+			{
+				auto transitions =
+					get_next_transitions(sched.begin(), sched.end(), tp, 5);
+				BOOST_CHECK(transitions.size() == 5);
+				BOOST_CHECK(transitions == get_next_transitions(index, tp, 5));
+			}
+		}
+	}
+
+	// it repeats every week
+	for (int w : {-52, -1, 1, 520})
+	{
+		for (int i = 0; i < 7 * 24 * 60; i += 7)
+		{
+			auto tp = week_start + minutes(i);
+			BOOST_CHECK(get_state(index, tp) ==
+						get_state(index, tp + hours(w * 7 * 24)));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(bitmap_test)
+{
+	CompareBitmap(test_schedule);
+	CompareBitmap(test_schedule2);
+
+	// an empty schedule has no next on time
+	week_bitmap empty;
+	BOOST_CHECK(get_state(empty, rtc::now()) == false);
+	BOOST_CHECK_THROW(get_next_on_time(empty, rtc::now()), std::runtime_error);
+	BOOST_CHECK(get_next_transitions(empty, rtc::now(), 3).empty());
+}
+
+BOOST_AUTO_TEST_CASE(compact_test)
+{
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto week_start = get_week_start(now);
+
+	for (const auto& text : {test_schedule, test_schedule2})
+	{
+		std::istringstream iss(text);
+		std::vector<action_t> sched;
+		std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+		read_schedule(back_inserter, iss, now);
+
+		// it sorts on its own and converts back
+		compact_schedule compact(sched.begin(), sched.end(), week_start);
+		std::sort(sched.begin(), sched.end());
+		BOOST_REQUIRE(compact.size() == sched.size());
+		auto actions = compact.to_actions();
+		BOOST_CHECK(actions == sched);
+		for (std::size_t i = 0; i < actions.size(); ++i)
+		{
+			BOOST_CHECK(actions[i].line == sched[i].line);
+		}
+		BOOST_CHECK(validate_schedule(compact).empty());
+
+		for (int i = 0; i < 7 * 24 * 60 + 60; i += 3)
+		{
+			for (auto tp : {week_start + minutes(i),
+							week_start + minutes(i) + seconds(59) +
+								boost::posix_time::millisec(500)})
+			{
+				bool state = get_state(sched.begin(), sched.end(), tp);
+				BOOST_CHECK(get_state(compact, tp) == state);
+				BOOST_CHECK(get_next_on_time(compact, tp) ==
+							get_next_on_time(sched.begin(), sched.end(), tp));
+
+				// it repeats every week
+				auto later = tp + hours(52 * 7 * 24);
+				BOOST_CHECK(get_state(compact, later) == state);
+				BOOST_CHECK(get_state(compact, tp - hours(7 * 24)) == state);
+			}
+		}
+	}
+
+	// more windows than the linear scan takes
+	std::vector<action_t> many;
+	for (int i = 0; i < 200; ++i)
+	{
+		auto on = week_start + minutes(i * 50);
+		many.push_back({on, on + minutes(20), std::size_t(i + 1)});
+	}
+	compact_schedule big(many.begin(), many.end(), week_start);
+	BOOST_REQUIRE(big.size() > compact_schedule::linear_scan_max);
+	for (int i = 0; i < 7 * 24 * 60; i += 7)
+	{
+		auto tp = week_start + minutes(i);
+		BOOST_CHECK(get_state(big, tp) ==
+					get_state(many.begin(), many.end(), tp));
+		BOOST_CHECK(get_next_on_time(big, tp) ==
+					get_next_on_time(many.begin(), many.end(), tp));
+	}
+
+	// the same issues as the sweep, with their lines
+	std::vector<action_t> bad = {
+		{week_start + hours(10), week_start + hours(12), 1},
+		{week_start + hours(11), week_start + hours(13), 2},
+		{week_start + hours(20), week_start + hours(19), 3},
+	};
+	compact_schedule compact(bad.begin(), bad.end(), week_start);
+	auto issues = validate_schedule(compact);
+	auto expected = validate_schedule(bad.begin(), bad.end());
+	BOOST_REQUIRE(issues.size() == 2 && expected.size() == 2);
+	for (std::size_t i = 0; i < issues.size(); ++i)
+	{
+		BOOST_CHECK(issues[i].kind == expected[i].kind);
+		BOOST_CHECK(issues[i].first.line == expected[i].first.line);
+		BOOST_CHECK(issues[i].second.line == expected[i].second.line);
+	}
+	BOOST_CHECK_THROW(check_schedule(compact), schedule_error);
+
+	// only whole seconds in the week and later
+	std::vector<action_t> early = {
+		{week_start - hours(1), week_start + hours(1), 1}};
+	BOOST_CHECK_THROW(compact_schedule(early.begin(), early.end(), week_start),
+					  std::runtime_error);
+
+	compact_schedule empty;
+	BOOST_CHECK(!get_state(empty, now));
+	BOOST_CHECK_THROW(get_next_on_time(empty, now), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(overrides_test)
+{
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto at = [](const char* s)
+	{ return boost::posix_time::time_from_string(s); };
+
+	std::istringstream iss(test_schedule +
+						   "2019-02-19 08:00-2019-02-19 12:00 on # meeting\n"
+						   "2019-02-20..2019-02-21 off\n"
+						   "2019-02-21 16:00-2019-02-21 18:00 on\n"
+						   "2019-02-23\ton  \n");
+	auto c = compile_schedule(iss, now);
+	const auto& ov = c.cmds.overrides;
+
+	// flattened, the later line wins
+	BOOST_REQUIRE(ov.ranges().size() == 5);
+	BOOST_CHECK(ov.ranges()[1].from == at("2019-02-20 00:00:00"));
+	BOOST_CHECK(ov.ranges()[1].to == at("2019-02-21 16:00:00"));
+	BOOST_CHECK(!ov.ranges()[1].on && ov.ranges()[1].line == 20);
+	BOOST_CHECK(ov.ranges()[3].to == at("2019-02-22 00:00:00"));
+
+	BOOST_CHECK(get_state(c.index, ov, at("2019-02-19 09:00:00")));
+	BOOST_CHECK(!get_state(c.index, ov, at("2019-02-19 12:00:00")));
+	BOOST_CHECK(!get_state(c.index, ov, at("2019-02-20 00:30:00")));
+	BOOST_CHECK(get_state(c.index, ov, at("2019-02-21 17:00:00")));
+	BOOST_CHECK(!get_state(c.index, ov, at("2019-02-21 20:00:00")));
+	BOOST_CHECK(get_state(c.index, ov, at("2019-02-23 10:00:00")));
+	// the weekly windows next week
+	BOOST_CHECK(get_state(c.index, ov, at("2019-02-27 00:30:00")));
+
+	BOOST_CHECK(get_next_on_time(c.index, ov, now) ==
+				at("2019-02-19 16:00:00"));
+	BOOST_CHECK(get_next_on_time(c.index, ov, at("2019-02-20 00:30:00")) ==
+				at("2019-02-21 16:00:00"));
+	BOOST_CHECK(get_next_on_time(c.index, ov, at("2019-02-21 18:30:00")) ==
+				at("2019-02-22 00:00:00"));
+	BOOST_CHECK(get_next_off_time(c.index, ov, at("2019-02-22 20:00:00")) ==
+				at("2019-02-24 01:00:00"));
+
+	auto t = get_next_transitions(c.index, ov, now, 6);
+	BOOST_REQUIRE(t.size() == 6);
+	BOOST_CHECK(to_string(t[1]) == "2019-Feb-20 00:00:00 off");
+	BOOST_CHECK(to_string(t[2]) == "2019-Feb-21 16:00:00 on");
+	BOOST_CHECK(to_string(t[3]) == "2019-Feb-21 18:00:00 off");
+	BOOST_CHECK(to_string(t[4]) == "2019-Feb-22 00:00:00 on");
+	BOOST_CHECK(to_string(t[5]) == "2019-Feb-22 01:00:00 off");
+
+	// the weekly window starts at 10:35, but not on this day
+	auto d = decide(c.index, c.cmds, at("2019-02-20 10:00:00"), false,
+					[]() { return false; });
+	BOOST_CHECK(!d.scheduled_on && d.power_off);
+	BOOST_CHECK(d.wake_up_at == at("2019-02-21 16:00:00"));
+
+	for (const char* bad : {"2019-02-30 on\n", "2019-02-20..2019-02-19 off\n",
+							"2019-02-20 on x\n", "2019-02-20off\n",
+							"2019-02-20 10:00-2019-02-20 09:00 on\n"})
+	{
+		std::istringstream bad_iss(bad);
+		std::vector<action_t> sched;
+		std::back_insert_iterator<std::vector<action_t>> inserter(sched);
+		BOOST_CHECK_THROW(read_schedule(inserter, bad_iss, now), parse_error);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(transitions_test)
+{
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto week_start = get_week_start(now);
+
+	// Tue:16:00-Wed:01:00 and Sun:16:00-Mon:01:00 over the end of the week
+	std::vector<action_t> sched = {
+		{week_start, week_start + hours(1)},
+		{week_start + hours(24 + 16), week_start + hours(48 + 1)},
+		{week_start + hours(6 * 24 + 16), week_start + hours(7 * 24 + 1)}};
+
+	auto t = get_next_transitions(sched.begin(), sched.end(), now, 5);
+	BOOST_REQUIRE(t.size() == 5);
+	BOOST_CHECK(to_string(t[0]) == "2019-Feb-19 16:00:00 on");
+	BOOST_CHECK(to_string(t[1]) == "2019-Feb-20 01:00:00 off");
+	BOOST_CHECK(to_string(t[2]) == "2019-Feb-24 16:00:00 on");
+	// no off at midnight
+	BOOST_CHECK(to_string(t[3]) == "2019-Feb-25 01:00:00 off");
+	BOOST_CHECK(to_string(t[4]) == "2019-Feb-26 16:00:00 on");
+
+	// in a window: the first one is off
+	auto in = get_next_transitions(sched.begin(), sched.end(),
+								   week_start + hours(44), 1);
+	BOOST_REQUIRE(in.size() == 1);
+	BOOST_CHECK(to_string(in[0]) == "2019-Feb-20 01:00:00 off");
+
+	// the second half of the window over the end of the week
+	BOOST_CHECK(get_next_on_time(sched.begin(), sched.end(),
+								 week_start + hours(6 * 24 + 20)) ==
+				week_start + hours(7 * 24 + 24 + 16));
+
+	// always on has no transitions
+	std::vector<action_t> always = {{week_start, week_start + hours(7 * 24)}};
+	BOOST_CHECK(
+		get_next_transitions(always.begin(), always.end(), now, 3).empty());
+
+	std::vector<action_t> empty;
+	BOOST_CHECK_THROW(get_next_on_time(empty.begin(), empty.end(), now),
+					  std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(validate_schedule_test)
+{
+	using kind_t = schedule_issue_t::kind_t;
+
+	const std::string schedule = "Mon:10:00-Mon:12:00\n" // 1
+								 "Mon:11:00-Mon:13:00\n" // 2: overlaps 1
+								 "Mon:11:30-Mon:11:45\n" // 3: overlaps 1, 2
+								 "Tue:10:00-Tue:12:00\n" // 4
+								 "Tue:12:00-Tue:14:00\n" // 5: touches 4
+								 "Wed:10:00-Wed:12:00\n" // 6
+								 "Sun:16:00-Mon:01:00\n" // 7
+								 "Mon:00:30-Mon:02:00\n"; // 8: overlaps 7
+
+	std::istringstream iss(schedule);
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	read_schedule(back_inserter, iss, rtc::now());
+
+	// the order of the input does not matter
+	std::reverse(sched.begin(), sched.end());
+
+	auto issues = validate_schedule(sched.begin(), sched.end());
+
+	std::vector<std::pair<std::size_t, std::size_t>> pairs;
+	for (const auto& issue : issues)
+	{
+		BOOST_CHECK(issue.kind == kind_t::overlap);
+		pairs.push_back({std::min(issue.first.line, issue.second.line),
+						 std::max(issue.first.line, issue.second.line)});
+	}
+	std::sort(pairs.begin(), pairs.end());
+
+	std::vector<std::pair<std::size_t, std::size_t>> expected = {
+		{1, 2}, {1, 3}, {2, 3}, {4, 5}, {7, 8}};
+	BOOST_CHECK(pairs == expected);
+
+	// check_schedule reports them all at once
+	try
+	{
+		check_schedule(sched.begin(), sched.end());
+		BOOST_REQUIRE(false);
+	}
+	catch (const schedule_error& ex)
+	{
+		BOOST_CHECK(ex.issues().size() == expected.size());
+	}
+
+	// inverted and too long windows
+	auto ws = get_week_start(rtc::now());
+	std::vector<action_t> bad = {
+		{ws + hours(10), ws + hours(9), 1},
+		{ws + hours(20), ws + hours(20 + 7 * 24 + 1), 2},
+		{ws + hours(30), ws + hours(31), 3}, // overlaps 2
+	};
+	issues = validate_schedule(bad.begin(), bad.end());
+	BOOST_REQUIRE(issues.size() == 3);
+	BOOST_CHECK(issues[0].kind == kind_t::inverted);
+	BOOST_CHECK(issues[0].first.line == 1);
+	BOOST_CHECK(issues[1].kind == kind_t::too_long);
+	BOOST_CHECK(issues[1].first.line == 2);
+	BOOST_CHECK(issues[2].kind == kind_t::overlap);
+	BOOST_CHECK(issues[2].first.line == 2 && issues[2].second.line == 3);
+
+	// a line repeated in one file overlaps itself
+	std::istringstream dup("Thu:10:00-Thu:12:00\n"	// 1
+						   "Thu:10:00-Thu:12:00\n"); // 2: the same as 1
+	sched.clear();
+	read_schedule(back_inserter, dup, rtc::now());
+	issues = validate_schedule(sched.begin(), sched.end());
+	BOOST_REQUIRE(issues.size() == 1);
+	BOOST_CHECK(issues[0].kind == kind_t::overlap);
+
+	// the valid schedules pass
+	for (const auto& text : {test_schedule, test_schedule2})
+	{
+		std::istringstream iss(text);
+		std::vector<action_t> sched;
+		std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+		read_schedule(back_inserter, iss, rtc::now());
+		BOOST_CHECK(validate_schedule(sched.begin(), sched.end()).empty());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(decide_test)
+{
+	std::istringstream iss(test_schedule);
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto cmds = read_schedule(back_inserter, iss, now);
+	std::sort(sched.begin(), sched.end());
+	week_bitmap index(sched.begin(), sched.end(), get_week_start(now));
+
+	int calls = 0;
+	auto awake = [&calls]()
+	{
+		++calls;
+		return true;
+	};
+	auto asleep = [&calls]()
+	{
+		++calls;
+		return false;
+	};
+
+	// in the on time CheckStayAwake is not asked
+	auto on = boost::posix_time::time_from_string("2019-02-19 17:00:00");
+	auto d = decide(index, cmds, on, false, awake);
+	BOOST_CHECK(d.scheduled_on && !d.power_off && calls == 0);
+
+	// in the off time it is
+	d = decide(index, cmds, now, false, awake);
+	BOOST_CHECK(!d.scheduled_on && d.stay_awake && !d.power_off);
+	BOOST_CHECK(calls == 1);
+
+	d = decide(index, cmds, now, false, asleep);
+	BOOST_CHECK(d.power_off);
+	BOOST_CHECK(to_iso_string(d.wake_up_at) == "20190219T160000");
+	BOOST_CHECK(d.power_off_cmd == "/usr/sbin/rtcwake -m off -s 11808");
+
+	// forced overrides CheckStayAwake
+	d = decide(index, cmds, now, true, awake);
+	BOOST_CHECK(d.stay_awake && d.power_off);
+}
+
+// a fresh directory below /tmp for file based tests
+std::string make_temp_dir()
+{
+	char tmpl[] = "/tmp/rtcwake-schedule-test-XXXXXX";
+	BOOST_REQUIRE(mkdtemp(tmpl) != nullptr);
+	return tmpl;
+}
+
+void write_file(const std::string& path, const std::string& content)
+{
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	ofs << content;
+}
+
+// seconds since 1970 of a local time, as libc sees it
+std::int64_t local_epoch(const time_point_t tp)
+{
+	auto tm = boost::posix_time::to_tm(tp);
+	tm.tm_isdst = -1;
+	return std::mktime(&tm);
+}
+
+BOOST_AUTO_TEST_CASE(cache_test)
+{
+	auto dir = make_temp_dir();
+	auto path = dir + "/schedule";
+	auto cache_path = dir + "/cache/schedule.bin";
+	write_file(path, test_schedule + "2019-12-24..2019-12-26 on\n");
+
+	std::string content;
+	file_stamp_t stamp;
+	BOOST_REQUIRE(read_file(path, content, stamp));
+	BOOST_CHECK(content == test_schedule + "2019-12-24..2019-12-26 on\n");
+
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	std::istringstream iss(content);
+	auto compiled = compile_schedule(iss, now);
+
+	// nothing there yet
+	compiled_schedule_t loaded;
+	BOOST_CHECK(!load_compiled_schedule(cache_path, stamp, now, loaded));
+
+	BOOST_REQUIRE(store_compiled_schedule(cache_path, stamp, content, compiled));
+
+	// the next week it is still valid, moved to that week
+	auto next_week = now + hours(7 * 24);
+	BOOST_REQUIRE(load_compiled_schedule(cache_path, stamp, next_week, loaded));
+	BOOST_REQUIRE(loaded.actions.size() == compiled.actions.size());
+	for (std::size_t i = 0; i < loaded.actions.size(); ++i)
+	{
+		BOOST_CHECK(loaded.actions[i].on ==
+					compiled.actions[i].on + hours(7 * 24));
+		BOOST_CHECK(loaded.actions[i].off ==
+					compiled.actions[i].off + hours(7 * 24));
+		BOOST_CHECK(loaded.actions[i].line == compiled.actions[i].line);
+	}
+	BOOST_CHECK(loaded.index.raw_words() == compiled.index.raw_words());
+	BOOST_CHECK(loaded.index.week_start() == get_week_start(next_week));
+	BOOST_CHECK(loaded.cmds.power_down == compiled.cmds.power_down);
+	BOOST_CHECK(loaded.cmds.check_stay_awake == compiled.cmds.check_stay_awake);
+	BOOST_CHECK(loaded.cmds.overrides.ranges().size() == 1);
+	BOOST_CHECK(loaded.cmds.overrides.ranges() ==
+				compiled.cmds.overrides.ranges());
+
+	// a changed file does not match the stamp
+	write_file(path, test_schedule2);
+	file_stamp_t stamp2;
+	BOOST_REQUIRE(read_file(path, content, stamp2));
+	BOOST_CHECK(stamp2 != stamp);
+	BOOST_CHECK(!load_compiled_schedule(cache_path, stamp2, now, loaded));
+
+	// a truncated cache is ignored
+	{
+		std::ifstream ifs(cache_path, std::ios::binary);
+		std::string bin((std::istreambuf_iterator<char>(ifs)),
+						std::istreambuf_iterator<char>());
+		write_file(cache_path, bin.substr(0, bin.size() - 3));
+	}
+	BOOST_CHECK(!load_compiled_schedule(cache_path, stamp, now, loaded));
+
+	std::system(("rm -rf " + dir).c_str());
+}
+
+// big endian, as in TZif files
+void put_be(std::string& out, std::uint64_t v, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; --i)
+	{
+		out += static_cast<char>((v >> (i * 8)) & 0xff);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(timezone_test)
+{
+	using boost::posix_time::time_from_string;
+
+	std::vector<zone_transition_t> transitions;
+	BOOST_REQUIRE(
+		expand_posix_tz("CET-1CEST,M3.5.0,M10.5.0/3", 0, transitions));
+	time_zone_table zone(transitions);
+
+	// 2019-03-31: 02:00 CET -> 03:00 CEST, 2019-10-27: 03:00 CEST -> 02:00
+	BOOST_CHECK(zone.to_utc(time_from_string("2019-03-31 01:59:00")) ==
+				time_from_string("2019-03-31 00:59:00"));
+	BOOST_CHECK(zone.to_utc(time_from_string("2019-03-31 03:00:00")) ==
+				time_from_string("2019-03-31 01:00:00"));
+	BOOST_CHECK(zone.to_local(time_from_string("2019-07-01 12:00:00")) ==
+				time_from_string("2019-07-01 14:00:00"));
+
+	// the skipped hour is at the switch
+	BOOST_CHECK(zone.to_utc(time_from_string("2019-03-31 02:30:00")) ==
+				time_from_string("2019-03-31 01:00:00"));
+
+	// the repeated hour is the first one
+	BOOST_CHECK(zone.to_utc(time_from_string("2019-10-27 02:30:00")) ==
+				time_from_string("2019-10-27 00:30:00"));
+	BOOST_CHECK(zone.to_utc(time_from_string("2019-10-27 03:00:00")) ==
+				time_from_string("2019-10-27 02:00:00"));
+
+	// the night to the switch is an hour shorter
+	cmd_t cmds;
+	cmds.power_down = "%d";
+	auto now = time_from_string("2019-03-30 22:00:00");
+	auto wake = time_from_string("2019-03-31 08:00:00");
+	BOOST_CHECK(build_power_off_command(wake, cmds, now) == "36000");
+	cmds.zone = zone;
+	BOOST_CHECK(build_power_off_command(wake, cmds, now) == "32400");
+
+	// the epoch of a wake up only depends on the local time, not the clock
+	BOOST_CHECK(to_epoch(cmds, wake) == 1554012000); // 06:00 UTC
+	BOOST_CHECK(to_epoch(cmds, now) == 1553979600);	 // 21:00 UTC
+
+	// the switch in the southern hemisphere is the other way round
+	transitions.clear();
+	BOOST_REQUIRE(
+		expand_posix_tz("AEST-10AEDT,M10.1.0,M4.1.0/3", 0, transitions));
+	time_zone_table sydney(transitions);
+	BOOST_CHECK(sydney.offset_at(1547000000) == 11 * 3600); // January
+	BOOST_CHECK(sydney.offset_at(1562000000) == 10 * 3600); // July
+
+	transitions.clear();
+	BOOST_CHECK(!expand_posix_tz("CET-1CEST,M13.5.0,M10.5.0", 0, transitions));
+
+	// a TZif file: a v1 block without transitions, the v2 block with two
+	// and the TZ string after them
+	auto header = [](std::string& out, int times, int types, int chars)
+	{
+		out += "TZif2";
+		out += std::string(15, '\0');
+		for (int n : {0, 0, 0, times, types, chars})
+		{
+			put_be(out, n, 4);
+		}
+	};
+	std::string tzif;
+	header(tzif, 0, 1, 4);
+	put_be(tzif, 3600, 4);
+	tzif += std::string("\0\0CET\0", 6);
+
+	header(tzif, 2, 2, 10);
+	put_be(tzif, 1553994000, 8); // 2019-03-31 01:00 UTC
+	put_be(tzif, 1572138000, 8); // 2019-10-27 01:00 UTC
+	tzif += std::string("\1\0", 2);
+	put_be(tzif, 3600, 4);
+	tzif += std::string("\0\0", 2);
+	put_be(tzif, 7200, 4);
+	tzif += std::string("\1\4", 2);
+	tzif += std::string("CET\0CEST\0\0", 10);
+	tzif += "\nCET-1CEST,M3.5.0,M10.5.0/3\n";
+
+	auto parsed = parse_tzif(tzif);
+	BOOST_REQUIRE(parsed.size() > 3);
+	BOOST_CHECK(parsed[1] == zone_transition_t({1553994000, 7200, 1}));
+	BOOST_CHECK(parsed[2] == zone_transition_t({1572138000, 3600, 0}));
+	time_zone_table from_file(parsed);
+	bool same = true;
+	for (std::int64_t t = 1546300800; t < 1900000000; t += 86400 / 3)
+	{
+		same = same && from_file.offset_at(t) == zone.offset_at(t);
+	}
+	BOOST_CHECK(same);
+	BOOST_CHECK_THROW(parse_tzif(tzif.substr(0, 60)), std::runtime_error);
+
+	// the table is stored with the compiled schedule
+	auto dir = make_temp_dir();
+	auto path = dir + "/schedule";
+	write_file(path, test_schedule);
+	std::string content;
+	file_stamp_t stamp;
+	BOOST_REQUIRE(read_file(path, content, stamp));
+	std::istringstream iss(content);
+	auto compiled = compile_schedule(iss, now);
+	zone_source_t source;
+	source.name = "Europe/Berlin";
+	compiled.cmds.zone = time_zone_table(parsed, source);
+	BOOST_REQUIRE(
+		store_compiled_schedule(dir + "/schedule.bin", stamp, content, compiled));
+
+	compiled_schedule_t loaded;
+	BOOST_REQUIRE(
+		load_compiled_schedule(dir + "/schedule.bin", stamp, now, loaded));
+	BOOST_CHECK(loaded.cmds.zone.transitions() ==
+				compiled.cmds.zone.transitions());
+	BOOST_CHECK(loaded.cmds.zone.source() == source);
+
+	std::system(("rm -rf " + dir).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(fragments_test)
+{
+	auto dir = make_temp_dir();
+	schedule_files_t files;
+	files.schedule_path = dir + "/schedule";
+	files.fragment_dir = dir + "/schedule.d";
+	files.cache_path = dir + "/cache/schedule.bin";
+
+	write_file(files.schedule_path, "PowerDown=/usr/sbin/rtcwake -m off -s %d\n"
+									"Mon:16:00-Mon:18:00\n");
+	std::system(("mkdir -p " + files.fragment_dir).c_str());
+	write_file(files.fragment_dir + "/20-evening.conf", "Tue:18:00-Tue:20:00\n"
+														"Mon:19:00-Mon:20:00\n");
+	write_file(files.fragment_dir + "/10-morning.conf", "Tue:06:00-Tue:07:00\n"
+														"Mon:06:00-Mon:07:00\n");
+	write_file(files.fragment_dir + "/README", "not a fragment\n");
+
+	auto fragments = list_fragments(files.fragment_dir);
+	BOOST_REQUIRE(fragments.size() == 2);
+	BOOST_CHECK(fragments[0] == files.fragment_dir + "/10-morning.conf");
+	BOOST_CHECK(fragments[1] == files.fragment_dir + "/20-evening.conf");
+	BOOST_CHECK(list_fragments(dir + "/missing").empty());
+
+	// the runs are merged in time order and remember their file
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	run_trace trace;
+	auto loaded = load_schedule(files, now, trace);
+	BOOST_CHECK(loaded.sources.size() == 3 && loaded.cached == 0);
+
+	const auto& actions = loaded.compiled.actions;
+	BOOST_REQUIRE(actions.size() == 5);
+	BOOST_CHECK(std::is_sorted(actions.begin(), actions.end()));
+	std::vector<std::uint32_t> sources;
+	for (const auto& a : actions)
+	{
+		sources.push_back(a.source);
+	}
+	BOOST_CHECK(sources == std::vector<std::uint32_t>({1, 0, 2, 1, 2}));
+	BOOST_CHECK(loaded.compiled.cmds.power_down ==
+				"/usr/sbin/rtcwake -m off -s %d");
+
+	// the index covers all files
+	for (const auto& a : actions)
+	{
+		BOOST_CHECK(get_state(loaded.compiled.index, a.on));
+		BOOST_CHECK(!get_state(loaded.compiled.index, a.off));
+	}
+
+	// unchanged files come from their caches, also in parallel
+	files.parallel_from = 1;
+	run_trace trace2;
+	auto again = load_schedule(files, now, trace2);
+	BOOST_CHECK(again.cached == 3);
+	BOOST_CHECK(again.compiled.actions == actions);
+	BOOST_CHECK(again.compiled.index.raw_words() ==
+				loaded.compiled.index.raw_words());
+
+	// an overlap across files names both of them
+	write_file(files.fragment_dir + "/30-overlap.conf", "Mon:17:00-Mon:19:30\n");
+	try
+	{
+		load_schedule(files, now, trace2);
+		BOOST_REQUIRE(false);
+	}
+	catch (const schedule_error& ex)
+	{
+		std::string msg = ex.what();
+		BOOST_CHECK(ex.issues().size() == 2);
+		BOOST_CHECK(msg.find(files.schedule_path + " line 2") !=
+					std::string::npos);
+		BOOST_CHECK(msg.find("30-overlap.conf line 1") != std::string::npos);
+		BOOST_CHECK(msg.find("20-evening.conf line 2") != std::string::npos);
+	}
+
+	// the same windows in two files are merged into one, also a window over
+	// the end of the week. The next on times stay the window starts.
+	write_file(files.fragment_dir + "/30-overlap.conf", "Sun:22:00-Mon:02:00\n");
+	auto once = load_schedule(files, now, trace2).compiled.actions;
+	write_file(files.fragment_dir + "/40-again.conf",
+			   "Sun:22:00-Mon:02:00\nMon:16:00-Mon:18:00\n");
+	auto twice = load_schedule(files, now, trace2).compiled.actions;
+	BOOST_CHECK(twice == once && twice.size() == 7);
+	auto ws = get_week_start(now);
+	for (auto t = ws; t < ws + hours(7 * 24); t += hours(1))
+	{
+		BOOST_CHECK(get_next_on_time(twice.begin(), twice.end(), t) ==
+					get_next_on_time(once.begin(), once.end(), t));
+	}
+	BOOST_CHECK(get_next_on_time(twice.begin(), twice.end(),
+								 ws + hours(6 * 24 + 23)) ==
+				ws + hours(7 * 24 + 6));
+	std::remove((files.fragment_dir + "/40-again.conf").c_str());
+
+	// a file with only Key= lines is cached as well
+	write_file(files.fragment_dir + "/40-checks.conf",
+			   "CheckStayAwake=pgrep -c borg\n");
+	load_schedule(files, now, trace2);
+	auto checks = load_schedule(files, now, trace2);
+	BOOST_CHECK(checks.cached == checks.sources.size());
+	BOOST_CHECK(checks.compiled.cmds.check_stay_awake ==
+				std::vector<std::string>({"pgrep -c borg"}));
+	std::remove((files.fragment_dir + "/40-checks.conf").c_str());
+
+	// a syntax error names the file
+	write_file(files.fragment_dir + "/30-overlap.conf", "Mon:17:00\n");
+	try
+	{
+		load_schedule(files, now, trace2);
+		BOOST_REQUIRE(false);
+	}
+	catch (const parse_error& ex)
+	{
+		BOOST_CHECK(std::string(ex.what()).find(files.fragment_dir +
+											   "/30-overlap.conf: ") == 0);
+	}
+
+	std::system(("rm -rf " + dir).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(parse_duration_test)
+{
+	duration_t d;
+	BOOST_CHECK(detail::parse_duration("90", d) && d == seconds(90));
+	BOOST_CHECK(detail::parse_duration("90s", d) && d == seconds(90));
+	BOOST_CHECK(detail::parse_duration("10m", d) && d == minutes(10));
+	BOOST_CHECK(detail::parse_duration("2h", d) && d == hours(2));
+	BOOST_CHECK(detail::parse_duration("1d", d) && d == hours(24));
+	BOOST_CHECK(detail::parse_duration("1h30m", d) &&
+				d == hours(1) + minutes(30));
+	BOOST_CHECK(!detail::parse_duration("", d));
+	BOOST_CHECK(!detail::parse_duration("h", d));
+	BOOST_CHECK(!detail::parse_duration("10x", d));
+	BOOST_CHECK(!detail::parse_duration("-10", d));
+
+	std::istringstream iss("CommandTimeout=2m\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto cmds = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_CHECK(cmds.command_timeout == minutes(2));
+}
+
+BOOST_AUTO_TEST_CASE(run_command_test)
+{
+	// no shell needed
+	BOOST_CHECK((command_argv("echo  hello\tworld") ==
+				 std::vector<std::string>{"echo", "hello", "world"}));
+	BOOST_CHECK((command_argv("netstat -n | wc -l") ==
+				 std::vector<std::string>{"/bin/sh", "-c",
+										  "netstat -n | wc -l"}));
+
+	exec_options_t opts;
+	auto r = run_command("echo hello", opts);
+	BOOST_CHECK(r.output == "hello\n");
+	BOOST_CHECK(r.exited() && r.exit_status == 0);
+
+	r = run_command("echo 0 | cat", opts);
+	BOOST_CHECK(r.output == "0\n");
+
+	r = run_command("sh -c 'exit 3'", opts);
+	BOOST_CHECK(r.exited() && r.exit_status == 3);
+
+	// like popen, an empty command prints nothing
+	r = run_command("", opts);
+	BOOST_CHECK(r.output.empty() && r.exit_status == 0);
+
+	BOOST_CHECK_THROW(run_command("/does/not/exist", opts), std::runtime_error);
+
+	// the output is capped
+	opts.max_output = 1000;
+	r = run_command("head -c 100000 /dev/zero", opts);
+	BOOST_CHECK(r.output.size() == 1000);
+	BOOST_CHECK(r.truncated);
+	BOOST_CHECK(r.exit_status == 0);
+
+	// a hanging command gets killed
+	opts.timeout = boost::posix_time::milliseconds(200);
+	auto start = std::chrono::steady_clock::now();
+	r = run_command("echo started; sleep 10", opts);
+	auto took = std::chrono::steady_clock::now() - start;
+	BOOST_CHECK(r.timed_out);
+	BOOST_CHECK(r.term_signal == SIGTERM);
+	BOOST_CHECK(r.output == "started\n");
+	BOOST_CHECK(took < std::chrono::seconds(5));
+
+	// it ignores SIGTERM: SIGKILL after the grace time
+	opts.kill_grace = boost::posix_time::milliseconds(200);
+	r = run_command("trap '' TERM; sleep 10", opts);
+	BOOST_CHECK(r.timed_out);
+	BOOST_CHECK(r.term_signal == SIGKILL);
+
+	// a hanging CheckStayAwake does not block and keeps it awake
+	cmd_t cmds;
+	cmds.check_stay_awake = {"sleep 10"};
+	cmds.command_timeout = boost::posix_time::milliseconds(100);
+	BOOST_CHECK(check_stay_awake(cmds, rtc::now()));
+	cmds.check_stay_awake = {"echo 0"};
+	BOOST_CHECK(!check_stay_awake(cmds, rtc::now()));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_checks_test)
+{
+	std::istringstream iss("CheckStayAwake=smbstatus -b | grep -c .\n"
+						   "CheckStayAwake=pgrep -c rsync\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto parsed = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_CHECK(parsed.check_stay_awake ==
+				std::vector<std::string>(
+					{"smbstatus -b | grep -c .", "pgrep -c rsync"}));
+
+	// the first one that says something else than "0" stops the others
+	auto start = std::chrono::steady_clock::now();
+	auto results =
+		run_commands({"sleep 10", "echo 1", "sh -c 'sleep 10; echo 0'"},
+					 exec_options_t(),
+					 [](std::size_t, const exec_result_t& r)
+					 { return r.output != "0\n"; });
+	BOOST_CHECK(std::chrono::steady_clock::now() - start <
+				std::chrono::seconds(5));
+	BOOST_REQUIRE(results.size() == 3);
+	BOOST_CHECK(results[0].cancelled && !results[0].exited());
+	BOOST_CHECK(!results[1].cancelled && results[1].output == "1\n");
+	BOOST_CHECK(results[2].cancelled);
+
+	// all of them say "0": in the order they finished
+	cmd_t cmds;
+	cmds.check_stay_awake = {"sh -c 'sleep 0.3; echo 0'", "echo 0"};
+	auto checks = run_stay_awake_checks(cmds);
+	BOOST_REQUIRE(checks.size() == 2);
+	BOOST_CHECK(checks[0].text == "echo 0" && checks[0].count == 0);
+	BOOST_CHECK(checks[1].count == 0);
+	BOOST_CHECK(!check_stay_awake(cmds, rtc::now()));
+
+	// the one that keeps it awake comes last
+	cmds.check_stay_awake = {"sleep 10", "echo 2", "echo 0"};
+	start = std::chrono::steady_clock::now();
+	checks = run_stay_awake_checks(cmds);
+	BOOST_CHECK(std::chrono::steady_clock::now() - start <
+				std::chrono::seconds(5));
+	BOOST_REQUIRE(!checks.empty());
+	BOOST_CHECK(checks.back().text == "echo 2" && checks.back().count == 1);
+}
+
+BOOST_AUTO_TEST_CASE(cache_for_test)
+{
+	// CacheFor= belongs to the check before it
+	std::istringstream iss("CheckStayAwake=cat flag\n"
+						   "CacheFor=10m\n"
+						   "StayAwakeIf=logged-in-users\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto parsed = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_REQUIRE(parsed.cache_for.size() == 1);
+	BOOST_CHECK(parsed.cache_for.at("cat flag") == minutes(10));
+
+	for (const auto& bad : {"CacheFor=10m", "CheckStayAwake=true\nCacheFor=x"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	auto dir = make_temp_dir();
+	cmd_t cmds;
+	cmds.check_stay_awake = {"cat " + dir + "/flag"};
+	cmds.cache_for[cmds.check_stay_awake[0]] = minutes(10);
+
+	probe_context_t ctx;
+	ctx.state_path = dir + "/run/checks";
+	ctx.now = 1000;
+
+	// a positive result is kept
+	write_file(dir + "/flag", "2\n");
+	auto checks = run_stay_awake_checks(cmds, ctx);
+	BOOST_REQUIRE(checks.size() == 1);
+	BOOST_CHECK(checks[0].count == 1 && !checks[0].cached);
+
+	// and used again without running the check
+	write_file(dir + "/flag", "0\n");
+	ctx.now = 1000 + 599;
+	checks = run_stay_awake_checks(cmds, ctx);
+	BOOST_REQUIRE(checks.size() == 1);
+	BOOST_CHECK(checks[0].count == 1 && checks[0].cached);
+
+	// until it expired
+	ctx.now = 1000 + 600;
+	checks = run_stay_awake_checks(cmds, ctx);
+	BOOST_REQUIRE(checks.size() == 1);
+	BOOST_CHECK(checks[0].count == 0 && !checks[0].cached);
+
+	// the file was replaced, no temporary one is left
+	check_state state;
+	state.set("a b", {5, 3});
+	BOOST_CHECK(state.store(ctx.state_path));
+	state = check_state();
+	state.load(ctx.state_path);
+	BOOST_REQUIRE(state.entries().size() == 1);
+	BOOST_CHECK(state.entries().at("a b").at == 5);
+	BOOST_CHECK(state.entries().at("a b").count == 3);
+	BOOST_CHECK(std::system(("test \"$(ls " + dir + "/run)\" = checks")
+								.c_str()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(process_limits_test)
+{
+	// the limits belong to the CheckStayAwake= command before them
+	std::istringstream iss("CheckStayAwake=smbstatus -b\n"
+						   "Nice=10\n"
+						   "IOSchedulingClass=idle\n"
+						   "MemoryMax=256M\n"
+						   "CPUQuota=50%\n"
+						   "CheckStayAwake=true\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto parsed = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_REQUIRE(parsed.limits.size() == 1);
+	const auto& l = parsed.limits.at("smbstatus -b");
+	BOOST_CHECK(l.has_nice && l.nice == 10);
+	BOOST_CHECK(l.io_class == process_limits_t::io_class_t::idle);
+	BOOST_CHECK(l.memory_max == 256ULL << 20 && l.cpu_quota == 50);
+
+	for (const auto& bad :
+		 {"Nice=1", "StayAwakeIf=logged-in-users\nNice=1",
+		  "CheckStayAwake=true\nNice=20", "CheckStayAwake=true\nNice=-",
+		  "CheckStayAwake=true\nIOSchedulingClass=low",
+		  "CheckStayAwake=true\nIOSchedulingPriority=8",
+		  "CheckStayAwake=true\nMemoryMax=1T",
+		  "CheckStayAwake=true\nCPUQuota=50"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	// set in the child before the exec, the shell passes them on. The
+	// cgroup can not be made in a plain directory: rlimits then.
+	auto dir = make_temp_dir();
+	exec_options_t opts;
+	opts.timeout = seconds(10);
+	opts.cgroup_root = dir + "/cgroup";
+	opts.limits.resize(2);
+	opts.limits[0] = l;
+	opts.limits[0].io_class = process_limits_t::io_class_t::best_effort;
+	opts.limits[0].io_priority = 7;
+	auto results = run_commands(
+		{"sh -c 'nice; ulimit -v; ulimit -t; ionice'", "nice"}, opts,
+		[](std::size_t, const exec_result_t&) { return false; });
+	BOOST_CHECK(results[0].output == "10\n262144\n5\nbest-effort: prio 7\n");
+	BOOST_CHECK(results[1].output == "0\n");
+	BOOST_CHECK(std::system(("test -z \"$(ls " + dir + "/cgroup)\"")
+								.c_str()) == 0);
+
+	BOOST_CHECK_THROW(run_command("/nonexistent", opts), std::runtime_error);
+
+	// what it cost, for the tuning
+	auto r = run_command("sh -c 'i=0; while [ $i -lt 20000 ]; do "
+						 "i=$((i+1)); done'",
+						 opts);
+	BOOST_CHECK(r.exit_status == 0);
+	BOOST_CHECK(r.cpu_us > 0 && r.max_rss_kb > 0);
+}
+
+BOOST_AUTO_TEST_CASE(power_tier_test)
+{
+	std::istringstream iss("PowerDown=off %d\n"
+						   "PowerDownBelow=12h disk %d\n"
+						   "PowerDownBelow=2h mem %d\n"
+						   "PowerDownBelow=12h hibernate %d\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto cmds = read_schedule(back_inserter, iss, rtc::now());
+
+	// sorted, the same limit again replaced the first one
+	BOOST_REQUIRE(cmds.power_tiers.size() == 2);
+	BOOST_CHECK(cmds.power_tiers[0].below == hours(2));
+	BOOST_CHECK(cmds.power_tiers[1].command == "hibernate %d");
+
+	for (const auto& bad : {"PowerDownBelow=2h", "PowerDownBelow=2x mem %d",
+							"PowerDownBelow=0m mem %d"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	// the limit itself belongs to the next tier
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:00:00");
+	BOOST_CHECK(build_power_off_command(now + minutes(40), cmds, now) ==
+				"mem 2400");
+	BOOST_CHECK(build_power_off_command(now + hours(2), cmds, now) ==
+				"hibernate 7200");
+	BOOST_CHECK(build_power_off_command(now + hours(12), cmds, now) ==
+				"off 43200");
+
+	// --test tells why
+	BOOST_CHECK(explain_power_tier(cmds, minutes(40)) ==
+				"sleep of 00:40:00 is below 2h: mem %d");
+	BOOST_CHECK(explain_power_tier(cmds, hours(30)) ==
+				"sleep of 30:00:00 is not below 12h: PowerDown");
+
+	// with WakeAlarm= a tier runs its command instead of the state
+	cmds.wake_alarm.rtc = "rtc0";
+	cmds.wake_alarm.state = "mem";
+	BOOST_CHECK(build_power_off_command(now + hours(20), cmds, now).empty());
+	BOOST_CHECK(build_power_off_command(now + minutes(40), cmds, now) ==
+				"mem 2400");
+}
+
+BOOST_AUTO_TEST_CASE(wake_lead_test)
+{
+	std::istringstream iss(test_schedule +
+						   std::string("WakeLead=10m\n"
+									   "WakeLead=1h Wed:10:35\n"
+									   "WarmUp=/etc/hot.list\n"));
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto cmds = read_schedule(back_inserter, iss, now);
+	std::sort(sched.begin(), sched.end());
+	week_bitmap index(sched.begin(), sched.end(), get_week_start(now));
+	BOOST_CHECK(cmds.wake_lead == minutes(10));
+	BOOST_CHECK(cmds.window_leads.size() == 1);
+	BOOST_CHECK(cmds.warm_up == "/etc/hot.list");
+
+	for (const auto& bad : {"WakeLead=", "WakeLead=10m Wed", "WakeLead=x",
+							"WakeLead=10m Wed:25:00", "WakeLead=1m Mon:00:00 x"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, now), parse_error);
+	}
+
+	// the alarm goes off before the window, the window stays the same
+	auto asleep = []() { return false; };
+	auto d = decide(index, cmds, now, false, asleep);
+	BOOST_CHECK(d.power_off && !d.warming_up);
+	BOOST_CHECK(to_iso_string(d.wake_up_at) == "20190219T160000");
+	BOOST_CHECK(to_iso_string(d.alarm_at) == "20190219T155000");
+	BOOST_CHECK(d.power_off_cmd == "/usr/sbin/rtcwake -m off -s 11208");
+
+	// in the lead it stays up without asking CheckStayAwake
+	bool asked = false;
+	auto t = boost::posix_time::time_from_string("2019-02-19 15:50:00");
+	d = decide(index, cmds, t, false,
+			   [&]()
+			   {
+				   asked = true;
+				   return false;
+			   });
+	BOOST_CHECK(d.warming_up && !d.power_off && !asked);
+
+	// the window with its own lead
+	t = boost::posix_time::time_from_string("2019-02-20 02:00:00");
+	d = decide(index, cmds, t, false, asleep);
+	BOOST_CHECK(to_iso_string(d.alarm_at) == "20190220T093500");
+}
+
+BOOST_AUTO_TEST_CASE(warm_up_test)
+{
+	auto dir = make_temp_dir();
+	std::system(("mkdir -p " + dir + "/data/sub").c_str());
+	write_file(dir + "/data/a", "aaaa");
+	write_file(dir + "/data/sub/b", "bb");
+	write_file(dir + "/single", "c");
+	write_file(dir + "/hot.list", "# hot files\n" + dir + "/data\n  " + dir +
+									  "/single \n\n" + dir + "/missing\n");
+
+	std::ifstream ifs(dir + "/hot.list");
+	auto paths = read_warm_up_manifest(ifs);
+	BOOST_REQUIRE(paths.size() == 3);
+	BOOST_CHECK(paths[1] == dir + "/single");
+
+	auto r = warm_up(paths);
+	BOOST_CHECK(r.files == 3 && r.bytes == 7 && r.missing == 1);
+
+	// once until it powered down again
+	cmd_t cmds;
+	cmds.warm_up = dir + "/hot.list";
+	auto marker = dir + "/run/warmed-up";
+	run_trace trace;
+	BOOST_CHECK(warm_up_once(cmds, marker, trace));
+	BOOST_CHECK(is_warmed_up(marker));
+	BOOST_CHECK(!warm_up_once(cmds, marker, trace));
+	forget_warm_up(marker);
+	BOOST_CHECK(warm_up_once(cmds, marker, trace));
+}
+
+BOOST_AUTO_TEST_CASE(status_test)
+{
+	std::istringstream iss(test_schedule);
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	auto cmds = read_schedule(back_inserter, iss, now);
+	std::sort(sched.begin(), sched.end());
+	week_bitmap index(sched.begin(), sched.end(), get_week_start(now));
+
+	auto d = decide(index, cmds, now, false, []() { return false; });
+	std::vector<probe_result_t> probes(1);
+	probes[0].text = std::string(100, 'x');
+	probes[0].count = 2;
+	auto s = make_status(index, cmds, now, d, probes);
+	BOOST_CHECK(!s.scheduled_on && s.power_off);
+	BOOST_CHECK(s.next_on == local_epoch(now + seconds(11808)));
+	BOOST_CHECK(s.next_off - s.next_on == 9 * 3600);
+	BOOST_CHECK(s.next_wake == s.next_on);
+	BOOST_CHECK(s.probe_count == 1 && s.probes[0].count == 2);
+	BOOST_CHECK(std::string(s.probes[0].text) == std::string(63, 'x'));
+
+	// nothing there yet
+	auto path = make_temp_dir() + "/run/status";
+	status_t read;
+	BOOST_CHECK(!status_reader(path).read(read));
+
+	status_writer writer(path);
+	BOOST_REQUIRE(writer.is_open());
+	BOOST_CHECK(writer.publish(s));
+	BOOST_CHECK(writer.publish(s));
+	status_reader reader(path);
+	BOOST_REQUIRE(reader.read(read));
+	BOOST_CHECK(read.generation == 2);
+	BOOST_CHECK(read.next_on == s.next_on && read.power_off);
+
+	// a reader never sees half of a status
+	std::atomic<bool> done(false);
+	std::thread t(
+		[&]()
+		{
+			status_t w = s;
+			for (std::int64_t i = 0; i < 20000; ++i)
+			{
+				w.next_off = w.next_on = w.next_wake = i;
+				writer.publish(w);
+			}
+			done = true;
+		});
+	unsigned torn = 0;
+	while (!done)
+	{
+		if (reader.read(read) && read.generation > 2 &&
+			(read.next_off != read.next_on || read.next_on != read.next_wake))
+		{
+			++torn;
+		}
+	}
+	t.join();
+	BOOST_CHECK(torn == 0);
+	BOOST_CHECK(reader.read(read) && read.generation == 20002);
+}
+
+BOOST_AUTO_TEST_CASE(learn_test)
+{
+	auto tuesday = boost::posix_time::time_from_string("2019-02-19 16:05:00");
+	BOOST_CHECK(minute_of_week(tuesday) == 1440 + 16 * 60 + 5);
+
+	// the machine was up all week for four weeks. It was needed tuesday
+	// 16:00-18:00 each week and sunday 23:30-monday 00:30 in one of them.
+	auto path = make_temp_dir() + "/lib/activity";
+	std::int64_t at = 1000000;
+	{
+		activity_histogram h(path, true);
+		BOOST_REQUIRE(h.is_open());
+		for (int week = 0; week < 4; ++week)
+		{
+			for (std::size_t m = 0; m < week_bitmap::minutes_per_week; m += 5)
+			{
+				bool active = (m >= 2400 && m < 2520) ||
+							  (week == 0 && (m < 30 || m >= 10050));
+				BOOST_CHECK(h.record(m, active, at + m * 60));
+			}
+			at += 7 * 24 * 3600;
+		}
+	}
+
+	activity_histogram h(path, false);
+	BOOST_REQUIRE(h.is_open());
+	auto slots = h.slots(at);
+	BOOST_REQUIRE(slots.size() == week_bitmap::minutes_per_week);
+	BOOST_CHECK(slots[1].seen == 0);
+
+	// the older weeks count less
+	BOOST_CHECK(slots[2400].active == slots[2400].seen);
+	BOOST_CHECK(slots[0].seen > 2.6 && slots[0].seen < 2.7);
+	BOOST_CHECK(slots[0].active > 0.49 && slots[0].active < 0.51);
+
+	// the tuesday is enough for 80%, all of it takes sunday night as well
+	auto p = propose_schedule(slots, 0.8);
+	BOOST_REQUIRE(p.windows.size() == 1);
+	BOOST_CHECK(p.on_minutes == 120);
+	std::ostringstream oss;
+	print_proposal(oss, p, 0.8);
+	BOOST_CHECK(oss.str().find("\nTue:16:00-Tue:18:00\n") !=
+				std::string::npos);
+
+	p = propose_schedule(slots, 1.0);
+	oss.str("");
+	print_proposal(oss, p, 1.0);
+	BOOST_CHECK(oss.str().find("# covers 100.0% with 3:00 on hours a week") !=
+				std::string::npos);
+
+	// in the grammar of the schedule
+	std::istringstream iss(oss.str());
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	read_schedule(back_inserter, iss, tuesday);
+	std::sort(sched.begin(), sched.end());
+	week_bitmap index(sched.begin(), sched.end(), get_week_start(tuesday));
+	BOOST_CHECK(get_state(index, tuesday));
+	BOOST_CHECK(
+		get_state(index, boost::posix_time::time_from_string("2019-02-24 23:45:00")));
+	BOOST_CHECK(
+		get_state(index, boost::posix_time::time_from_string("2019-02-18 00:15:00")));
+	BOOST_CHECK(
+		!get_state(index, boost::posix_time::time_from_string("2019-02-18 00:30:00")));
+
+	BOOST_CHECK(propose_schedule(std::vector<activity_slot_t>(), 1.0)
+					.windows.empty());
+}
+
+BOOST_AUTO_TEST_CASE(instance_lock_test)
+{
+	lock_policy_t policy;
+	BOOST_CHECK(parse_lock_policy("takeover", policy) &&
+				policy == lock_policy_t::takeover);
+	BOOST_CHECK(!parse_lock_policy("steal", policy));
+
+	// flock() is per open file, two locks conflict in one process as well
+	auto path = make_temp_dir() + "/run/lock";
+	std::unique_ptr<instance_lock> first(new instance_lock(path));
+	std::string msg;
+	BOOST_REQUIRE(first->acquire(lock_options_t(), msg));
+	BOOST_CHECK(msg.empty());
+	BOOST_CHECK(first->holder().pid == ::getpid());
+
+	instance_lock second(path);
+	BOOST_CHECK(!second.acquire(lock_options_t(), msg));
+	BOOST_CHECK(msg.find("lock: pid " + std::to_string(::getpid()) +
+						 " holds " + path + " for ") == 0);
+	BOOST_CHECK(msg.find(", skipping this run") != std::string::npos);
+
+	lock_options_t wait;
+	wait.policy = lock_policy_t::wait;
+	wait.timeout = boost::posix_time::milliseconds(200);
+	auto start = std::chrono::steady_clock::now();
+	BOOST_CHECK(!second.acquire(wait, msg));
+	BOOST_CHECK(std::chrono::steady_clock::now() - start >=
+				std::chrono::milliseconds(200));
+	BOOST_CHECK(msg.find(", gave up after 0.") != std::string::npos);
+
+	first.reset();
+	BOOST_CHECK(second.acquire(wait, msg) && second.locked());
+	BOOST_CHECK(second.holder().pid == ::getpid());
+
+	// a hanging run is terminated
+	auto other = make_temp_dir() + "/lock";
+	int ready[2];
+	BOOST_REQUIRE(::pipe(ready) == 0);
+	pid_t child = ::fork();
+	BOOST_REQUIRE(child >= 0);
+	if (child == 0)
+	{
+		instance_lock hanging(other);
+		char c = hanging.try_lock() ? '1' : '0';
+		if (::write(ready[1], &c, 1) == 1)
+		{
+			::pause();
+		}
+		::_exit(1);
+	}
+	char c = 0;
+	BOOST_REQUIRE(::read(ready[0], &c, 1) == 1 && c == '1');
+	::close(ready[0]);
+	::close(ready[1]);
+
+	instance_lock taker(other);
+	lock_options_t takeover;
+	takeover.policy = lock_policy_t::takeover;
+	takeover.timeout = seconds(5);
+	BOOST_CHECK(taker.acquire(takeover, msg));
+	BOOST_CHECK(msg.find("lock: pid " + std::to_string(child)) == 0);
+	BOOST_CHECK(msg.find(", took it over after ") != std::string::npos);
+	int status = 0;
+	BOOST_CHECK(::waitpid(child, &status, 0) == child &&
+				WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+
+	// a pid in the file that is another program is not signaled, the
+	// takeover waits for the lock then
+	pid_t stranger = ::fork();
+	BOOST_REQUIRE(stranger >= 0);
+	if (stranger == 0)
+	{
+		::execlp("sleep", "sleep", "30", static_cast<char*>(nullptr));
+		::_exit(1);
+	}
+	for (std::string comm; comm != "sleep";)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		std::ifstream ifs("/proc/" + std::to_string(stranger) + "/comm");
+		std::getline(ifs, comm);
+	}
+	write_file(other, std::to_string(stranger) + " " +
+						  std::to_string(std::time(nullptr)) + "\n");
+	instance_lock late(other);
+	takeover.timeout = boost::posix_time::milliseconds(200);
+	BOOST_CHECK(!late.acquire(takeover, msg));
+	BOOST_CHECK(msg.find(", can not take it over") != std::string::npos);
+	BOOST_CHECK(::waitpid(stranger, &status, WNOHANG) == 0);
+	::kill(stranger, SIGKILL);
+	::waitpid(stranger, &status, 0);
+}
+
+BOOST_AUTO_TEST_CASE(wake_alarm_test)
+{
+	std::istringstream iss("WakeAlarm=rtc0 state=mem\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto cmds = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_CHECK(cmds.wake_alarm.rtc == "rtc0");
+	BOOST_CHECK(cmds.wake_alarm.state == "mem");
+
+	for (const auto& bad :
+		 {"WakeAlarm=", "WakeAlarm=../rtc0", "WakeAlarm=rtc0 state=off",
+		  "WakeAlarm=rtc0 mode=mem", "WakeAlarm=rtc0 state=mem x"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	// no %d needed, with a state there is no command
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:00:00");
+	auto wake = now + hours(2);
+	BOOST_CHECK(build_power_off_command(wake, cmds, now).empty());
+	cmds.wake_alarm.state.clear();
+	cmds.power_down = "systemctl poweroff";
+	BOOST_CHECK(build_power_off_command(wake, cmds, now) ==
+				"systemctl poweroff");
+	cmds.power_down.clear();
+	BOOST_CHECK_THROW(build_power_off_command(wake, cmds, now),
+					  std::runtime_error);
+
+	// a fake /sys: the alarm is set and read back, then the state written
+	auto dir = make_temp_dir();
+	std::system(("mkdir -p " + dir + "/class/rtc/rtc0 " + dir + "/power")
+					.c_str());
+	write_file(dir + "/class/rtc/rtc0/wakealarm", "");
+	write_file(dir + "/power/state", "");
+	wake_alarm_context_t ctx;
+	ctx.sys_root = dir;
+
+	cmds.wake_alarm.state = "mem";
+	decision_t d;
+	d.power_off = true;
+	d.wake_up_at = wake;
+	d.alarm_at = wake;
+	power_down(d, cmds, ctx);
+
+	auto read = [](const std::string& path)
+	{
+		std::ifstream ifs(path);
+		std::string s;
+		std::getline(ifs, s);
+		return s;
+	};
+	BOOST_CHECK(read(dir + "/class/rtc/rtc0/wakealarm") ==
+				std::to_string(local_epoch(wake)));
+	BOOST_CHECK(read(dir + "/power/state") == "mem");
+
+	// no such RTC: nothing is powered down
+	write_file(dir + "/power/state", "");
+	cmds.wake_alarm.rtc = "rtc1";
+	BOOST_CHECK_THROW(power_down(d, cmds, ctx), std::runtime_error);
+	BOOST_CHECK(read(dir + "/power/state").empty());
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(daemon_test)
+{
+	// a window in three days and a WakeAlarm= RTC that is not there
+	static const char* days[] = {"Sun", "Mon", "Tue", "Wed",
+								 "Thu", "Fri", "Sat"};
+	std::string day = days[(rtc::now().date().day_of_week() + 3) % 7];
+	auto dir = make_temp_dir();
+	std::system(("mkdir -p " + dir + "/sys/power").c_str());
+	write_file(dir + "/sys/power/state", "");
+	write_file(dir + "/schedule", "WakeAlarm=rtc0 state=mem\n"
+								  "CheckStayAwake=echo 0\n" +
+									  day + ":10:00-" + day + ":11:00\n");
+
+	daemon_options opts;
+	opts.schedule_path = dir + "/schedule";
+	opts.wake_alarm.sys_root = dir + "/sys";
+	schedule_daemon daemon(opts);
+
+	// the failed power down is asked again after recheck, every time
+	for (int i = 0; i < 2; ++i)
+	{
+		auto before = rtc::now();
+		time_point_t next;
+		BOOST_CHECK_NO_THROW(next = daemon.step());
+		BOOST_CHECK(next >= before + opts.recheck &&
+					next <= rtc::now() + opts.recheck + seconds(1));
+	}
+
+	std::ifstream ifs(dir + "/sys/power/state");
+	std::string state;
+	BOOST_CHECK(!std::getline(ifs, state) || state.empty());
+
+	// a power down that returns in the WakeLead= time of the next window
+	// is decided again right away, then it is woken up early
+	auto now = rtc::now();
+	auto on = time_point_t(now.date(),
+						   hours(now.time_of_day().hours()) +
+							   minutes(now.time_of_day().minutes() + 2));
+	auto window = [&](time_point_t t)
+	{
+		char buf[16];
+		std::snprintf(buf, sizeof(buf), "%s:%02d:%02d",
+					  days[t.date().day_of_week()],
+					  static_cast<int>(t.time_of_day().hours()),
+					  static_cast<int>(t.time_of_day().minutes()));
+		return std::string(buf);
+	};
+	auto lead = (on - now - seconds(1)).total_seconds();
+	write_file(dir + "/schedule",
+			   "PowerDown=sleep 2; : %d\nCheckStayAwake=echo 0\nWakeLead=" +
+				   std::to_string(lead) + "s\n" + window(on) + "-" +
+				   window(on + minutes(1)) + "\n");
+	opts.wake_alarm = wake_alarm_context_t();
+	schedule_daemon resumed(opts);
+	auto next = resumed.step();
+	BOOST_CHECK(next <= rtc::now());
+	BOOST_CHECK(resumed.step() == on);
+	std::system(("rm -rf " + dir).c_str());
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(idle_test)
+{
+	std::istringstream iss("StayAwakeIf=busy cpu=20% disk=2M net=500K "
+						   "window=1m interval=5s gap=2m\n"
+						   "StayAwakeIf=busy\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto cmds = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_REQUIRE(cmds.probes.size() == 2);
+	auto probe = cmds.probes[0];
+	BOOST_CHECK(probe.kind == probe_spec_t::kind_t::busy);
+	BOOST_CHECK(probe.cpu_percent == 20 && probe.disk_rate == 2 << 20 &&
+				probe.net_rate == 500 << 10);
+	BOOST_CHECK(probe.window == minutes(1) && probe.interval == seconds(5) &&
+				probe.gap == minutes(2));
+	BOOST_CHECK(cmds.probes[1].window == minutes(5) &&
+				cmds.probes[1].gap == minutes(15) &&
+				cmds.probes[1].cpu_percent == 10);
+
+	for (const auto& bad :
+		 {"StayAwakeIf=busy cpu=20", "StayAwakeIf=busy cpu=101%",
+		  "StayAwakeIf=busy net=fast", "StayAwakeIf=busy interval=0",
+		  "StayAwakeIf=busy window=1h interval=1s",
+		  "StayAwakeIf=busy window=5s interval=10s",
+		  "StayAwakeIf=busy gap=5s interval=10s"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	// a fake /proc. Partitions, loop and stacked devices and lo dont count.
+	auto dir = make_temp_dir();
+	std::system(("mkdir -p " + dir + "/proc/net").c_str());
+	auto set_counters =
+		[&](unsigned busy, unsigned idle, unsigned sectors, unsigned bytes)
+	{
+		write_file(dir + "/proc/stat",
+				   "cpu  " + std::to_string(busy) + " 0 0 " +
+					   std::to_string(idle) + " 0 0 0 0 0 0\n"
+											  "cpu0 1 0 0 1 0 0 0 0 0 0\n");
+		auto disk = [&](const std::string& name, unsigned n)
+		{
+			return "   8 0 " + name + " 1 0 " + std::to_string(n) +
+				   " 0 1 0 " + std::to_string(n) + " 0 0 0 0\n";
+		};
+		write_file(dir + "/proc/diskstats",
+				   disk("sda", sectors) + disk("sda1", sectors) +
+					   disk("loop0", 9999) + disk("dm-0", 9999) +
+					   disk("nvme0n1", 1) + disk("nvme0n1p1", 1));
+		write_file(dir + "/proc/net/dev",
+				   "Inter-|   Receive  |  Transmit\n"
+				   " face |bytes packets errs drop fifo frame compressed "
+				   "multicast|bytes\n"
+				   "    lo: 99999 1 0 0 0 0 0 0 99999 1 0 0 0 0 0 0\n"
+				   "  eth0: " +
+					   std::to_string(bytes) + " 1 0 0 0 0 0 0 " +
+					   std::to_string(bytes) + " 1 0 0 0 0 0 0\n");
+	};
+	set_counters(100, 900, 10, 1000);
+	auto c = read_system_counters(dir + "/proc");
+	BOOST_CHECK(c.cpu_busy == 100 && c.cpu_total == 1000);
+	BOOST_CHECK(c.disk_bytes == (10 + 10 + 1 + 1) * 512);
+	BOOST_CHECK(c.net_bytes == 2000);
+
+	// a clock that runs in the sleeps, 5% cpu in each step
+	std::int64_t now = 1000000;
+	unsigned sleeps = 0;
+	unsigned cpu = 100;
+	unsigned idle = 900;
+	unsigned net = 1000;
+	auto clock = [&]() { return now; };
+	auto sleep = [&](std::int64_t ms)
+	{
+		now += ms;
+		++sleeps;
+		cpu += 5;
+		idle += 95;
+		set_counters(cpu, idle, 10, net);
+	};
+	auto watch = [&](const probe_spec_t& p, duration_t timeout)
+	{ return watch_idle(p, dir + "/proc", dir + "/run/idle", timeout, clock,
+						sleep); };
+
+	// a new ring watches the whole window
+	auto r = watch(probe, seconds(60));
+	BOOST_CHECK(r.count == 0 && sleeps == 12);
+	BOOST_CHECK(r.output == "cpu 5.0% disk 0 B/s net 0 B/s\n");
+
+	// the next run adds a sample to the kept ones
+	now += 30000;
+	r = watch(probe, seconds(60));
+	BOOST_CHECK(r.count == 0 && sleeps == 12);
+	idle_ring ring;
+	ring.load(dir + "/run/idle");
+	BOOST_CHECK(ring.size() == 8 && ring.back().at == now);
+
+	// one right after it replaces the last sample
+	now += 100;
+	r = watch(probe, seconds(60));
+	BOOST_CHECK(r.count == 0 && sleeps == 12);
+	ring.load(dir + "/run/idle");
+	BOOST_CHECK(ring.size() == 8 && ring.back().at == now);
+
+	// a burst in between is seen, though the counters are quiet now
+	net += 10000000;
+	set_counters(cpu, idle, 10, net);
+	now += 30000;
+	r = watch(probe, seconds(60));
+	BOOST_CHECK(r.count == 1 && sleeps == 12);
+	now += 30000;
+	r = watch(probe, seconds(60));
+	BOOST_CHECK(r.count == 1);
+	BOOST_CHECK(r.output.find("net 666667 B/s") != std::string::npos);
+
+	// after a gap longer than gap= it watches the window again, but not
+	// longer than the timeout. The next run goes on from there.
+	now += 180000;
+	r = watch(probe, seconds(20));
+	BOOST_CHECK(r.count == 1 && sleeps == 16);
+	BOOST_CHECK(r.output ==
+				"cpu 5.0% disk 0 B/s net 0 B/s, 20s of 60s watched\n");
+	now += 60000;
+	r = watch(probe, seconds(20));
+	BOOST_CHECK(r.count == 0 && sleeps == 16);
+
+	// the runs from cron every 10 minutes with the defaults judge the step
+	// between them and dont block
+	auto every10m = cmds.probes[1];
+	auto from = sleeps;
+	r = watch(every10m, seconds(60));
+	BOOST_CHECK(r.count == 1 && sleeps == from + 6);
+	for (int run = 0; run < 3; ++run)
+	{
+		now += 600000;
+		cpu += 300;
+		idle += 6000;
+		set_counters(cpu, idle, 10, net);
+		r = watch(every10m, seconds(60));
+		BOOST_CHECK(r.count == 0 && sleeps == from + 6);
+	}
+	// 4.8% over the step counts twice in a window of half of it
+	BOOST_CHECK(r.output == "cpu 9.5% disk 0 B/s net 0 B/s\n");
+
+	// a minute of 8 MB/s to the disk in the step is 0.8 MB/s over all of
+	// it, but 1.6 MB/s in the window
+	now += 600000;
+	cpu += 100;
+	idle += 6000;
+	set_counters(cpu, idle, 10 + 468750, net);
+	r = watch(every10m, seconds(60));
+	BOOST_CHECK(r.count == 1 && sleeps == from + 6);
+	BOOST_CHECK(r.output == "cpu 3.3% disk 1600000 B/s net 0 B/s\n");
+
+	// and see the load in between
+	now += 600000;
+	cpu += 3000;
+	idle += 6000;
+	set_counters(cpu, idle, 10 + 468750, net);
+	r = watch(every10m, seconds(60));
+	BOOST_CHECK(r.count == 1 && sleeps == from + 6);
+
+	// the ring keeps the newest samples
+	ring.clear();
+	for (std::int64_t i = 0; i < 600; ++i)
+	{
+		ring.push({i, system_counters_t()});
+	}
+	BOOST_CHECK(ring.size() == idle_ring::capacity && ring.front().at == 88);
+	ring.prune(500);
+	BOOST_CHECK(ring.size() == 100 && ring.front().at == 500);
+}
+
+BOOST_AUTO_TEST_CASE(probes_test)
+{
+	using kind_t = probe_spec_t::kind_t;
+
+	// the syntax
+	std::istringstream iss("StayAwakeIf=tcp-established port=445,2049\n"
+						   "StayAwakeIf=logged-in-users\n"
+						   "StayAwakeIf=process name=rsync,borg\n");
+	std::vector<action_t> sched;
+	std::back_insert_iterator<decltype(sched)> back_inserter(sched);
+	auto cmds = read_schedule(back_inserter, iss, rtc::now());
+	BOOST_REQUIRE(cmds.probes.size() == 3);
+	BOOST_CHECK(cmds.probes[0].kind == kind_t::tcp_established);
+	BOOST_CHECK((cmds.probes[0].ports == std::vector<unsigned>{445, 2049}));
+	BOOST_CHECK(cmds.probes[1].kind == kind_t::logged_in_users);
+	BOOST_CHECK(cmds.probes[2].kind == kind_t::process);
+	BOOST_CHECK((cmds.probes[2].names ==
+				 std::vector<std::string>{"rsync", "borg"}));
+
+	for (const auto& bad : {"StayAwakeIf=", "StayAwakeIf=tcp-established port=",
+							"StayAwakeIf=tcp-established port=70000",
+							"StayAwakeIf=process", "StayAwakeIf=process port=1",
+							"StayAwakeIf=unknown"})
+	{
+		std::istringstream iss(bad);
+		BOOST_CHECK_THROW(read_schedule(back_inserter, iss, rtc::now()),
+						  parse_error);
+	}
+
+	// a fake /proc
+	auto dir = make_temp_dir();
+	probe_context_t ctx;
+	ctx.proc_root = dir + "/proc";
+	ctx.utmp_path = dir + "/utmp";
+	std::system(("mkdir -p " + dir + "/proc/net " + dir + "/proc/17 " + dir +
+				 "/proc/42 " + dir + "/proc/self")
+					.c_str());
+
+	// 445 established, 445 TIME_WAIT, 22 established
+	write_file(dir + "/proc/net/tcp",
+			   "  sl  local_address rem_address   st tx_queue rx_queue\n"
+			   "   0: 0100007F:01BD 0100007F:D2A4 01 00000000:00000000\n"
+			   "   1: 0100007F:01BD 0100007F:D2A5 06 00000000:00000000\n"
+			   "   2: 0100007F:0016 0100007F:D2A6 01 00000000:00000000\n");
+	// 2049 established, 2049 listening
+	write_file(dir + "/proc/net/tcp6",
+			   "  sl  local_address                         remote_address "
+			   "st\n"
+			   "   0: 00000000000000000000000001000000:0801 "
+			   "00000000000000000000000001000000:C350 01\n"
+			   "   1: 00000000000000000000000000000000:0801 "
+			   "00000000000000000000000000000000:0000 0A\n");
+	write_file(dir + "/proc/17/comm", "rsync\n");
+	write_file(dir + "/proc/42/comm", "bash\n");
+	write_file(dir + "/proc/self/comm", "rsync\n");
+
+	BOOST_CHECK(evaluate_probe(cmds.probes[0], ctx).count == 2);
+	BOOST_CHECK(evaluate_probe(cmds.probes[2], ctx).count == 1);
+
+	probe_spec_t any;
+	BOOST_REQUIRE(detail::parse_probe("tcp-established", any));
+	BOOST_CHECK(evaluate_probe(any, ctx).count == 3);
+
+	// utmp: one logged in user, one dead entry
+	{
+		struct utmp entries[2];
+		std::memset(entries, 0, sizeof(entries));
+		entries[0].ut_type = USER_PROCESS;
+		entries[1].ut_type = DEAD_PROCESS;
+		write_file(ctx.utmp_path,
+				   std::string(reinterpret_cast<const char*>(entries),
+							   sizeof(entries)));
+	}
+	BOOST_CHECK(evaluate_probe(cmds.probes[1], ctx).count == 1);
+
+	// only built in probes: no process gets started
+	cmd_t only_probes;
+	only_probes.probes.push_back(cmds.probes[2]);
+	BOOST_CHECK(check_stay_awake(only_probes, rtc::now(), ctx));
+	write_file(dir + "/proc/17/comm", "sleep\n");
+	BOOST_CHECK(!check_stay_awake(only_probes, rtc::now(), ctx));
+
+	// then CheckStayAwake decides
+	only_probes.check_stay_awake = {"echo 1"};
+	BOOST_CHECK(check_stay_awake(only_probes, rtc::now(), ctx));
+
+	// the results for the trace: the probe and the command
+	auto results = run_stay_awake_checks(only_probes, ctx);
+	BOOST_REQUIRE(results.size() == 2);
+	BOOST_CHECK(results[0].count == 0);
+	BOOST_CHECK(results[1].text == "echo 1");
+	BOOST_CHECK(results[1].output == "1\n");
+	BOOST_CHECK(results[1].count == 1);
+
+	std::system(("rm -rf " + dir).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(trace_test)
+{
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+
+	run_trace trace;
+	trace.now = now;
+	std::istringstream iss(test_schedule);
+	auto c = compile_schedule(iss, now, trace);
+
+	std::vector<std::string> phases;
+	for (const auto& p : trace.phases())
+	{
+		phases.push_back(p.first);
+		BOOST_CHECK(p.second >= 0);
+	}
+	BOOST_CHECK((phases == std::vector<std::string>{"parse", "sort",
+													"validate", "index"}));
+	BOOST_CHECK(trace.entries == c.actions.size());
+
+	trace.decided = true;
+	trace.decision = decide(c.index, c.cmds, now, false, []() { return false; });
+	trace.next_wake = trace.decision.wake_up_at;
+
+	probe_result_t probe;
+	probe.text = "echo \"0\"";
+	probe.output = "0\n";
+	trace.probes.push_back(probe);
+
+	auto json = to_json(trace);
+	BOOST_CHECK(json.front() == '{' && json.back() == '}');
+	BOOST_CHECK(json.find('\n') == std::string::npos);
+	BOOST_CHECK(json.find("\"time\":\"2019-02-19T12:43:12\"") !=
+				std::string::npos);
+	BOOST_CHECK(json.find("\"power_off\":true") != std::string::npos);
+	BOOST_CHECK(json.find("\"next_wake\":\"2019-02-19T16:00:00\"") !=
+				std::string::npos);
+	BOOST_CHECK(json.find("\"probe\":\"echo \\\"0\\\"\",\"count\":0,"
+						  "\"cached\":false,\"output\":\"0\\n\"") !=
+				std::string::npos);
+	BOOST_CHECK(json.find("\"error\"") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(simulate_test)
+{
+	auto now = boost::posix_time::time_from_string("2019-02-19 12:43:12");
+	std::istringstream iss(test_schedule);
+	auto compiled = compile_schedule(iss, now);
+
+	simulation_options_t opts;
+	BOOST_REQUIRE(parse_time_point("2019-02-18", opts.from));
+	BOOST_REQUIRE(parse_time_point("2019-02-25T00:00", opts.to));
+	BOOST_CHECK(!parse_time_point("2019-02-31", opts.to) &&
+				!parse_time_point("yesterday", opts.to));
+
+	// a week later, the schedule repeats
+	opts.from += hours(7 * 24);
+	opts.to += hours(7 * 24);
+
+	stay_awake_script none;
+	auto r = simulate(compiled, opts, none);
+	BOOST_CHECK(r.wrong_wake_ups == 0);
+	BOOST_CHECK(r.power_cycles == 7);
+	BOOST_CHECK(r.stay_awake_ticks == 0);
+	BOOST_CHECK(r.on_time == hours(68) + minutes(25));
+	BOOST_REQUIRE(r.longest_gaps.size() == 3);
+	BOOST_CHECK(to_simple_string(r.longest_gaps[0].from) ==
+				"2019-Feb-25 01:00:00");
+	BOOST_CHECK(to_simple_string(r.longest_gaps[2].to) ==
+				"2019-Feb-28 16:00:00");
+
+	// CheckStayAwake keeps it up on wednesday from 01:00 until 03:00
+	std::istringstream script_text("# comment\n"
+								   "2019-02-27 00:30 1\n"
+								   "2019-02-27 03:00 0\n");
+	stay_awake_script script;
+	script.load(script_text);
+	BOOST_CHECK(script.output(opts.from) == "0\n");
+
+	r = simulate(compiled, opts, script);
+	BOOST_CHECK(r.wrong_wake_ups == 0);
+	BOOST_CHECK(r.power_cycles == 7);
+	BOOST_CHECK(r.stay_awake_ticks == 120);
+	BOOST_CHECK(r.on_time == hours(70) + minutes(25));
+
+	std::istringstream bad("2019-02-27 00:30\n");
+	BOOST_CHECK_THROW(script.load(bad), std::runtime_error);
+}